@@ -710,7 +710,7 @@ static void opDump(AsyncIoRoot & aio, Strings opFlags, Strings opArgs)
 
     FdSink sink(STDOUT_FILENO);
     std::string path = *opArgs.begin();
-    sink << dumpPath(path);
+    dumpPath(path, sink);
     sink.flush();
 }
 
@@ -938,10 +938,18 @@ static void opServe(AsyncIoRoot & aio, Strings opFlags, Strings opArgs)
                 break;
             }
 
-            case ServeProto::Command::DumpStorePath:
-                aio.blockOn(store->narFromPath(store->parseStorePath(readString(in))))
-                    ->drainInto(out);
+            case ServeProto::Command::DumpStorePath: {
+                auto path = store->parseStorePath(readString(in));
+                /* Send local files straight to the output descriptor. */
+                if (auto localFSStore = std::dynamic_pointer_cast<LocalFSStore>(store)) {
+                    if (!aio.blockOn(store->isValidPath(path)))
+                        throw Error("path '%s' does not exist in store", store->printStorePath(path));
+                    dumpPath(localFSStore->toRealPath(path), out);
+                } else {
+                    aio.blockOn(store->narFromPath(path))->drainInto(out);
+                }
                 break;
+            }
 
             case ServeProto::Command::ImportPaths: {
                 if (!writeAllowed) throw Error("importing paths is not allowed");
@@ -25,6 +25,28 @@ Bindings * EvalMemory::allocBindings(size_t capacity)
 }
 
 
+Bindings * EvalMemory::allocOverlay(Bindings & base, Bindings & updates)
+{
+    Bindings * under = &base;
+    if (under->isOverlay() && under->capacity_ == 0)
+        under = under->base_;
+    if (under->overlayDepth() >= Bindings::maxOverlayDepth)
+        under = &under->flat();
+
+    auto overlay = allocBindings(updates.size());
+    Bindings::Size shadowed = 0;
+    for (auto & attr : updates) {
+        overlay->push_back(attr);
+        if (under->get(attr.name))
+            shadowed++;
+    }
+    overlay->size_ += under->size_ - shadowed;
+    assert(overlay->isOverlay());
+    overlay->base_ = under;
+    return overlay;
+}
+
+
 Value & BindingsBuilder::alloc(Symbol name, PosIdx pos)
 {
     auto value = mem.allocValue();
@@ -41,10 +63,98 @@ Value & BindingsBuilder::alloc(std::string_view name, PosIdx pos)
 
 void Bindings::sort()
 {
+    assert(!isOverlay());
+    invalidateIndex();
     if (size_) std::sort(begin(), end());
 }
 
 
+void Bindings::buildIndex()
+{
+    const auto bits = indexBits();
+    const size_t slots = size_t(1) << bits;
+    const size_t mask = slots - 1;
+
+    auto index = static_cast<uint32_t *>(LIX_GC_MALLOC_ATOMIC(slots * sizeof(uint32_t)));
+    if (index == nullptr) {
+        throw std::bad_alloc();
+    }
+    std::fill_n(index, slots, 0);
+
+    // entries are attribute positions plus one so that zero marks empty slots.
+    // inserting in attribute order keeps the first of several equal names
+    // (which should not exist anyway) the one that lookups find, as with
+    // the binary search.
+    for (Size n = 0; n < size_; n++) {
+        auto slot = indexSlot(attrs[n].name, bits);
+        while (index[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        index[slot] = n + 1;
+    }
+
+    index_ = index;
+}
+
+
+Attr * Bindings::copyTo(Attr * out) const
+{
+    if (!isOverlay())
+        return std::copy(attrs, attrs + size_, out);
+
+    // copy the base, then merge our own attributes into it from the back.
+    // the result is exactly `size_` long, so the merge never overwrites base
+    // attributes it has not moved yet.
+    auto base = base_->copyTo(out);
+    auto end = out + size_;
+    auto own = attrs + capacity_;
+    while (own != attrs) {
+        if (base != out && own[-1].name < base[-1].name) {
+            *--end = *--base;
+        } else {
+            if (base != out && base[-1].name == own[-1].name)
+                --base;
+            *--end = *--own;
+        }
+    }
+    assert(end == base);
+    return out + size_;
+}
+
+
+void Bindings::flatten()
+{
+    auto flat = new (gcAllocBytes(sizeof(Bindings) + sizeof(Attr) * size_)) Bindings(size_);
+    flat->size_ = copyTo(flat->attrs) - flat->attrs;
+    flat->pos = pos;
+    nrFlattenedAttrs += size_;
+
+    base_ = flat;
+    capacity_ = 0;
+    lookups_ = 0;
+}
+
+
+Attr * Bindings::getOverlay(Symbol name, unsigned long & probes)
+{
+    // every lookup searches each overlay on the way down. once this one has
+    // been looked into as often as it has attributes, copying it is cheaper.
+    if (capacity_ != 0 && ++lookups_ >= std::max(size_, indexMinLookups))
+        flatten();
+
+    auto own = std::lower_bound(attrs, attrs + capacity_, name, [&](const Attr & a, Symbol name) {
+        probes++;
+        return a.name < name;
+    });
+    if (own != attrs + capacity_) {
+        probes++;
+        if (own->name == name)
+            return own;
+    }
+    return base_->get(name, probes);
+}
+
+
 Value & Value::mkAttrs(BindingsBuilder & bindings)
 {
     mkAttrs(bindings.finish());
@@ -5,6 +5,7 @@
 #include "lix/libexpr/symbol-table.hh"
 
 #include <algorithm>
+#include <bit>
 #include <optional>
 
 namespace nix {
@@ -44,6 +45,20 @@ static_assert(sizeof(Attr) == 2 * sizeof(uint32_t) + sizeof(Value *),
  * by its size and its capacity, the capacity being the number of Attr
  * elements allocated after this structure, while the size corresponds to
  * the number of elements already inserted in this structure.
+ *
+ * Lookups binary search the sorted attributes. Large sets that are looked
+ * up repeatedly additionally get an open-addressing hash index from symbol
+ * to attribute position, built lazily on the first lookup after the set
+ * has been searched `indexMinLookups` times.
+ *
+ * `a // b` with a much smaller `b` is an *overlay*: it stores only the
+ * attributes of `b` and refers to `a` for all others, so it costs time and
+ * memory in the size of `b`. get() looks through overlays. Everything that
+ * needs the attributes as one sorted array, i.e. iteration, find() and
+ * indexing, first flattens the overlay into a copy that it then forwards
+ * to. Overlays are also flattened once they have been looked into as many
+ * times as they have attributes, and chains of overlays are cut short at
+ * `maxOverlayDepth`.
  */
 class Bindings
 {
@@ -53,13 +68,128 @@ public:
 
     static Bindings EMPTY;
 
+    /**
+     * Sets smaller than this are never indexed. Binary search over a few
+     * dozen attributes touches only a handful of cache lines anyway.
+     */
+    static constexpr Size indexMinSize = 64;
+
+    /**
+     * Number of lookups into a large set before its index is built. Most
+     * large sets produced by `//` or `mapAttrs` are only looked into a few
+     * times before being discarded and would not amortize the index.
+     */
+    static constexpr Size indexMinLookups = 16;
+
+    /**
+     * Longest chain of overlays that lookups have to walk. `//` flattens its
+     * left operand first if it is this deep already.
+     */
+    static constexpr unsigned maxOverlayDepth = 8;
+
+    /**
+     * Number of attributes copied by flattening overlays. Overlays are
+     * flattened by whatever code iterates over them, which has no evaluator
+     * at hand to count this in, so this counts for all evaluators.
+     */
+    static inline unsigned long nrFlattenedAttrs = 0;
+
 private:
+    /**
+     * `size_` is the number of attributes in the set, `capacity_` the number
+     * of attributes stored after this structure. An overlay always has more
+     * attributes than it stores, which is how overlays are told apart from
+     * flat sets. A flattened overlay stores none.
+     */
     Size size_, capacity_;
+
+    /**
+     * Lookups into a flat set, towards building its index, or into an
+     * overlay, towards flattening it.
+     */
+    Size lookups_ = 0;
+
+    union {
+        /**
+         * The hash index of a flat set, if built.
+         */
+        uint32_t * index_ = nullptr;
+
+        /**
+         * The set an overlay refers to for the attributes it does not store:
+         * the left operand of `//` or, once flattened, the flat copy.
+         */
+        Bindings * base_;
+    };
+
     Attr attrs[0];
 
     Bindings(Size capacity) : size_(0), capacity_(capacity) { }
     Bindings(const Bindings & bindings) = delete;
 
+    /**
+     * log2 of the number of index slots, keeping the load factor under 1/2.
+     */
+    unsigned indexBits() const
+    {
+        return std::bit_width(size_) + 1;
+    }
+
+    static size_t indexSlot(Symbol name, unsigned bits)
+    {
+        // fibonacci hashing. symbol ids are dense small integers, so we must
+        // take the high bits of the product to spread them over the table.
+        return (uint64_t(name.id) * 0x9e3779b97f4a7c15ull) >> (64 - bits);
+    }
+
+    void buildIndex();
+
+    void invalidateIndex()
+    {
+        index_ = nullptr;
+        lookups_ = 0;
+    }
+
+    bool isOverlay() const { return size_ > capacity_; }
+
+    /**
+     * Number of overlays a lookup may have to look through.
+     */
+    unsigned overlayDepth() const
+    {
+        unsigned depth = 0;
+        for (auto b = this; b->isOverlay(); b = b->base_)
+            depth++;
+        return depth;
+    }
+
+    /**
+     * Copies the attributes of the set to `out`, in order. Returns the end
+     * of the copied attributes.
+     */
+    Attr * copyTo(Attr * out) const;
+
+    /**
+     * Turns an overlay into one that stores no attributes and refers to a
+     * flat copy of the set instead.
+     */
+    void flatten();
+
+    /**
+     * The flat set holding the attributes of this one, which is this one
+     * unless it is an overlay.
+     */
+    Bindings & flat()
+    {
+        if (!isOverlay()) [[likely]]
+            return *this;
+        if (capacity_ != 0)
+            flatten();
+        return *base_;
+    }
+
+    Attr * getOverlay(Symbol name, unsigned long & probes);
+
 public:
     Size size() const { return size_; }
 
@@ -73,28 +203,78 @@ public:
         attrs[size_++] = attr;
     }
 
+    /**
+     * Find the attribute called `name`, adding the number of attributes that
+     * were compared against `name` to `probes`.
+     *
+     * Sets are not looked into while they are being built, so push_back()
+     * and append() leave the index alone. sort() and alreadySorted() drop it
+     * once building is done.
+     */
+    iterator find(Symbol name, unsigned long & probes)
+    {
+        if (isOverlay()) [[unlikely]]
+            return flat().find(name, probes);
+
+        if (!index_ && size_ >= indexMinSize && ++lookups_ >= indexMinLookups) {
+            buildIndex();
+        }
+
+        if (index_) {
+            const auto bits = indexBits();
+            const size_t mask = (size_t(1) << bits) - 1;
+            for (size_t slot = indexSlot(name, bits);; slot = (slot + 1) & mask) {
+                const auto entry = index_[slot];
+                if (entry == 0) return end();
+                probes++;
+                if (attrs[entry - 1].name == name) return &attrs[entry - 1];
+            }
+        }
+
+        iterator i = std::lower_bound(begin(), end(), name, [&](const Attr & a, Symbol name) {
+            probes++;
+            return a.name < name;
+        });
+        if (i == end()) return i;
+        probes++;
+        return i->name == name ? i : end();
+    }
+
     iterator find(Symbol name)
     {
-        Attr key(name, 0);
-        iterator i = std::lower_bound(begin(), end(), key);
-        if (i != end() && i->name == name) return i;
-        return end();
+        unsigned long probes = 0;
+        return find(name, probes);
     }
 
-    Attr * get(Symbol name)
+    /**
+     * Like find(), but does not flatten overlays and returns nullptr if
+     * there is no attribute called `name`.
+     */
+    Attr * get(Symbol name, unsigned long & probes)
     {
-        Attr key(name, 0);
-        iterator i = std::lower_bound(begin(), end(), key);
-        if (i != end() && i->name == name) return &*i;
+        if (isOverlay()) [[unlikely]]
+            return getOverlay(name, probes);
+        iterator i = find(name, probes);
+        if (i != end()) return &*i;
         return nullptr;
     }
 
-    iterator begin() { return &attrs[0]; }
-    iterator end() { return &attrs[size_]; }
+    Attr * get(Symbol name)
+    {
+        unsigned long probes = 0;
+        return get(name, probes);
+    }
+
+    iterator begin() { return &flat().attrs[0]; }
+    iterator end()
+    {
+        auto & f = flat();
+        return &f.attrs[f.size_];
+    }
 
     Attr & operator[](Size pos)
     {
-        return attrs[pos];
+        return flat().attrs[pos];
     }
 
     void sort();
@@ -108,8 +288,8 @@ public:
     {
         std::vector<const Attr *> res;
         res.reserve(size_);
-        for (Size n = 0; n < size_; n++)
-            res.emplace_back(&attrs[n]);
+        for (auto & attr : const_cast<Bindings *>(this)->flat())
+            res.emplace_back(&attr);
         std::sort(res.begin(), res.end(), [&](const Attr * a, const Attr * b) {
             std::string_view sa = symbols[a->name], sb = symbols[b->name];
             return sa < sb;
@@ -118,6 +298,7 @@ public:
     }
 
     friend class EvalMemory;
+    friend class BindingsBuilder;
 };
 
 /**
@@ -168,6 +349,7 @@ public:
 
     Bindings * alreadySorted()
     {
+        bindings->invalidateIndex();
         return bindings;
     }
 };
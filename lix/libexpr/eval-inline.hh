@@ -71,6 +71,8 @@ void EvalState::forceValue(Value & v, const PosIdx pos)
     if (v.isThunk()) {
         Env * env = v.thunk.env;
         Expr & expr = *v.thunk.expr;
+        if (ctx.profiler)
+            ctx.profiler->thunkForced();
         try {
             v.mkBlackhole();
             //checkInterrupt();
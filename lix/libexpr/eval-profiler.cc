@@ -0,0 +1,162 @@
+#include "lix/libexpr/eval-profiler.hh"
+#include "lix/libexpr/attr-set.hh"
+#include "lix/libexpr/eval.hh"
+#include "lix/libexpr/pos-table.hh"
+#include "lix/libutil/error.hh"
+#include "lix/libutil/file-system.hh"
+
+#include <algorithm>
+#include <sstream>
+
+namespace nix {
+
+EvalProfiler::EvalProfiler(const EvalMemory & mem, Metric metric)
+    : mem(mem)
+    , metric(metric)
+    , nodes(1)
+    , stack{{.node = 0, .site = nullptr}}
+    , lastEvent(std::chrono::steady_clock::now())
+    , lastAllocated(allocatedBytes())
+{
+}
+
+EvalProfiler::Metric EvalProfiler::parseMetric(std::string_view name)
+{
+    if (name == "time") return Metric::Time;
+    if (name == "calls") return Metric::Calls;
+    if (name == "thunks") return Metric::Thunks;
+    if (name == "allocations") return Metric::Allocations;
+    throw UsageError(
+        "unknown evaluation profile metric '%s'; expected 'time', 'calls', 'thunks' or 'allocations'",
+        name
+    );
+}
+
+uint64_t EvalProfiler::allocatedBytes() const
+{
+    auto stats = mem.getStats();
+    return stats.nrEnvs * sizeof(Env) + stats.nrValuesInEnvs * sizeof(Value *)
+        + stats.nrListElems * sizeof(Value *) + stats.nrValues * sizeof(Value)
+        + stats.nrAttrsets * sizeof(Bindings) + stats.nrAttrsInAttrsets * sizeof(Attr);
+}
+
+void EvalProfiler::charge()
+{
+    auto & node = nodes[stack.back().node];
+
+    if (metric == Metric::Time) {
+        auto now = std::chrono::steady_clock::now();
+        node.time += now - lastEvent;
+        lastEvent = now;
+    } else if (metric == Metric::Allocations) {
+        auto allocated = allocatedBytes();
+        node.allocations += allocated - lastAllocated;
+        lastAllocated = allocated;
+    }
+}
+
+EvalProfiler::Scope EvalProfiler::enter(PosIdx pos)
+{
+    charge();
+
+    Site site{.pos = pos, .primOp = pos ? nullptr : stack.back().primOp};
+    auto & state = sites[site];
+    if (!state.active++) {
+        auto [it, inserted] = nodes[stack.back().node].children.try_emplace(site, nodes.size());
+        if (inserted) {
+            nodes.push_back(Node{.site = site});
+        }
+        state.node = it->second;
+    }
+
+    stack.push_back({.node = state.node, .site = &state});
+    nodes[state.node].calls++;
+    return Scope(this);
+}
+
+void EvalProfiler::exit()
+{
+    charge();
+    stack.back().site->active--;
+    stack.pop_back();
+}
+
+uint64_t EvalProfiler::valueOf(const Node & node) const
+{
+    switch (metric) {
+    case Metric::Time:
+        return std::chrono::duration_cast<std::chrono::microseconds>(node.time).count();
+    case Metric::Calls:
+        return node.calls;
+    case Metric::Thunks:
+        return node.thunks;
+    case Metric::Allocations:
+        return node.allocations;
+    }
+    abort();
+}
+
+void EvalProfiler::write(const Path & path, const PosTable & positions) const
+{
+    std::unordered_map<Site, std::string, SiteHash> labels;
+    auto label = [&](const Site & site) -> const std::string & {
+        auto [it, inserted] = labels.try_emplace(site);
+        if (inserted) {
+            if (site.pos) {
+                std::ostringstream str;
+                str << positions[site.pos];
+                it->second = str.str();
+            } else if (site.primOp) {
+                std::string_view name = site.primOp->name;
+                if (name.starts_with("__")) {
+                    name.remove_prefix(2);
+                }
+                it->second = "«builtins." + std::string(name) + "»";
+            } else {
+                /* Calls made by the evaluator itself, e.g. to apply the
+                   result of a file to automatic arguments. */
+                it->second = "«internal»";
+            }
+            /* ';' separates frames and the last space the value. */
+            std::replace(it->second.begin(), it->second.end(), ';', ',');
+        }
+        return it->second;
+    };
+
+    std::string out;
+
+    if (auto value = valueOf(nodes[0])) {
+        out += "«toplevel» " + std::to_string(value) + "\n";
+    }
+
+    /* Walk the tree depth-first, keeping the stack of the current node in
+       `frames` so that it doesn't have to be rebuilt for every line. */
+    std::string frames;
+    std::vector<std::pair<uint32_t, size_t>> todo;
+    for (auto & [site, child] : nodes[0].children) {
+        todo.emplace_back(child, 0);
+    }
+    while (!todo.empty()) {
+        auto [index, prefixLength] = todo.back();
+        todo.pop_back();
+        auto & node = nodes[index];
+
+        frames.resize(prefixLength);
+        if (prefixLength) {
+            frames += ';';
+        }
+        frames += label(node.site);
+
+        if (auto value = valueOf(node)) {
+            out += frames + " " + std::to_string(value) + "\n";
+        }
+
+        for (auto & [site, child] : node.children) {
+            todo.emplace_back(child, frames.size());
+        }
+    }
+
+    writeFile(path, out);
+}
+
+}
@@ -0,0 +1,201 @@
+#pragma once
+///@file
+
+#include "lix/libexpr/pos-idx.hh"
+#include "lix/libutil/types.hh"
+
+#include <chrono>
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace nix {
+
+class EvalMemory;
+class PosTable;
+struct PrimOp;
+
+/**
+ * Aggregating profiler for the evaluator, enabled by the `eval-profile-file`
+ * setting. Function calls are recorded in a tree keyed by the position of
+ * each call site, and every node accumulates the time spent, the thunks
+ * forced and the memory allocated directly in it. Calls that builtins make
+ * have no position and are keyed by the builtin instead. A call from a site
+ * that is already on the stack is charged to that frame, so recursion does
+ * not deepen the tree. The tree is written out in the collapsed-stack format
+ * read by `flamegraph.pl` and speedscope.
+ */
+class EvalProfiler
+{
+public:
+    enum class Metric { Time, Calls, Thunks, Allocations };
+
+    /**
+     * Ends the call started by enter() when destroyed.
+     */
+    class Scope
+    {
+        EvalProfiler * profiler;
+
+    public:
+        explicit Scope(EvalProfiler * profiler) : profiler(profiler) {}
+
+        Scope(Scope && other) noexcept : profiler(std::exchange(other.profiler, nullptr)) {}
+        Scope(const Scope &) = delete;
+        Scope & operator=(const Scope &) = delete;
+        Scope & operator=(Scope &&) = delete;
+
+        ~Scope()
+        {
+            if (profiler) {
+                profiler->exit();
+            }
+        }
+    };
+
+    /**
+     * Marks the end of the builtin call started by callPrimOp() when
+     * destroyed.
+     */
+    class PrimOpScope
+    {
+        EvalProfiler * profiler;
+
+    public:
+        explicit PrimOpScope(EvalProfiler * profiler) : profiler(profiler) {}
+
+        PrimOpScope(PrimOpScope && other) noexcept : profiler(std::exchange(other.profiler, nullptr)) {}
+        PrimOpScope(const PrimOpScope &) = delete;
+        PrimOpScope & operator=(const PrimOpScope &) = delete;
+        PrimOpScope & operator=(PrimOpScope &&) = delete;
+
+        ~PrimOpScope()
+        {
+            if (profiler) {
+                profiler->stack.back().primOp = nullptr;
+            }
+        }
+    };
+
+private:
+    /**
+     * A call site: the position of the call, or for calls without one, the
+     * builtin that made them.
+     */
+    struct Site
+    {
+        PosIdx pos;
+        const PrimOp * primOp = nullptr;
+
+        bool operator==(const Site &) const = default;
+    };
+
+    struct SiteHash
+    {
+        size_t operator()(const Site & site) const
+        {
+            return std::hash<PosIdx>{}(site.pos) ^ std::hash<const PrimOp *>{}(site.primOp);
+        }
+    };
+
+    struct Node
+    {
+        Site site;
+        std::unordered_map<Site, uint32_t, SiteHash> children;
+        uint64_t calls = 0;
+        uint64_t thunks = 0;
+        uint64_t allocations = 0;
+        std::chrono::nanoseconds time{0};
+    };
+
+    const EvalMemory & mem;
+    const Metric metric;
+
+    /**
+     * The call tree. The first node is the root, which collects everything
+     * that happens outside of any function call.
+     */
+    std::vector<Node> nodes;
+
+    struct SiteState
+    {
+        /**
+         * The node of the outermost call from this site that is in progress.
+         */
+        uint32_t node = 0;
+        /**
+         * The number of calls from this site that are in progress.
+         */
+        uint32_t active = 0;
+    };
+
+    /**
+     * Every site seen so far. Entries are never removed, so that entering a
+     * call does not allocate once its site is known.
+     */
+    std::unordered_map<Site, SiteState, SiteHash> sites;
+
+    struct Frame
+    {
+        uint32_t node;
+        SiteState * site;
+        /**
+         * The builtin this frame is currently running, which makes any calls
+         * that have no position.
+         */
+        const PrimOp * primOp = nullptr;
+    };
+
+    /**
+     * The calls in progress, starting with the root.
+     */
+    std::vector<Frame> stack;
+
+    std::chrono::steady_clock::time_point lastEvent;
+    uint64_t lastAllocated;
+
+    uint64_t allocatedBytes() const;
+
+    /**
+     * Charge the time and memory used since the previous event to the
+     * current node.
+     */
+    void charge();
+
+    void exit();
+
+    uint64_t valueOf(const Node & node) const;
+
+public:
+    EvalProfiler(const EvalMemory & mem, Metric metric);
+
+    static Metric parseMetric(std::string_view name);
+
+    [[nodiscard]]
+    Scope enter(PosIdx pos);
+
+    /**
+     * Record that the current call is running `primOp`, so that calls it
+     * makes without a position are attributed to it.
+     */
+    [[nodiscard]]
+    PrimOpScope callPrimOp(const PrimOp & primOp)
+    {
+        stack.back().primOp = &primOp;
+        return PrimOpScope(this);
+    }
+
+    void thunkForced()
+    {
+        nodes[stack.back().node].thunks++;
+    }
+
+    /**
+     * Write the profile in collapsed-stack format to `path`.
+     */
+    void write(const Path & path, const PosTable & positions) const;
+};
+
+}
@@ -110,7 +110,9 @@ std::string showType(const Value & v)
     #pragma GCC diagnostic push
     #pragma GCC diagnostic ignored "-Wswitch-enum"
     switch (v.internalType) {
-        case tString: return v.string.context ? "a string with context" : "a string";
+        case tString:
+        case tSizedString:
+            return v.string.context ? "a string with context" : "a string";
         case tPrimOp:
             return fmt("the built-in function '%s'", std::string(v.primOp->name));
         case tPrimOpApp:
@@ -167,6 +169,10 @@ void initLibExpr()
 
     GC_INIT();
 
+    /* Sized strings are referenced by a pointer just past their length
+       header, so the collector has to accept that one displacement. */
+    GC_register_displacement(sizeof(size_t));
+
     GC_set_oom_fn(oomHandler);
 
     /* Set the initial heap size to something fairly big (25% of
@@ -349,6 +355,11 @@ Evaluator::Evaluator(
 {
     stats.countCalls = getEnv("NIX_COUNT_CALLS").value_or("0") != "0";
 
+    if (!evalSettings.evalProfileFile.get().empty())
+        profiler = std::make_unique<EvalProfiler>(
+            mem, EvalProfiler::parseMetric(evalSettings.evalProfileMetric.get())
+        );
+
     static_assert(sizeof(Env) <= 16, "environment must be <= 16 bytes");
 }
 
@@ -837,8 +848,8 @@ inline Value * EvalState::lookupVar(Env * env, const ExprVar & var, bool noEval)
     auto * fromWith = var.fromWith;
     while (1) {
         forceAttrs(*env->values[0], fromWith->pos, "while evaluating the first subexpression of a with expression");
-        Bindings::iterator j = env->values[0]->attrs->find(var.name);
-        if (j != env->values[0]->attrs->end()) {
+        Attr * j = env->values[0]->attrs->get(var.name);
+        if (j) {
             if (ctx.stats.countCalls) ctx.stats.attrSelects[j->pos]++;
             return j->value;
         }
@@ -1345,8 +1356,8 @@ void ExprSelect::eval(EvalState & state, Env & env, Value & v)
 
             // Now that we know this is actually an attrset, try to find an attr
             // with the selected name.
-            Bindings::iterator attrIt = vCurrent->attrs->find(name);
-            if (attrIt == vCurrent->attrs->end()) {
+            Attr * attrIt = vCurrent->attrs->get(name, state.ctx.stats.nrLookupProbes);
+            if (!attrIt) {
 
                 // If we have an `or` provided default, then we'll use that.
                 if (def != nullptr) {
@@ -1398,10 +1409,9 @@ void ExprOpHasAttr::eval(EvalState & state, Env & env, Value & v)
 
     for (auto & i : attrPath) {
         state.forceValue(*vAttrs, getPos());
-        Bindings::iterator j;
+        Attr * j;
         auto name = getName(i, state, env);
-        if (vAttrs->type() != nAttrs ||
-            (j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
+        if (vAttrs->type() != nAttrs || !(j = vAttrs->attrs->get(name)))
         {
             v.mkBool(false);
             return;
@@ -1578,6 +1588,7 @@ void EvalState::callFunction(Value & fun, size_t nrArgs, Value * * args, Value &
     auto trace = evalSettings.traceFunctionCalls
         ? std::make_unique<FunctionCallTrace>(ctx.positions[pos])
         : nullptr;
+    auto profile = ctx.profiler ? ctx.profiler->enter(pos) : EvalProfiler::Scope(nullptr);
 
     forceValue(fun, pos);
 
@@ -1645,6 +1656,7 @@ void EvalState::callFunction(Value & fun, size_t nrArgs, Value * * args, Value &
 
                 ctx.stats.nrPrimOpCalls++;
                 if (ctx.stats.countCalls) ctx.stats.primOpCalls[fn->name]++;
+                auto inPrimOp = ctx.profiler ? ctx.profiler->callPrimOp(*fn) : EvalProfiler::PrimOpScope(nullptr);
 
                 try {
                     fn->fun(*this, vCur.determinePos(noPos), args, vCur);
@@ -1699,6 +1711,7 @@ void EvalState::callFunction(Value & fun, size_t nrArgs, Value * * args, Value &
                 auto fn = primOp->primOp;
                 ctx.stats.nrPrimOpCalls++;
                 if (ctx.stats.countCalls) ctx.stats.primOpCalls[fn->name]++;
+                auto inPrimOp = ctx.profiler ? ctx.profiler->callPrimOp(*fn) : EvalProfiler::PrimOpScope(nullptr);
 
                 try {
                     // TODO:
@@ -1791,8 +1804,8 @@ void EvalState::autoCallFunction(Bindings & args, Value & fun, Value & res)
     forceValue(fun, pos);
 
     if (fun.type() == nAttrs) {
-        auto found = fun.attrs->find(ctx.s.functor);
-        if (found != fun.attrs->end()) {
+        auto found = fun.attrs->get(ctx.s.functor);
+        if (found) {
             Value * v = ctx.mem.allocValue();
             callFunction(*found->value, fun, *v, pos);
             forceValue(*v, pos);
@@ -1908,6 +1921,13 @@ void ExprOpImpl::eval(EvalState & state, Env & env, Value & v)
 }
 
 
+/**
+ * `//` returns an overlay over its left operand instead of copying it once
+ * the left operand has this many times more attributes than the right one,
+ * as in `drv // { meta = ...; }`.
+ */
+static constexpr size_t opUpdateOverlayRatio = 8;
+
 void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
 {
     Value v1, v2;
@@ -1919,6 +1939,12 @@ void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
     if (v1.attrs->size() == 0) { v = v2; return; }
     if (v2.attrs->size() == 0) { v = v1; return; }
 
+    if (v2.attrs->size() * opUpdateOverlayRatio < v1.attrs->size()) {
+        v.mkAttrs(state.ctx.mem.allocOverlay(*v1.attrs, *v2.attrs));
+        state.ctx.stats.nrOpUpdateValuesCopied += v2.attrs->size();
+        return;
+    }
+
     auto attrs = state.ctx.buildBindings(v1.attrs->size() + v2.attrs->size());
 
     /* Merge the sets, preferring values from the second set.  Make
@@ -1987,6 +2013,11 @@ void EvalState::concatLists(Value & v, size_t nrLists, Value * * lists, const Po
 void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
 {
     NixStringContext context;
+    /* Context array of the only string part seen so far that has any
+       context. As long as no other part contributes context the result
+       can share this array instead of parsing it into `context` and
+       serialising it again. */
+    const char * * sharedContext = nullptr;
     std::vector<BackedStringView> s;
     size_t sSize = 0;
     NixInt n{0};
@@ -2005,13 +2036,12 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
        Value. allocating a GC'd string directly and moving it into a
        Value lets us avoid an allocation and copy. */
     const auto c_str = [&] {
-        char * result = gcAllocString(sSize + 1);
+        char * result = gcAllocSizedString(sSize);
         char * tmp = result;
         for (const auto & part : s) {
             memcpy(tmp, part->data(), part->size());
             tmp += part->size();
         }
-        *tmp = 0;
         return result;
     };
 
@@ -2055,6 +2085,19 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
                 state.ctx.errors.make<EvalError>("cannot add %1% to a float", showType(vTmp)).atPos(i_pos).withFrame(env, *this).debugThrow();
         } else {
             if (s.empty()) s.reserve(es.size());
+            if (firstType == nString && vTmp.type() == nString) {
+                if (vTmp.string.context && vTmp.string.context != sharedContext) {
+                    if (!sharedContext && context.empty()) {
+                        sharedContext = vTmp.string.context;
+                    } else {
+                        copyContext(vTmp, context);
+                    }
+                }
+                sSize += vTmp.str().size();
+                s.emplace_back(vTmp.str());
+                first = false;
+                continue;
+            }
             /* skip canonization of first path, which would only be not
             canonized in the first place if it's coming from a ./${foo} type
             path */
@@ -2076,8 +2119,15 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
         if (!context.empty())
             state.ctx.errors.make<EvalError>("a string that refers to a store path cannot be appended to a path").atPos(pos).withFrame(env, *this).debugThrow();
         v.mkPath(CanonPath(canonPath(str())));
-    } else
+    } else if (sharedContext && context.empty()) {
+        v.mkSizedString(c_str(), sharedContext);
+    } else {
+        if (sharedContext) {
+            for (const char * * p = sharedContext; *p; ++p)
+                context.insert(NixStringContextElem::parse(*p));
+        }
         v.mkStringMove(c_str(), context);
+    }
 }
 
 
@@ -2210,7 +2260,7 @@ bool EvalState::forceBool(Value & v, const PosIdx pos, std::string_view errorCtx
 
 bool EvalState::isFunctor(Value & fun)
 {
-    return fun.type() == nAttrs && fun.attrs->find(ctx.s.functor) != fun.attrs->end();
+    return fun.type() == nAttrs && fun.attrs->get(ctx.s.functor);
 }
 
 
@@ -2241,7 +2291,7 @@ std::string_view EvalState::forceString(Value & v, const PosIdx pos, std::string
                 showType(v),
                 ValuePrinter(*this, v, errorPrintOptions)
             ).atPos(pos).debugThrow();
-        return v.string.s;
+        return v.str();
     } catch (Error & e) {
         e.addTrace(ctx.positions[pos], errorCtx);
         throw;
@@ -2278,8 +2328,8 @@ std::string_view EvalState::forceStringNoCtx(Value & v, const PosIdx pos, std::s
 bool EvalState::isDerivation(Value & v)
 {
     if (v.type() != nAttrs) return false;
-    Bindings::iterator i = v.attrs->find(ctx.s.type);
-    if (i == v.attrs->end()) return false;
+    Attr * i = v.attrs->get(ctx.s.type);
+    if (!i) return false;
     forceValue(*i->value, i->pos);
     if (i->value->type() != nString) return false;
     return strcmp(i->value->string.s, "derivation") == 0;
@@ -2289,8 +2339,8 @@ bool EvalState::isDerivation(Value & v)
 std::optional<std::string> EvalState::tryAttrsToString(const PosIdx pos, Value & v,
     NixStringContext & context, bool coerceMore, bool copyToStore)
 {
-    auto i = v.attrs->find(ctx.s.toString);
-    if (i != v.attrs->end()) {
+    auto i = v.attrs->get(ctx.s.toString);
+    if (i) {
         Value v1;
         callFunction(*i->value, v, v1, pos);
         return coerceToString(pos, v1, context,
@@ -2314,7 +2364,7 @@ BackedStringView EvalState::coerceToString(
 
     if (v.type() == nString) {
         copyContext(v, context);
-        return std::string_view(v.string.s);
+        return v.str();
     }
 
     if (v.type() == nPath) {
@@ -2333,8 +2383,8 @@ BackedStringView EvalState::coerceToString(
         auto maybeString = tryAttrsToString(pos, v, context, coerceMore, copyToStore);
         if (maybeString)
             return std::move(*maybeString);
-        auto i = v.attrs->find(ctx.s.outPath);
-        if (i == v.attrs->end()) {
+        auto i = v.attrs->get(ctx.s.outPath);
+        if (!i) {
             ctx.errors.make<TypeError>(
                 "cannot coerce %1% to a string: %2%",
                 showType(v),
@@ -2528,7 +2578,7 @@ bool EvalState::eqValues(Value & v1, Value & v2, const PosIdx pos, std::string_v
             return v1.boolean == v2.boolean;
 
         case nString:
-            return strcmp(v1.string.s, v2.string.s) == 0;
+            return v1.str() == v2.str();
 
         case nPath:
             return strcmp(v1._path, v2._path) == 0;
@@ -2595,6 +2645,9 @@ bool Evaluator::fullGC() {
 
 void Evaluator::maybePrintStats()
 {
+    if (profiler)
+        profiler->write(evalSettings.evalProfileFile.get(), positions);
+
     bool showStats = getEnv("NIX_SHOW_STATS").value_or("0") != "0";
 
     if (showStats) {
@@ -2662,11 +2715,38 @@ void Evaluator::printStatistics()
     };
     topObj["nrOpUpdates"] = stats.nrOpUpdates;
     topObj["nrOpUpdateValuesCopied"] = stats.nrOpUpdateValuesCopied;
+    topObj["nrOpUpdateValuesFlattened"] = Bindings::nrFlattenedAttrs;
     topObj["nrThunks"] = stats.nrThunks;
     topObj["nrAvoided"] = stats.nrAvoided;
     topObj["nrLookups"] = stats.nrLookups;
+    topObj["nrLookupProbes"] = stats.nrLookupProbes;
     topObj["nrPrimOpCalls"] = stats.nrPrimOpCalls;
     topObj["nrFunctionCalls"] = stats.nrFunctionCalls;
+    topObj["genericClosure"] = {
+        {"keys", stats.nrGenericClosureKeys},
+        {"keyComparisons", stats.nrGenericClosureKeyComparisons},
+    };
+    {
+        auto cache = store->getPathInfoCacheStats();
+        topObj["pathInfoCache"] = {
+            {"size", cache.size},
+            {"hits", cache.hits},
+            {"misses", cache.misses},
+            {"evictions", cache.evictions},
+        };
+    }
+    {
+        auto transfers = getFileTransfer()->getStats();
+        topObj["fileTransfers"]["metadata"] = {
+            {"number", transfers.metadataTransfers},
+            {"queueWaitMs", transfers.metadataQueueWaitMs},
+        };
+        topObj["fileTransfers"]["bulk"] = {
+            {"number", transfers.bulkTransfers},
+            {"queueWaitMs", transfers.bulkQueueWaitMs},
+            {"maxQueueWaitMs", transfers.bulkMaxQueueWaitMs},
+        };
+    }
 #if HAVE_BOEHMGC
     topObj["gc"] = {
         {"heapSize", heapSize},
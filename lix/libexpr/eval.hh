@@ -3,6 +3,7 @@
 
 #include "lix/libexpr/attr-set.hh"
 #include "lix/libexpr/eval-error.hh"
+#include "lix/libexpr/eval-profiler.hh"
 #include "lix/libexpr/gc-alloc.hh"
 #include "lix/libutil/box_ptr.hh"
 #include "lix/libutil/generator.hh"
@@ -132,6 +133,7 @@ void initLibExpr();
 
 
 struct RegexCache;
+struct ReplaceStringsCache;
 
 struct DebugTrace {
     std::shared_ptr<Pos> pos;
@@ -255,6 +257,12 @@ public:
     inline Env & allocEnv(size_t size);
 
     Bindings * allocBindings(size_t capacity);
+
+    /**
+     * Returns `base // updates` as an overlay over `base`. `updates` must
+     * be nonempty and have fewer attributes than `base`.
+     */
+    Bindings * allocOverlay(Bindings & base, Bindings & updates);
     Value newList(size_t length);
 
     BindingsBuilder buildBindings(SymbolTable & symbols, size_t capacity)
@@ -345,6 +353,11 @@ struct EvalRuntimeCaches
      */
     std::shared_ptr<RegexCache> regexes;
 
+    /**
+     * Cache used by prim_replaceStrings().
+     */
+    std::shared_ptr<ReplaceStringsCache> replaceStrings;
+
     /**
      * A cache from path names to values for evalFile().
      */
@@ -511,6 +524,10 @@ public:
 struct EvalStatistics
 {
     unsigned long nrLookups = 0;
+    /**
+     * Number of attributes compared against while performing `nrLookups`.
+     */
+    unsigned long nrLookupProbes = 0;
     unsigned long nrAvoided = 0;
     unsigned long nrOpUpdates = 0;
     unsigned long nrOpUpdateValuesCopied = 0;
@@ -518,6 +535,12 @@ struct EvalStatistics
     unsigned long nrPrimOpCalls = 0;
     unsigned long nrFunctionCalls = 0;
     unsigned long nrThunks = 0;
+    /**
+     * Number of keys checked by `builtins.genericClosure`, and the number
+     * of deep comparisons needed for the keys that could not be hashed.
+     */
+    unsigned long nrGenericClosureKeys = 0;
+    unsigned long nrGenericClosureKeyComparisons = 0;
 
     bool countCalls = false;
 
@@ -545,6 +568,11 @@ public:
     EvalBuiltins builtins;
     EvalStatistics stats;
 
+    /**
+     * Records a profile of all function calls if `eval-profile-file` is set.
+     */
+    std::unique_ptr<EvalProfiler> profiler;
+
     /**
      * If set, force copying files to the Nix store even if they
      * already exist there.
@@ -621,7 +649,7 @@ public:
     }
 
     /**
-     * Print statistics, if enabled.
+     * Print statistics and write the evaluation profile, if enabled.
      *
      * Performs a full memory GC before printing the statistics, so that the
      * GC statistics are more accurate.
@@ -20,4 +20,26 @@ char const * gcCopyStringIfNeeded(std::string_view toCopyFrom)
     return cstr;
 }
 
+/// Size header and NUL terminator of the empty string, all zeroes.
+alignas(size_t) static char const emptySizedString[sizeof(size_t) + 1] = {};
+
+char * gcAllocSizedString(size_t size)
+{
+    char * buf = gcAllocString(sizeof(size_t) + size + 1);
+    memcpy(buf, &size, sizeof(size_t));
+    buf[sizeof(size_t) + size] = '\0';
+    return buf + sizeof(size_t);
+}
+
+char const * gcCopySizedString(std::string_view toCopyFrom)
+{
+    if (toCopyFrom.empty()) {
+        return emptySizedString + sizeof(size_t);
+    }
+
+    char * cstr = gcAllocSizedString(toCopyFrom.size());
+    memcpy(cstr, toCopyFrom.data(), toCopyFrom.size());
+    return cstr;
+}
+
 }
@@ -137,4 +137,23 @@ inline char * gcAllocString(size_t size)
 /// string if @ref toCopyFrom is also empty.
 char const * gcCopyStringIfNeeded(std::string_view toCopyFrom);
 
+/// GC-transparently allocates a buffer for a C-string of @ref size bytes *plus*
+/// the NUL terminator, preceded by a header that records @ref size. The returned
+/// pointer points past the header, so the buffer can be used as a C-string while
+/// @ref gcSizedStringLength recovers its length without scanning it. Memory
+/// allocated with this function must never contain other pointers.
+char * gcAllocSizedString(size_t size);
+
+/// Returns the length recorded by @ref gcAllocSizedString for @ref s.
+inline size_t gcSizedStringLength(char const * s)
+{
+    size_t size;
+    memcpy(&size, s - sizeof(size_t), sizeof(size_t));
+    return size;
+}
+
+/// Like @ref gcCopyStringIfNeeded, but returns a string allocated with
+/// @ref gcAllocSizedString (or a static empty string with a size header).
+char const * gcCopySizedString(std::string_view toCopyFrom);
+
 }
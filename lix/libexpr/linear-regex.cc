@@ -0,0 +1,760 @@
+#include "lix/libexpr/linear-regex.hh"
+
+#include <algorithm>
+#include <regex>
+
+namespace nix {
+
+namespace {
+
+/**
+ * Upper bound on the number of instructions of a compiled expression. It
+ * also bounds the recursion depth of the matcher.
+ */
+constexpr size_t maxProgramSize = 4096;
+
+/**
+ * Upper bound on the repetition counts of `{n,m}` that are expanded.
+ */
+constexpr unsigned maxRepeatCount = 1000;
+
+/**
+ * Upper bound on the size of the table built by matchAll().
+ */
+constexpr size_t maxTableSize = size_t(64) << 20;
+
+/**
+ * Tables up to this size are kept for the next search.
+ */
+constexpr size_t keptTableSize = size_t(1) << 20;
+
+constexpr unsigned unbounded = ~0u;
+
+struct Node
+{
+    enum class Kind { Byte, Group, Concat, Alt, Repeat, Bol, Eol };
+
+    Kind kind;
+    std::bitset<256> set = {};
+    unsigned group = 0;
+    unsigned min = 0, max = 0;
+    std::vector<Node> children = {};
+};
+
+/**
+ * Parses the syntax libstdc++ accepts for std::regex::extended. Anything
+ * this does not understand makes the whole expression unsupported.
+ */
+class Parser
+{
+    std::string_view re;
+    size_t pos = 0;
+
+public:
+    unsigned groups = 0;
+
+    explicit Parser(std::string_view re) : re(re) {}
+
+    std::optional<Node> parse()
+    {
+        auto root = disjunction();
+        if (!root || pos != re.size())
+            return std::nullopt;
+        return root;
+    }
+
+private:
+    bool at(char c) const
+    {
+        return pos < re.size() && re[pos] == c;
+    }
+
+    std::optional<Node> disjunction()
+    {
+        Node alt{.kind = Node::Kind::Alt};
+        while (true) {
+            auto branch = alternative();
+            if (!branch)
+                return std::nullopt;
+            alt.children.push_back(std::move(*branch));
+            if (!at('|'))
+                break;
+            pos++;
+        }
+        if (alt.children.size() == 1)
+            return std::move(alt.children[0]);
+        return alt;
+    }
+
+    std::optional<Node> alternative()
+    {
+        Node seq{.kind = Node::Kind::Concat};
+        while (pos < re.size() && re[pos] != '|' && re[pos] != ')') {
+            auto t = term();
+            if (!t)
+                return std::nullopt;
+            seq.children.push_back(std::move(*t));
+        }
+        return seq;
+    }
+
+    std::optional<Node> term()
+    {
+        /* Anchors cannot be repeated. */
+        if (at('^')) {
+            pos++;
+            return Node{.kind = Node::Kind::Bol};
+        }
+        if (at('$')) {
+            pos++;
+            return Node{.kind = Node::Kind::Eol};
+        }
+
+        auto res = atom();
+        while (res && pos < re.size()) {
+            unsigned min, max;
+            switch (re[pos]) {
+            case '*':
+                min = 0, max = unbounded;
+                pos++;
+                break;
+            case '+':
+                min = 1, max = unbounded;
+                pos++;
+                break;
+            case '?':
+                min = 0, max = 1;
+                pos++;
+                break;
+            case '{':
+                if (!interval(min, max))
+                    return std::nullopt;
+                break;
+            default:
+                return res;
+            }
+            res = Node{.kind = Node::Kind::Repeat, .min = min, .max = max, .children = {std::move(*res)}};
+        }
+        return res;
+    }
+
+    bool interval(unsigned & min, unsigned & max)
+    {
+        pos++;
+        if (!number(min))
+            return false;
+        max = min;
+        if (at(',')) {
+            pos++;
+            if (at('}'))
+                max = unbounded;
+            else if (!number(max) || max < min)
+                return false;
+        }
+        if (!at('}'))
+            return false;
+        pos++;
+        return true;
+    }
+
+    bool number(unsigned & n)
+    {
+        if (pos == re.size() || re[pos] < '0' || re[pos] > '9')
+            return false;
+        n = 0;
+        for (; pos < re.size() && re[pos] >= '0' && re[pos] <= '9'; pos++) {
+            n = n * 10 + (re[pos] - '0');
+            if (n > maxRepeatCount)
+                return false;
+        }
+        return true;
+    }
+
+    std::optional<Node> atom()
+    {
+        Node res{.kind = Node::Kind::Byte};
+        switch (re[pos]) {
+        case '.':
+            /* libstdc++ does not match NUL with `.`. */
+            res.set.set();
+            res.set.reset(0);
+            pos++;
+            return res;
+        case '\\':
+            /* There are no back-references or character class escapes in
+               extended expressions; every escaped character is literal. */
+            if (pos + 1 == re.size())
+                return std::nullopt;
+            res.set.set((unsigned char) re[pos + 1]);
+            pos += 2;
+            return res;
+        case '[':
+            return bracket();
+        case '(': {
+            pos++;
+            auto group = ++groups;
+            auto body = disjunction();
+            if (!body || !at(')'))
+                return std::nullopt;
+            pos++;
+            return Node{.kind = Node::Kind::Group, .group = group, .children = {std::move(*body)}};
+        }
+        case ')':
+        case '|':
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+        case '\0':
+            return std::nullopt;
+        default:
+            res.set.set((unsigned char) re[pos]);
+            pos++;
+            return res;
+        }
+    }
+
+    /**
+     * Finds the end of a bracket expression the way the libstdc++ scanner
+     * does and asks std::regex which bytes it matches, so that ranges,
+     * classes and collating elements need not be reimplemented.
+     */
+    std::optional<Node> bracket()
+    {
+        auto begin = pos++;
+        if (at('^'))
+            pos++;
+        if (at(']'))
+            pos++;
+        while (true) {
+            if (pos == re.size())
+                return std::nullopt;
+            auto c = re[pos++];
+            if (c == ']')
+                break;
+            if (c == '[' && pos < re.size() && (re[pos] == '.' || re[pos] == ':' || re[pos] == '=')) {
+                auto close = re.find(re[pos], pos + 1);
+                if (close == re.npos || close + 1 == re.size() || re[close + 1] != ']')
+                    return std::nullopt;
+                pos = close + 2;
+            }
+        }
+
+        Node res{.kind = Node::Kind::Byte};
+        try {
+            std::regex probe(re.begin() + begin, re.begin() + pos, std::regex::extended);
+            for (unsigned b = 0; b < 256; b++) {
+                char c = b;
+                if (std::regex_match(&c, &c + 1, probe))
+                    res.set.set(b);
+            }
+        } catch (std::regex_error &) {
+            return std::nullopt;
+        }
+        return res;
+    }
+};
+
+bool nullable(const Node & n)
+{
+    switch (n.kind) {
+    case Node::Kind::Byte:
+        return false;
+    case Node::Kind::Bol:
+    case Node::Kind::Eol:
+        return true;
+    case Node::Kind::Group:
+        return nullable(n.children[0]);
+    case Node::Kind::Concat:
+        return std::all_of(n.children.begin(), n.children.end(), nullable);
+    case Node::Kind::Alt:
+        return std::any_of(n.children.begin(), n.children.end(), nullable);
+    case Node::Kind::Repeat:
+        return n.min == 0 || nullable(n.children[0]);
+    }
+    return true;
+}
+
+/**
+ * libstdc++ lets a loop whose body matched nothing run once more at the
+ * same offset, which changes captures in ways an automaton cannot track.
+ * Loops over bodies that can match the empty string are not supported.
+ */
+bool supported(const Node & n)
+{
+    if (n.kind == Node::Kind::Repeat && n.max == unbounded && nullable(n.children[0]))
+        return false;
+    return std::all_of(n.children.begin(), n.children.end(), supported);
+}
+
+/**
+ * Number of instructions emitted for `n`, saturating above the limit.
+ */
+size_t programSize(const Node & n)
+{
+    auto add = [](size_t a, size_t b) { return std::min(a + b, maxProgramSize + 1); };
+    auto mul = [](size_t a, size_t b) { return a && b > maxProgramSize / a ? maxProgramSize + 1 : a * b; };
+
+    switch (n.kind) {
+    case Node::Kind::Byte:
+    case Node::Kind::Bol:
+    case Node::Kind::Eol:
+        return 1;
+    case Node::Kind::Group:
+        return add(programSize(n.children[0]), 2);
+    case Node::Kind::Concat:
+    case Node::Kind::Alt: {
+        size_t size = n.children.size();
+        for (auto & child : n.children)
+            size = add(size, programSize(child));
+        return size;
+    }
+    case Node::Kind::Repeat: {
+        auto body = programSize(n.children[0]);
+        auto optional = n.max == unbounded ? add(body, 1) : mul(n.max - n.min, add(body, 1));
+        return add(mul(n.min, body), optional);
+    }
+    }
+    return maxProgramSize + 1;
+}
+
+}
+
+/**
+ * Lowers the syntax tree to instructions the same way libstdc++ builds its
+ * automaton, so that the order in which alternatives are tried agrees.
+ */
+struct LinearRegexCompiler
+{
+    using Inst = LinearRegex::Inst;
+    using Op = Inst::Op;
+
+    LinearRegex & r;
+
+    uint32_t add(Inst inst)
+    {
+        r.prog.push_back(inst);
+        return r.prog.size() - 1;
+    }
+
+    /**
+     * Emits `n` followed by the instruction `next` and returns its entry.
+     */
+    uint32_t emit(const Node & n, uint32_t next)
+    {
+        switch (n.kind) {
+        case Node::Kind::Byte:
+            r.sets.push_back(n.set);
+            return add({Op::Byte, next, uint32_t(r.sets.size() - 1)});
+        case Node::Kind::Bol:
+            return add({Op::Bol, next});
+        case Node::Kind::Eol:
+            return add({Op::Eol, next});
+        case Node::Kind::Group: {
+            auto end = add({Op::Save, next, 2 * n.group + 1});
+            return add({Op::Save, emit(n.children[0], end), 2 * n.group});
+        }
+        case Node::Kind::Concat:
+            for (auto child = n.children.rbegin(); child != n.children.rend(); ++child)
+                next = emit(*child, next);
+            return next;
+        case Node::Kind::Alt: {
+            auto entry = emit(n.children.back(), next);
+            for (auto i = n.children.size() - 1; i-- > 0;)
+                entry = add({Op::Split, emit(n.children[i], next), entry});
+            return entry;
+        }
+        case Node::Kind::Repeat: {
+            auto & body = n.children[0];
+            auto tail = next;
+            if (n.max == unbounded) {
+                tail = add({Op::Repeat, 0, next});
+                auto entry = emit(body, tail);
+                r.prog[tail].next = entry;
+            } else {
+                /* Optional copies all skip to the end, like `{n,m}` in
+                   libstdc++, rather than nesting like repeated `?`. */
+                for (auto i = n.min; i < n.max; i++)
+                    tail = add({Op::Repeat, emit(body, tail), next});
+            }
+            for (auto i = 0u; i < n.min; i++)
+                tail = emit(body, tail);
+            return tail;
+        }
+        }
+        return next;
+    }
+
+    bool sort(uint32_t pc, std::vector<uint8_t> & state)
+    {
+        if (state[pc] == 2)
+            return true;
+        if (state[pc] == 1)
+            return false;
+        state[pc] = 1;
+        auto & i = r.prog[pc];
+        switch (i.op) {
+        case Op::Split:
+        case Op::Repeat:
+            if (!sort(i.next, state) || !sort(i.arg, state))
+                return false;
+            break;
+        case Op::Save:
+        case Op::Bol:
+        case Op::Eol:
+            if (!sort(i.next, state))
+                return false;
+            break;
+        case Op::Byte:
+        case Op::Match:
+            break;
+        }
+        state[pc] = 2;
+        r.order.push_back(pc);
+        return true;
+    }
+
+    bool compile(const Node & root, unsigned groups)
+    {
+        auto end = add({Op::Save, add({Op::Match}), 1});
+        r.start = add({Op::Save, emit(root, end), 0});
+        r.captures = 2 * (groups + 1);
+
+        std::vector<uint8_t> state(r.prog.size());
+        for (uint32_t pc = 0; pc < r.prog.size(); pc++)
+            if (!sort(pc, state))
+                return false;
+
+        r.column.assign(r.prog.size(), LinearRegex::untracked);
+        auto track = [&](uint32_t pc) {
+            if (r.column[pc] == LinearRegex::untracked)
+                r.column[pc] = r.columns++;
+        };
+        track(r.start);
+        for (uint32_t pc = 0; pc < r.prog.size(); pc++) {
+            if (r.prog[pc].op == Op::Byte)
+                track(pc);
+            if (r.prog[pc].op == Op::Repeat)
+                track(r.prog[pc].next);
+        }
+        return true;
+    }
+};
+
+/**
+ * A Pike VM over the instructions: all paths through the automaton advance
+ * in lockstep over the subject, ordered by the priority the backtracking
+ * matcher would give them, and a path that reaches an instruction already
+ * reached at the same offset is dropped. That is sound because the rest of
+ * its run could only repeat what the earlier path does.
+ *
+ * While searching, libstdc++ reports the longest match from the leftmost
+ * offset that has one, and among those the first in backtracking order.
+ * It also does not try to leave a greedy repetition when repeating it
+ * once more led to any match. Reproducing that requires knowing in advance
+ * whether a match can be completed from an instruction at an offset, so
+ * searching first scans the subject backwards to find out.
+ */
+struct LinearRegexSearch
+{
+    using Inst = LinearRegex::Inst;
+    using Op = Inst::Op;
+    using Captures = LinearRegex::Captures;
+
+    struct Threads
+    {
+        std::vector<uint32_t> pcs;
+        /** Captures of each thread, `captures` entries each. */
+        Captures caps;
+        /** The value of `stamp` when each instruction was last added. */
+        std::vector<uint64_t> seen;
+        uint64_t stamp;
+    };
+
+    /**
+     * Buffers kept between calls, as most subjects are short and allocating
+     * them would dominate the time spent.
+     */
+    struct Scratch
+    {
+        Threads clist, nlist;
+        Captures caps;
+        /**
+         * Whether a match can be completed from each instruction at the
+         * offset last passed to computeReach().
+         */
+        std::vector<char> reach, next;
+        /**
+         * For every offset, a row with the reachability of the tracked
+         * instructions at that offset. For Byte instructions it is whether
+         * the instruction consumes the byte there and a match can be
+         * completed after that.
+         */
+        std::vector<char> table;
+        uint64_t stamp;
+    };
+
+    /* Zero-initialised like every object with static storage duration. */
+    static inline thread_local Scratch scratch;
+
+    const LinearRegex & re;
+    std::string_view s;
+    /** Whether the whole subject has to match, as with std::regex_match. */
+    bool exact;
+    Scratch & sc = scratch;
+
+    /* Where the current run started, and how anchors and empty matches
+       are treated at that offset. Only if `specialAtFrom` is set do these
+       differ from the rest of the subject, and `sc.reach` is used there
+       instead of the table. */
+    size_t from = 0;
+    bool bolAtFrom = false;
+    bool acceptAtFrom = true;
+    bool specialAtFrom = false;
+
+    LinearRegexSearch(const LinearRegex & re, std::string_view s, bool exact)
+        : re(re)
+        , s(s)
+        , exact(exact)
+    {
+        if (sc.reach.size() < re.prog.size()) {
+            sc.reach.resize(re.prog.size());
+            sc.next.resize(re.prog.size());
+            sc.clist.seen.resize(re.prog.size());
+            sc.nlist.seen.resize(re.prog.size());
+        }
+    }
+
+    ~LinearRegexSearch()
+    {
+        if (sc.table.capacity() > keptTableSize)
+            sc.table = {};
+    }
+
+    char & cell(size_t p, uint32_t pc)
+    {
+        return sc.table[p * re.columns + re.column[pc]];
+    }
+
+    bool reachable(uint32_t pc, size_t p)
+    {
+        return p == from && specialAtFrom ? sc.reach[pc] : cell(p, pc);
+    }
+
+    /**
+     * Fills `sc.reach` for offset `p`. Byte instructions are looked up in
+     * the table, unless `next` is given. Then it must hold the reachability
+     * at `p + 1`, and the row of the table for `p` is filled in.
+     */
+    void computeReach(size_t p, bool bol, bool accept, const std::vector<char> * next = nullptr)
+    {
+        auto & reach = sc.reach;
+        for (auto pc : re.order) {
+            auto & i = re.prog[pc];
+            switch (i.op) {
+            case Op::Byte:
+                if (next)
+                    reach[pc] = p < s.size() && re.sets[i.arg][(unsigned char) s[p]] && (*next)[i.next];
+                else
+                    reach[pc] = p < s.size() && cell(p, pc);
+                break;
+            case Op::Split:
+            case Op::Repeat:
+                reach[pc] = reach[i.next] || reach[i.arg];
+                break;
+            case Op::Save:
+                reach[pc] = reach[i.next];
+                break;
+            case Op::Bol:
+                reach[pc] = bol && reach[i.next];
+                break;
+            case Op::Eol:
+                reach[pc] = p == s.size() && reach[i.next];
+                break;
+            case Op::Match:
+                reach[pc] = accept;
+                break;
+            }
+            if (next && re.column[pc] != LinearRegex::untracked)
+                cell(p, pc) = reach[pc];
+        }
+    }
+
+    bool buildTable()
+    {
+        if (s.size() + 1 > maxTableSize / re.columns)
+            return false;
+        sc.table.assign((s.size() + 1) * re.columns, false);
+        for (size_t p = s.size() + 1; p-- > 0;) {
+            std::swap(sc.reach, sc.next);
+            computeReach(p, false, true, &sc.next);
+        }
+        return true;
+    }
+
+    void reset(Threads & list)
+    {
+        list.pcs.clear();
+        list.caps.clear();
+        list.stamp = ++sc.stamp;
+    }
+
+    void add(Threads & list, uint32_t pc, size_t p, Captures & caps)
+    {
+        if (list.seen[pc] == list.stamp)
+            return;
+        list.seen[pc] = list.stamp;
+
+        auto & i = re.prog[pc];
+        switch (i.op) {
+        case Op::Byte:
+        case Op::Match:
+            list.pcs.push_back(pc);
+            list.caps.insert(list.caps.end(), caps.begin(), caps.end());
+            break;
+        case Op::Split:
+            add(list, i.next, p, caps);
+            add(list, i.arg, p, caps);
+            break;
+        case Op::Repeat:
+            add(list, i.next, p, caps);
+            if (exact || !reachable(i.next, p))
+                add(list, i.arg, p, caps);
+            break;
+        case Op::Save: {
+            auto saved = caps[i.arg];
+            caps[i.arg] = p;
+            add(list, i.next, p, caps);
+            caps[i.arg] = saved;
+            break;
+        }
+        case Op::Bol:
+            if (p == from && bolAtFrom)
+                add(list, i.next, p, caps);
+            break;
+        case Op::Eol:
+            if (p == s.size())
+                add(list, i.next, p, caps);
+            break;
+        }
+    }
+
+    std::optional<Captures> run(size_t from, bool bol, bool accept)
+    {
+        this->from = from;
+        bolAtFrom = bol;
+        acceptAtFrom = accept;
+        specialAtFrom = !exact && (bol || !accept);
+        if (specialAtFrom)
+            computeReach(from, bol, accept);
+
+        auto n = re.captures;
+        auto & caps = sc.caps;
+        caps.assign(n, -1);
+        auto * clist = &sc.clist, * nlist = &sc.nlist;
+        std::optional<Captures> best;
+
+        size_t p = from;
+        reset(*clist);
+        add(*clist, re.start, p, caps);
+
+        while (!clist->pcs.empty()) {
+            reset(*nlist);
+            for (size_t t = 0; t < clist->pcs.size(); t++) {
+                auto pc = clist->pcs[t];
+                auto & i = re.prog[pc];
+                auto tcaps = clist->caps.begin() + t * n;
+                if (i.op == Op::Match) {
+                    if (exact ? p == s.size() : p != from || accept)
+                        best.emplace(tcaps, tcaps + n);
+                    continue;
+                }
+                if (p == s.size())
+                    continue;
+                if (exact ? re.sets[i.arg][(unsigned char) s[p]] : cell(p, pc)) {
+                    std::copy(tcaps, tcaps + n, caps.begin());
+                    add(*nlist, i.next, p + 1, caps);
+                }
+            }
+            std::swap(clist, nlist);
+            p++;
+        }
+
+        return best;
+    }
+
+    /**
+     * std::regex_search on the subject from `from`, with `bol` set unless
+     * the flags contain match_prev_avail.
+     */
+    std::optional<Captures> search(size_t from, bool bol, bool notNull, bool continuous)
+    {
+        if (bol || notNull) {
+            computeReach(from, bol, !notNull);
+            if (sc.reach[re.start])
+                return run(from, bol, !notNull);
+        } else if (cell(from, re.start))
+            return run(from, false, true);
+        if (continuous)
+            return std::nullopt;
+        for (auto p = from + 1; p <= s.size(); p++)
+            if (cell(p, re.start))
+                return run(p, false, true);
+        return std::nullopt;
+    }
+};
+
+std::optional<LinearRegex> LinearRegex::compile(std::string_view re)
+{
+#if !defined(__GLIBCXX__)
+    /* The behaviour of other implementations is not reproduced. */
+    return std::nullopt;
+#endif
+
+    Parser parser(re);
+    auto root = parser.parse();
+    if (!root || !supported(*root) || programSize(*root) > maxProgramSize)
+        return std::nullopt;
+
+    LinearRegex res;
+    if (!LinearRegexCompiler{res}.compile(*root, parser.groups))
+        return std::nullopt;
+    return res;
+}
+
+auto LinearRegex::match(std::string_view s) const -> std::optional<Captures>
+{
+    return LinearRegexSearch(*this, s, true).run(0, true, true);
+}
+
+auto LinearRegex::matchAll(std::string_view s) const -> std::optional<std::vector<Captures>>
+{
+    LinearRegexSearch search(*this, s, false);
+    if (!search.buildTable())
+        return std::nullopt;
+
+    /* This follows the steps of std::regex_iterator. After an empty match
+       it first looks for a non-empty one at the same offset. Until then
+       `^` can still match there, as the iterator has not yet set
+       match_prev_avail. */
+    std::vector<Captures> res;
+    bool prevAvail = false;
+    auto m = search.search(0, true, false, false);
+    while (m) {
+        size_t begin = (*m)[0], end = (*m)[1];
+        res.push_back(std::move(*m));
+        if (begin == end) {
+            if (end == s.size())
+                break;
+            m = search.search(end, !prevAvail, true, true);
+            if (m)
+                continue;
+            end++;
+        }
+        prevAvail = true;
+        m = search.search(end, false, false, false);
+    }
+    return res;
+}
+
+}
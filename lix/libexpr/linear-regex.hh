@@ -0,0 +1,108 @@
+#pragma once
+///@file
+
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace nix {
+
+/**
+ * Automaton-based matcher for POSIX extended regular expressions, used by
+ * builtins.match and builtins.split. Matching takes time linear in the
+ * length of the subject and does not recurse over it.
+ *
+ * The results are exactly those of libstdc++'s backtracking std::regex with
+ * std::regex::extended, which Nix expressions depend on. That includes its
+ * departures from POSIX: captures follow the first path in backtracking
+ * order rather than POSIX subexpression rules, and while searching, a
+ * greedy repetition that leads to any match is not left early, even if
+ * leaving it would give a longer match.
+ *
+ * Expressions that libstdc++ treats in ways an automaton cannot reproduce,
+ * in particular repetitions of subexpressions that can match the empty
+ * string, are not compiled; callers have to use std::regex for them.
+ */
+class LinearRegex
+{
+public:
+    /**
+     * Start and end offsets of the whole match, followed by those of every
+     * subexpression. Subexpressions that did not take part in the match
+     * have both offsets set to -1.
+     */
+    using Captures = std::vector<std::ptrdiff_t>;
+
+    /**
+     * Compiles `re`, which std::regex must already have accepted. Returns
+     * nothing if `re` is outside the supported subset or if the standard
+     * library is not libstdc++.
+     */
+    static std::optional<LinearRegex> compile(std::string_view re);
+
+    size_t subexpressions() const
+    {
+        return captures / 2 - 1;
+    }
+
+    /**
+     * Equivalent to std::regex_match.
+     */
+    std::optional<Captures> match(std::string_view s) const;
+
+    /**
+     * Returns the matches std::regex_iterator visits, in order. Returns
+     * nothing if `s` is too long to be searched in bounded memory.
+     */
+    std::optional<std::vector<Captures>> matchAll(std::string_view s) const;
+
+private:
+    struct Inst
+    {
+        enum class Op : uint8_t {
+            /** Consume one byte from `sets[arg]`, then go to `next`. */
+            Byte,
+            /** Try `next`, then `arg`. */
+            Split,
+            /** Greedy repetition: try `next` (the body), then `arg` (the exit). */
+            Repeat,
+            /** Record the current offset in capture slot `arg`. */
+            Save,
+            Bol,
+            Eol,
+            Match,
+        };
+
+        Op op;
+        uint32_t next = 0;
+        uint32_t arg = 0;
+    };
+
+    std::vector<Inst> prog;
+    std::vector<std::bitset<256>> sets;
+    /**
+     * The instructions in an order where every instruction comes after all
+     * instructions it reaches without consuming input.
+     */
+    std::vector<uint32_t> order;
+    /**
+     * Column of the instructions whose reachability is recorded for every
+     * offset by matchAll(): Byte instructions, the start and the bodies of
+     * repetitions. Other instructions have `untracked`.
+     */
+    std::vector<uint32_t> column;
+    uint32_t columns = 0;
+    static constexpr uint32_t untracked = ~0u;
+    uint32_t start = 0;
+    size_t captures = 0;
+
+    LinearRegex() = default;
+
+    friend struct LinearRegexSearch;
+    friend struct LinearRegexCompiler;
+};
+
+}
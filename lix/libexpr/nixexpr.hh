@@ -85,6 +85,7 @@ public:
     ExprLiteral(const PosIdx pos, NewValueAs::integer_t, NixInt n) : Expr(pos) { v.mkInt(n); };
     ExprLiteral(const PosIdx pos, NewValueAs::integer_t, NixInt::Inner n) : Expr(pos) { v.mkInt(n); };
     ExprLiteral(const PosIdx pos, NewValueAs::floating_t, NixFloat nf) : Expr(pos) { v.mkFloat(nf); };
+    const Value & getValue() const { return v; }
     Value * maybeThunk(EvalState & state, Env & env) override;
     COMMON_METHODS
 };
@@ -0,0 +1,625 @@
+#include "lix/libexpr/parse-cache.hh"
+#include "lix/libstore/globals.hh"
+#include "lix/libutil/config.hh"
+#include "lix/libutil/file-descriptor.hh"
+#include "lix/libutil/file-system.hh"
+#include "lix/libutil/logging.hh"
+#include "lix/libutil/serialise.hh"
+#include "lix/libutil/source-path.hh"
+#include "lix/libutil/users.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <typeinfo>
+#include <utility>
+
+namespace nix {
+
+/**
+ * Version of the serialised AST format. Bump this whenever the layout below
+ * or the meaning of any node changes.
+ */
+static constexpr uint64_t parseCacheVersion = 1;
+
+namespace {
+
+enum class Tag : uint64_t {
+    None,
+    Int,
+    Float,
+    String,
+    Path,
+    Var,
+    InheritFrom,
+    Select,
+    OpHasAttr,
+    Set,
+    List,
+    Lambda,
+    Call,
+    Let,
+    With,
+    If,
+    Assert,
+    OpNot,
+    OpEq,
+    OpNEq,
+    OpAnd,
+    OpOr,
+    OpImpl,
+    OpUpdate,
+    OpConcatLists,
+    ConcatStrings,
+    Pos,
+};
+
+struct ExprWriter
+{
+    const SymbolTable & symbols;
+    const PosTable::Origin & origin;
+    StringSink sink;
+
+    void pos(PosIdx p)
+    {
+        sink << (p ? uint64_t(origin.offsetOf(p)) + 1 : 0);
+    }
+
+    void symbol(Symbol s)
+    {
+        if (s) {
+            sink << uint64_t(1) << std::string_view(symbols[s]);
+        } else {
+            sink << uint64_t(0);
+        }
+    }
+
+    void attrPath(const AttrPath & path)
+    {
+        sink << path.size();
+        for (auto & name : path) {
+            pos(name.pos);
+            symbol(name.symbol);
+            if (!name.symbol) {
+                expr(name.expr.get());
+            }
+        }
+    }
+
+    void attrs(const ExprAttrs & attrs)
+    {
+        sink << (attrs.inheritFromExprs ? attrs.inheritFromExprs->size() : 0);
+        if (attrs.inheritFromExprs) {
+            for (auto & from : *attrs.inheritFromExprs) {
+                expr(&*from);
+            }
+        }
+        sink << attrs.attrs.size();
+        for (auto & [name, def] : attrs.attrs) {
+            symbol(name);
+            sink << uint64_t(def.kind);
+            pos(def.pos);
+            expr(def.e.get());
+        }
+        sink << attrs.dynamicAttrs.size();
+        for (auto & def : attrs.dynamicAttrs) {
+            pos(def.pos);
+            expr(def.nameExpr.get());
+            expr(def.valueExpr.get());
+        }
+    }
+
+    template<typename T>
+    bool binOp(const Expr * e, Tag tag)
+    {
+        auto op = dynamic_cast<const T *>(e);
+        if (op) {
+            sink << uint64_t(tag);
+            pos(op->pos);
+            expr(op->e1.get());
+            expr(op->e2.get());
+        }
+        return op;
+    }
+
+    void expr(const Expr * e)
+    {
+        auto begin = [&](Tag tag) {
+            sink << uint64_t(tag);
+            pos(e->pos);
+        };
+
+        if (!e) {
+            sink << uint64_t(Tag::None);
+        } else if (auto str = dynamic_cast<const ExprString *>(e)) {
+            begin(Tag::String);
+            sink << str->s;
+        } else if (auto path = dynamic_cast<const ExprPath *>(e)) {
+            begin(Tag::Path);
+            sink << path->s;
+        } else if (auto lit = dynamic_cast<const ExprLiteral *>(e)) {
+            if (lit->getValue().type() == nInt) {
+                begin(Tag::Int);
+                sink << uint64_t(lit->getValue().integer.value);
+            } else {
+                begin(Tag::Float);
+                sink << std::bit_cast<uint64_t>(lit->getValue().fpoint);
+            }
+        } else if (auto from = dynamic_cast<const ExprInheritFrom *>(e)) {
+            begin(Tag::InheritFrom);
+            sink << uint64_t(from->displ);
+        } else if (auto var = dynamic_cast<const ExprVar *>(e)) {
+            begin(Tag::Var);
+            symbol(var->name);
+            sink << uint64_t(var->needsRoot);
+        } else if (auto select = dynamic_cast<const ExprSelect *>(e)) {
+            begin(Tag::Select);
+            expr(select->e.get());
+            expr(select->def.get());
+            attrPath(select->attrPath);
+        } else if (auto hasAttr = dynamic_cast<const ExprOpHasAttr *>(e)) {
+            begin(Tag::OpHasAttr);
+            expr(hasAttr->e.get());
+            attrPath(hasAttr->attrPath);
+        } else if (auto set = dynamic_cast<const ExprSet *>(e)) {
+            begin(Tag::Set);
+            sink << uint64_t(set->recursive);
+            attrs(*set);
+        } else if (auto list = dynamic_cast<const ExprList *>(e)) {
+            begin(Tag::List);
+            sink << list->elems.size();
+            for (auto & elem : list->elems) {
+                expr(elem.get());
+            }
+        } else if (auto lambda = dynamic_cast<const ExprLambda *>(e)) {
+            begin(Tag::Lambda);
+            symbol(lambda->name);
+            if (auto pattern = dynamic_cast<const AttrsPattern *>(lambda->pattern.get())) {
+                sink << uint64_t(1);
+                symbol(pattern->name);
+                sink << uint64_t(pattern->ellipsis) << pattern->formals.size();
+                for (auto & formal : pattern->formals) {
+                    pos(formal.pos);
+                    symbol(formal.name);
+                    expr(formal.def.get());
+                }
+            } else {
+                sink << uint64_t(0);
+                symbol(lambda->pattern->name);
+            }
+            expr(lambda->body.get());
+        } else if (auto call = dynamic_cast<const ExprCall *>(e)) {
+            begin(Tag::Call);
+            expr(call->fun.get());
+            sink << call->args.size();
+            for (auto & arg : call->args) {
+                expr(arg.get());
+            }
+        } else if (auto let = dynamic_cast<const ExprLet *>(e)) {
+            begin(Tag::Let);
+            attrs(*let);
+            expr(let->body.get());
+        } else if (auto with = dynamic_cast<const ExprWith *>(e)) {
+            begin(Tag::With);
+            expr(with->attrs.get());
+            expr(with->body.get());
+        } else if (auto if_ = dynamic_cast<const ExprIf *>(e)) {
+            begin(Tag::If);
+            expr(if_->cond.get());
+            expr(if_->then.get());
+            expr(if_->else_.get());
+        } else if (auto assert_ = dynamic_cast<const ExprAssert *>(e)) {
+            begin(Tag::Assert);
+            expr(assert_->cond.get());
+            expr(assert_->body.get());
+        } else if (auto not_ = dynamic_cast<const ExprOpNot *>(e)) {
+            begin(Tag::OpNot);
+            expr(not_->e.get());
+        } else if (binOp<ExprOpEq>(e, Tag::OpEq) || binOp<ExprOpNEq>(e, Tag::OpNEq)
+                   || binOp<ExprOpAnd>(e, Tag::OpAnd) || binOp<ExprOpOr>(e, Tag::OpOr)
+                   || binOp<ExprOpImpl>(e, Tag::OpImpl) || binOp<ExprOpUpdate>(e, Tag::OpUpdate)
+                   || binOp<ExprOpConcatLists>(e, Tag::OpConcatLists))
+        {
+        } else if (auto concat = dynamic_cast<const ExprConcatStrings *>(e)) {
+            begin(Tag::ConcatStrings);
+            sink << uint64_t(concat->forceString) << concat->es.size();
+            for (auto & [partPos, part] : concat->es) {
+                pos(partPos);
+                expr(part.get());
+            }
+        } else if (dynamic_cast<const ExprPos *>(e)) {
+            begin(Tag::Pos);
+        } else {
+            throw Error("cannot serialise expression of type '%s'", typeid(*e).name());
+        }
+    }
+};
+
+struct ExprReader
+{
+    SymbolTable & symbols;
+    PosTable & positions;
+    const PosTable::Origin & origin;
+    StringSource source;
+
+    /**
+     * The `inherit (from)` sources of the attribute set whose attributes are
+     * currently being read.
+     */
+    std::vector<ref<Expr>> * inheritFrom = nullptr;
+
+    uint64_t num()
+    {
+        return readNum<uint64_t>(source);
+    }
+
+    PosIdx pos()
+    {
+        auto p = num();
+        return p ? positions.add(origin, p - 1) : noPos;
+    }
+
+    Symbol symbol()
+    {
+        return num() ? symbols.create(readString(source)) : Symbol{};
+    }
+
+    AttrPath attrPath()
+    {
+        AttrPath path;
+        for (auto n = num(); n > 0; n--) {
+            auto p = pos();
+            if (auto s = symbol()) {
+                path.emplace_back(p, s);
+            } else {
+                path.emplace_back(p, required());
+            }
+        }
+        return path;
+    }
+
+    void attrs(ExprAttrs & attrs)
+    {
+        if (auto n = num()) {
+            attrs.inheritFromExprs = std::make_unique<std::vector<ref<Expr>>>();
+            for (; n > 0; n--) {
+                attrs.inheritFromExprs->push_back(ref<Expr>(required()));
+            }
+        }
+
+        auto outer = inheritFrom;
+        inheritFrom = attrs.inheritFromExprs.get();
+        for (auto n = num(); n > 0; n--) {
+            auto name = symbol();
+            auto kind = num();
+            if (kind > uint64_t(ExprAttrs::AttrDef::Kind::InheritedFrom)) {
+                throw Error("invalid attribute kind %d", kind);
+            }
+            auto p = pos();
+            attrs.attrs.emplace(name, ExprAttrs::AttrDef(required(), p, ExprAttrs::AttrDef::Kind(kind)));
+        }
+        for (auto n = num(); n > 0; n--) {
+            auto p = pos();
+            auto nameExpr = required();
+            attrs.dynamicAttrs.emplace_back(std::move(nameExpr), required(), p);
+        }
+        inheritFrom = outer;
+    }
+
+    std::unique_ptr<Expr> required()
+    {
+        auto e = expr();
+        if (!e) {
+            throw Error("missing expression");
+        }
+        return e;
+    }
+
+    std::unique_ptr<Expr> expr()
+    {
+        auto tag = Tag(num());
+        if (tag == Tag::None) {
+            return nullptr;
+        }
+        auto p = pos();
+
+        switch (tag) {
+        case Tag::Int:
+            return std::make_unique<ExprLiteral>(p, NewValueAs::integer, NixInt::Inner(num()));
+        case Tag::Float:
+            return std::make_unique<ExprLiteral>(p, NewValueAs::floating, std::bit_cast<NixFloat>(num()));
+        case Tag::String:
+            return std::make_unique<ExprString>(p, readString(source));
+        case Tag::Path:
+            return std::make_unique<ExprPath>(p, readString(source));
+        case Tag::Var: {
+            auto name = symbol();
+            return std::make_unique<ExprVar>(p, name, num() != 0);
+        }
+        case Tag::InheritFrom: {
+            auto displ = num();
+            if (!inheritFrom || displ >= inheritFrom->size()) {
+                throw Error("invalid inherit source %d", displ);
+            }
+            return std::make_unique<ExprInheritFrom>(p, displ, (*inheritFrom)[displ]);
+        }
+        case Tag::Select: {
+            auto e = required();
+            auto def = expr();
+            return std::make_unique<ExprSelect>(p, std::move(e), attrPath(), std::move(def));
+        }
+        case Tag::OpHasAttr: {
+            auto e = required();
+            return std::make_unique<ExprOpHasAttr>(p, std::move(e), attrPath());
+        }
+        case Tag::Set: {
+            auto set = std::make_unique<ExprSet>(p, num() != 0);
+            attrs(*set);
+            return set;
+        }
+        case Tag::List: {
+            auto list = std::make_unique<ExprList>(p);
+            for (auto n = num(); n > 0; n--) {
+                list->elems.push_back(required());
+            }
+            return list;
+        }
+        case Tag::Lambda: {
+            auto name = symbol();
+            std::unique_ptr<Pattern> pattern;
+            if (num()) {
+                auto attrs = std::make_unique<AttrsPattern>();
+                attrs->name = symbol();
+                attrs->ellipsis = num() != 0;
+                for (auto n = num(); n > 0; n--) {
+                    auto formalPos = pos();
+                    auto formalName = symbol();
+                    attrs->formals.push_back({formalPos, formalName, expr()});
+                }
+                /* Formals are sorted by symbol, and symbols are numbered
+                   differently in every evaluator. */
+                std::sort(attrs->formals.begin(), attrs->formals.end(), [](const auto & a, const auto & b) {
+                    return std::tie(a.name, a.pos) < std::tie(b.name, b.pos);
+                });
+                pattern = std::move(attrs);
+            } else if (auto arg = symbol()) {
+                pattern = std::make_unique<SimplePattern>(arg);
+            } else {
+                pattern = std::make_unique<SimplePattern>();
+            }
+            auto lambda = std::make_unique<ExprLambda>(p, std::move(pattern), required());
+            lambda->name = name;
+            return lambda;
+        }
+        case Tag::Call: {
+            auto fun = required();
+            std::vector<std::unique_ptr<Expr>> args;
+            for (auto n = num(); n > 0; n--) {
+                args.push_back(required());
+            }
+            return std::make_unique<ExprCall>(p, std::move(fun), std::move(args));
+        }
+        case Tag::Let: {
+            auto let = std::make_unique<ExprLet>();
+            let->pos = p;
+            attrs(*let);
+            let->body = required();
+            return let;
+        }
+        case Tag::With: {
+            auto attrs = required();
+            return std::make_unique<ExprWith>(p, std::move(attrs), required());
+        }
+        case Tag::If: {
+            auto cond = required();
+            auto then = required();
+            return std::make_unique<ExprIf>(p, std::move(cond), std::move(then), required());
+        }
+        case Tag::Assert: {
+            auto cond = required();
+            return std::make_unique<ExprAssert>(p, std::move(cond), required());
+        }
+        case Tag::OpNot:
+            return std::make_unique<ExprOpNot>(p, required());
+        case Tag::OpEq:
+            return binOp<ExprOpEq>(p);
+        case Tag::OpNEq:
+            return binOp<ExprOpNEq>(p);
+        case Tag::OpAnd:
+            return binOp<ExprOpAnd>(p);
+        case Tag::OpOr:
+            return binOp<ExprOpOr>(p);
+        case Tag::OpImpl:
+            return binOp<ExprOpImpl>(p);
+        case Tag::OpUpdate:
+            return binOp<ExprOpUpdate>(p);
+        case Tag::OpConcatLists:
+            return binOp<ExprOpConcatLists>(p);
+        case Tag::ConcatStrings: {
+            auto forceString = num() != 0;
+            std::vector<std::pair<PosIdx, std::unique_ptr<Expr>>> es;
+            for (auto n = num(); n > 0; n--) {
+                auto partPos = pos();
+                es.emplace_back(partPos, required());
+            }
+            return std::make_unique<ExprConcatStrings>(p, forceString, std::move(es));
+        }
+        case Tag::Pos:
+            return std::make_unique<ExprPos>(p);
+        case Tag::None:
+            break;
+        }
+        throw Error("invalid expression tag %d", uint64_t(tag));
+    }
+
+    template<typename T>
+    std::unique_ptr<Expr> binOp(PosIdx p)
+    {
+        auto e1 = required();
+        return std::make_unique<T>(p, std::move(e1), required());
+    }
+};
+
+}
+
+std::string serialiseExpr(const Expr & e, const SymbolTable & symbols, const PosTable::Origin & origin)
+{
+    ExprWriter writer{symbols, origin, {}};
+    writer.expr(&e);
+    return std::move(writer.sink.s);
+}
+
+std::unique_ptr<Expr> deserialiseExpr(
+    std::string_view data, SymbolTable & symbols, PosTable & positions, const PosTable::Origin & origin
+)
+{
+    ExprReader reader{symbols, positions, origin, StringSource{data}};
+    auto e = reader.required();
+    if (reader.source.pos != data.size()) {
+        throw Error("trailing data after expression");
+    }
+    return e;
+}
+
+ParseCache::Entry::Entry(Entry && other) noexcept
+    : data(std::exchange(other.data, nullptr))
+    , size(std::exchange(other.size, 0))
+{
+}
+
+ParseCache::Entry & ParseCache::Entry::operator=(Entry && other) noexcept
+{
+    std::swap(data, other.data);
+    std::swap(size, other.size);
+    return *this;
+}
+
+ParseCache::Entry::~Entry()
+{
+    if (data) {
+        munmap(const_cast<char *>(data), size);
+    }
+}
+
+ParseCache::ParseCache(Path dir, uint64_t maxSize) : dir(std::move(dir)), maxSize(maxSize) {}
+
+Hash ParseCache::key(std::string_view text, const SourcePath & basePath, const FeatureSettings & featureSettings)
+{
+    HashSink sink{HashType::SHA256};
+    sink << parseCacheVersion << nixVersion << basePath.to_string() << getHome()
+         << featureSettings.experimentalFeatures.to_string()
+         << featureSettings.deprecatedFeatures.to_string() << text;
+    return sink.finish().first;
+}
+
+std::optional<ParseCache::Entry> ParseCache::lookup(const Hash & key) const
+{
+    auto path = dir + "/" + key.to_string(Base::Base32, false);
+    AutoCloseFD fd{open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+    struct stat st;
+    if (!fd || fstat(fd.get(), &st) != 0) {
+        if (errno != ENOENT) {
+            debug("could not open parse cache entry '%s': %s", path, strerror(errno));
+        }
+        return std::nullopt;
+    }
+
+    /* Entries are read straight from the page cache rather than copied into
+       a string first. They are still deserialised in full: bindVars() walks
+       and rewrites the whole tree right away, so there is nothing to gain
+       from materialising nodes lazily. */
+    Entry entry;
+    if (st.st_size > 0) {
+        auto p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+        if (p == MAP_FAILED) {
+            debug("could not map parse cache entry '%s': %s", path, strerror(errno));
+            return std::nullopt;
+        }
+        entry.data = static_cast<const char *>(p);
+        entry.size = st.st_size;
+    }
+
+    /* The modification time orders entries for prune(). */
+    futimens(fd.get(), nullptr);
+    return entry;
+}
+
+void ParseCache::insert(const Hash & key, std::string_view data) const
+{
+    auto path = dir + "/" + key.to_string(Base::Base32, false);
+    try {
+        createDirs(dir);
+        auto tmpPath = makeTempPath(path);
+        writeFile(tmpPath, data);
+        if (rename(tmpPath.c_str(), path.c_str()) == -1) {
+            deletePath(tmpPath);
+            throw SysError("renaming '%s' to '%s'", tmpPath, path);
+        }
+    } catch (Error & e) {
+        debug("could not write parse cache entry '%s': %s", path, e.what());
+        return;
+    }
+
+    if (maxSize == 0) {
+        return;
+    }
+
+    /* Scanning the cache is too expensive to do for every entry, so only the
+       first insertion of a process prunes, and after that every tenth of the
+       limit that the process has added. Racing prunes are harmless. */
+    static std::atomic<bool> pruned{false};
+    static std::atomic<uint64_t> written{0};
+    if (!pruned.exchange(true) || (written += data.size()) > maxSize / 10) {
+        written = 0;
+        prune();
+    }
+}
+
+void ParseCache::prune() const
+{
+    struct File
+    {
+        Path path;
+        struct timespec mtime;
+        uint64_t size;
+    };
+
+    try {
+        std::vector<File> files;
+        uint64_t total = 0;
+        for (auto & entry : readDirectory(dir)) {
+            auto path = dir + "/" + entry.name;
+            auto st = maybeLstat(path);
+            if (!st || !S_ISREG(st->st_mode)) {
+                continue;
+            }
+            files.push_back({path, st->st_mtim, uint64_t(st->st_size)});
+            total += st->st_size;
+        }
+        if (total <= maxSize) {
+            return;
+        }
+
+        std::sort(files.begin(), files.end(), [](const File & a, const File & b) {
+            return std::tie(a.mtime.tv_sec, a.mtime.tv_nsec) < std::tie(b.mtime.tv_sec, b.mtime.tv_nsec);
+        });
+        for (auto & file : files) {
+            if (total <= maxSize) {
+                break;
+            }
+            if (unlink(file.path.c_str()) == 0 || errno == ENOENT) {
+                total -= file.size;
+            }
+        }
+    } catch (Error & e) {
+        debug("could not prune parse cache '%s': %s", dir, e.what());
+    }
+}
+
+}
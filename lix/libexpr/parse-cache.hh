@@ -0,0 +1,98 @@
+#pragma once
+///@file
+
+#include "lix/libexpr/nixexpr.hh"
+#include "lix/libexpr/pos-table.hh"
+#include "lix/libexpr/symbol-table.hh"
+#include "lix/libutil/hash.hh"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace nix {
+
+struct FeatureSettings;
+struct SourcePath;
+
+/**
+ * Serialises the AST of a freshly parsed file, before variables are bound.
+ * Positions are stored relative to `origin` and symbols by name, so the
+ * result can be loaded into another evaluator.
+ */
+std::string serialiseExpr(const Expr & e, const SymbolTable & symbols, const PosTable::Origin & origin);
+
+/**
+ * Loads an AST written by serialiseExpr(). `origin` must describe the same
+ * source text that the AST was parsed from. The caller still has to bind
+ * the variables of the result. Throws if `data` is malformed.
+ */
+std::unique_ptr<Expr> deserialiseExpr(
+    std::string_view data, SymbolTable & symbols, PosTable & positions, const PosTable::Origin & origin
+);
+
+/**
+ * On-disk cache of parsed files, enabled by the `eval-parse-cache` setting.
+ * Entries are keyed by the parser version, the source text and everything
+ * else that influences the AST, so they never need to be invalidated, only
+ * pruned once the cache outgrows `eval-parse-cache-size`.
+ */
+class ParseCache
+{
+    Path dir;
+    uint64_t maxSize;
+
+public:
+    /**
+     * A cache entry, mapped into memory for as long as this object lives.
+     */
+    class Entry
+    {
+        const char * data = nullptr;
+        size_t size = 0;
+
+        friend class ParseCache;
+
+    public:
+        Entry() = default;
+        Entry(Entry && other) noexcept;
+        Entry & operator=(Entry && other) noexcept;
+        ~Entry();
+
+        std::string_view view() const
+        {
+            return {data, size};
+        }
+    };
+
+    /**
+     * @param maxSize Size in bytes to which insert() trims the cache, or 0
+     * to let it grow without bound.
+     */
+    ParseCache(Path dir, uint64_t maxSize);
+
+    static Hash key(std::string_view text, const SourcePath & basePath, const FeatureSettings & featureSettings);
+
+    /**
+     * Maps the entry for `key`, if there is one, and marks it as recently
+     * used.
+     */
+    std::optional<Entry> lookup(const Hash & key) const;
+
+    /**
+     * Stores `data` under `key`, pruning the cache when this process has
+     * added enough to it. Failures are logged and otherwise ignored; the
+     * cache is only an optimisation.
+     */
+    void insert(const Hash & key, std::string_view data) const;
+
+    /**
+     * Deletes the least recently used entries until the cache is no larger
+     * than `maxSize`.
+     */
+    void prune() const;
+};
+
+}
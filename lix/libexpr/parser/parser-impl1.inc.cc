@@ -754,13 +754,15 @@ template<> struct BuildAST<grammar::v1::expr::ancient_let> : change_head<Binding
     static void success(const auto & in, BindingsStateRecSet & b, ExprState & s, State & ps) {
         // Added 2024-09-18. Turn into an error at some point in the future.
         // See the documentation on deprecated features for more details.
-        if (!ps.featureSettings.isEnabled(Dep::AncientLet))
+        if (!ps.featureSettings.isEnabled(Dep::AncientLet)) {
+            ps.warned = true;
             warn(
                 "%s found at %s. This feature is deprecated and will be removed in the future. Use %s to silence this warning.",
                 "let {",
                 ps.positions[ps.at(in)],
                 "--extra-deprecated-features ancient-let"
             );
+        }
 
         auto pos = ps.at(in);
         b.set.pos = pos;
@@ -4,6 +4,7 @@
 #include "lix/libexpr/eval.hh"
 #include "lix/libutil/finally.hh"
 #include "lix/libexpr/nixexpr.hh"
+#include "lix/libexpr/parse-cache.hh"
 #include "lix/libexpr/symbol-table.hh"
 #include "lix/libutil/users.hh"
 
@@ -39,12 +40,38 @@ Expr * Evaluator::parse(
         featureSettings,
     };
 
-    p::string_input<p::tracking_mode::lazy> inp{std::string_view{text, length}, "input"};
+    /* Only files are cached: strings and stdin are usually parsed once. */
+    std::optional<ParseCache> cache;
+    std::optional<Hash> cacheKey;
+    if (evalSettings.evalParseCache && std::holds_alternative<CheckedSourcePath>(origin)) {
+        cache.emplace(getCacheDir() + "/nix/parse-cache", evalSettings.evalParseCacheSize);
+        cacheKey = ParseCache::key({text, length}, basePath, featureSettings);
+        if (auto entry = cache->lookup(*cacheKey)) {
+            try {
+                auto result = deserialiseExpr(entry->view(), symbols, positions, s.origin);
+                result->bindVars(*this, staticEnv);
+                return result.release();
+            } catch (Error & e) {
+                debug("ignoring bad parse cache entry for %s: %s", basePath, e.what());
+            }
+        }
+    }
+
+    // memory_input parses the caller's buffer in place; string_input would
+    // copy every source file once more before parsing it.
+    p::memory_input<p::tracking_mode::lazy> inp{text, length, "input"};
     try {
         parser::v1::ExprState x;
         p::parse<parser::grammar::v1::root, parser::v1::BuildAST, parser::v1::Control>(inp, x, s);
 
         auto [_pos, result] = x.finish(s);
+        if (cache && !s.warned) {
+            try {
+                cache->insert(*cacheKey, serialiseExpr(*result, symbols, s.origin));
+            } catch (Error & e) {
+                debug("not caching the parse of %s: %s", basePath, e.what());
+            }
+        }
         result->bindVars(*this, staticEnv);
         return result.release();
     } catch (p::parse_error & e) {
@@ -32,6 +32,7 @@ struct State
     const Expr::AstSymbols & s;
     const FeatureSettings & featureSettings;
     bool hasWarnedAboutBadLineEndings = false; // State to only warn on first occurrence
+    bool warned = false; // Parses that warned are not cached, so the warning is not lost
 
     void dupAttr(const AttrPath & attrPath, const PosIdx pos, const PosIdx prevPos);
     void dupAttr(Symbol attr, const PosIdx pos, const PosIdx prevPos);
@@ -85,6 +86,7 @@ inline void State::dupAttr(Symbol attr, const PosIdx pos, const PosIdx prevPos)
 inline void State::overridesFound(const PosIdx pos) {
     // Added 2024-09-18. Turn into an error at some point in the future.
     // See the documentation on deprecated features for more details.
+    warned = true;
     warn(
         "%s found at %s. This feature is deprecated and will be removed in the future. Use %s to silence this warning.",
         "__overrides",
@@ -99,6 +101,7 @@ inline void State::badLineEndingFound(const PosIdx pos, bool warnOnly)
     // Within strings we should throw because it is a correctness issue, outside of
     // strings it only harmlessly fucks up line numbers in error messages so warning is sufficient.
     if (warnOnly) {
+        warned = true;
         if (!hasWarnedAboutBadLineEndings)
             warn(
                 "CR (`\\r`) and CRLF (`\\r\\n`) line endings found at %s. Please inspect the file and normalize it to use LF (`\\n`) line endings instead. Use %s to silence this warning.",
@@ -2,6 +2,7 @@
 ///@file
 
 #include <cinttypes>
+#include <functional>
 
 namespace nix {
 
@@ -9,6 +10,7 @@ class PosIdx
 {
     friend struct LazyPosAcessors;
     friend class PosTable;
+    friend struct std::hash<PosIdx>;
 
 private:
     uint32_t id;
@@ -48,3 +50,12 @@ public:
 inline PosIdx noPos = {};
 
 }
+
+template<>
+struct std::hash<nix::PosIdx>
+{
+    size_t operator()(nix::PosIdx pos) const noexcept
+    {
+        return std::hash<uint32_t>{}(pos.id);
+    }
+};
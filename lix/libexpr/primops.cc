@@ -8,10 +8,12 @@
 #include "lix/libexpr/gc-small-vector.hh"
 #include "lix/libstore/globals.hh"
 #include "lix/libexpr/json-to-value.hh"
+#include "lix/libexpr/linear-regex.hh"
 #include "lix/libstore/names.hh"
 #include "lix/libstore/path-references.hh"
 #include "lix/libutil/async.hh"
 #include "lix/libutil/json.hh"
+#include "lix/libutil/lru-cache.hh"
 #include "lix/libutil/processes.hh"
 #include "lix/libstore/store-api.hh"
 #include "lix/libexpr/value-to-json.hh"
@@ -19,6 +21,7 @@
 #include "lix/libexpr/primops.hh"
 #include "lix/libfetchers/fetch-to-store.hh"
 #include "lix/libutil/result.hh"
+#include "lix/libutil/string-matcher.hh"
 #include "lix/libutil/types.hh"
 
 #include <boost/container/small_vector.hpp>
@@ -32,6 +35,7 @@
 #include <cstring>
 #include <sstream>
 #include <regex>
+#include <unordered_set>
 #include <dlfcn.h>
 
 #include <cmath>
@@ -503,8 +507,8 @@ static Bindings::iterator getAttr(
     Bindings * attrSet,
     std::string_view errorCtx)
 {
-    Bindings::iterator value = attrSet->find(attrSym);
-    if (value == attrSet->end()) {
+    Attr * value = attrSet->get(attrSym);
+    if (!value) {
         state.ctx.errors.make<TypeError>("attribute '%s' missing", state.ctx.symbols[attrSym]).withTrace(noPos, errorCtx).debugThrow();
     }
     return value;
@@ -538,8 +542,41 @@ static void prim_genericClosure(EvalState & state, const PosIdx pos, Value * * a
     UnsafeValueList res;
     // `doneKeys' doesn't need to be a GC root, because its values are
     // reachable from res.
-    auto cmp = CompareValues(state, noPos, "while comparing the `key` attributes of two genericClosure elements");
+    auto compareKeys = CompareValues(state, noPos, "while comparing the `key` attributes of two genericClosure elements");
+    auto cmp = [&](Value * v1, Value * v2) {
+        state.ctx.stats.nrGenericClosureKeyComparisons++;
+        return compareKeys(v1, v2);
+    };
     std::set<Value *, decltype(cmp)> doneKeys(cmp);
+
+    /* Keys are nearly always all strings, all paths or all integers,
+       which are deduplicated by hashing instead. As soon as another key
+       shows up, all keys move to `doneKeys', which then decides which
+       keys are equal (and which cannot be compared) like it always did. */
+    std::optional<ValueType> hashedType;
+    std::unordered_set<std::string_view> doneStrings;
+    std::unordered_set<NixInt::Inner> doneInts;
+    bool ordered = false;
+
+    auto insertKey = [&](Value * key) {
+        state.ctx.stats.nrGenericClosureKeys++;
+        if (!ordered) {
+            auto type = key->type();
+            if ((type == nString || type == nPath || type == nInt) && (!hashedType || *hashedType == type)) {
+                hashedType = type;
+                if (type == nInt)
+                    return doneInts.insert(key->integer.value).second;
+                return doneStrings.insert(type == nString ? key->string.s : key->_path).second;
+            }
+            ordered = true;
+            for (auto e : res)
+                doneKeys.insert(e->attrs->find(state.ctx.s.key)->value);
+            doneStrings.clear();
+            doneInts.clear();
+        }
+        return doneKeys.insert(key).second;
+    };
+
     while (!workSet.empty()) {
         Value * e = *(workSet.begin());
         workSet.pop_front();
@@ -549,7 +586,7 @@ static void prim_genericClosure(EvalState & state, const PosIdx pos, Value * * a
         Bindings::iterator key = getAttr(state, state.ctx.s.key, e->attrs, "in one of the attrsets generated by (or initially passed to) builtins.genericClosure");
         state.forceValue(*key->value, noPos);
 
-        if (!doneKeys.insert(key->value).second) continue;
+        if (!insertKey(key->value)) continue;
         res.push_back(e);
 
         /* Call the `operator' function with `e' as argument. */
@@ -1714,8 +1751,8 @@ static void prim_unsafeGetAttrPos(EvalState & state, const PosIdx pos, Value * *
 {
     auto attr = state.forceStringNoCtx(*args[0], pos, "while evaluating the first argument passed to builtins.unsafeGetAttrPos");
     state.forceAttrs(*args[1], pos, "while evaluating the second argument passed to builtins.unsafeGetAttrPos");
-    Bindings::iterator i = args[1]->attrs->find(state.ctx.symbols.create(attr));
-    if (i == args[1]->attrs->end())
+    Attr * i = args[1]->attrs->get(state.ctx.symbols.create(attr));
+    if (!i)
         v.mkNull();
     else
         state.mkPos(v, i->pos);
@@ -1774,7 +1811,7 @@ static void prim_hasAttr(EvalState & state, const PosIdx pos, Value * * args, Va
 {
     auto attr = state.forceStringNoCtx(*args[0], pos, "while evaluating the first argument passed to builtins.hasAttr");
     state.forceAttrs(*args[1], pos, "while evaluating the second argument passed to builtins.hasAttr");
-    v.mkBool(args[1]->attrs->find(state.ctx.symbols.create(attr)) != args[1]->attrs->end());
+    v.mkBool(args[1]->attrs->get(state.ctx.symbols.create(attr)));
 }
 
 /* Determine whether the argument is a set. */
@@ -2560,22 +2597,98 @@ static void prim_hashString(EvalState & state, const PosIdx pos, Value * * args,
     v.mkString(hashString(*ht, s).to_string(Base::Base16, false));
 }
 
+struct CompiledRegex
+{
+    /**
+     * Set if the expression contains no operators and thus only matches
+     * this exact, non-empty string. Expressions like "/" or "\\." are very
+     * common in nixpkgs and are matched without the regex engine; `regex`
+     * is not compiled for them.
+     */
+    std::optional<std::string> literal;
+    /**
+     * Linear-time equivalent of `regex`, unless the expression is outside
+     * what LinearRegex supports.
+     */
+    std::optional<LinearRegex> linear;
+    std::regex regex;
+};
+
+/**
+ * Returns the string matched by an extended regular expression made up
+ * only of ordinary and escaped characters.
+ */
+static std::optional<std::string> regexLiteral(std::string_view re)
+{
+    constexpr std::string_view special = ".[]()*+?{}|^$\\";
+    std::string res;
+    for (size_t i = 0; i < re.size(); i++) {
+        if (re[i] == '\\') {
+            if (++i == re.size() || special.find(re[i]) == special.npos)
+                return std::nullopt;
+        } else if (special.find(re[i]) != special.npos) {
+            return std::nullopt;
+        }
+        res += re[i];
+    }
+    if (res.empty())
+        return std::nullopt;
+    return res;
+}
+
 struct RegexCache
 {
-    // TODO use C++20 transparent comparison when available
-    std::unordered_map<std::string_view, std::regex> cache;
-    std::list<std::string> keys;
+    struct Hash : std::hash<std::string_view>
+    {
+        using is_transparent = void;
+    };
+
+    std::unordered_map<std::string, CompiledRegex, Hash, std::equal_to<>> cache;
 
-    std::regex get(std::string_view re)
+    const CompiledRegex & get(std::string_view re)
     {
         auto it = cache.find(re);
         if (it != cache.end())
             return it->second;
-        keys.emplace_back(re);
-        return cache.emplace(keys.back(), std::regex(keys.back(), std::regex::extended)).first->second;
+        CompiledRegex compiled{.literal = regexLiteral(re)};
+        if (!compiled.literal) {
+            /* Always compiled, so that invalid expressions are reported
+               exactly as before. */
+            compiled.regex = std::regex(re.begin(), re.end(), std::regex::extended);
+            compiled.linear = LinearRegex::compile(re);
+        }
+        return cache.emplace(re, std::move(compiled)).first->second;
     }
 };
 
+static LinearRegex::Captures capturesOf(const std::cmatch & match, const char * begin)
+{
+    LinearRegex::Captures res;
+    for (auto & sub : match) {
+        res.push_back(sub.matched ? sub.first - begin : -1);
+        res.push_back(sub.matched ? sub.second - begin : -1);
+    }
+    return res;
+}
+
+/**
+ * Makes `v` the list of the subexpression matches in `caps`, with null for
+ * the ones that did not take part.
+ */
+static void mkGroups(EvalState & state, Value & v, std::string_view str, const LinearRegex::Captures & caps)
+{
+    // the first match is the whole string
+    const size_t len = caps.size() / 2 - 1;
+    v = state.ctx.mem.newList(len);
+    for (size_t i = 0; i < len; ++i) {
+        auto begin = caps[2 * i + 2], end = caps[2 * i + 3];
+        if (begin < 0)
+            (v.listElems()[i] = state.ctx.mem.allocValue())->mkNull();
+        else
+            (v.listElems()[i] = state.ctx.mem.allocValue())->mkString(str.substr(begin, end - begin));
+    }
+}
+
 static RegexCache & regexCacheOf(EvalState & state)
 {
     if (!state.ctx.caches.regexes) {
@@ -2590,27 +2703,33 @@ void prim_match(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 
     try {
 
-        auto regex = regexCacheOf(state).get(re);
+        auto & regex = regexCacheOf(state).get(re);
 
         NixStringContext context;
         const auto str = state.forceString(*args[1], context, pos, "while evaluating the second argument passed to builtins.match");
 
-        std::cmatch match;
-        if (!std::regex_match(str.begin(), str.end(), match, regex)) {
-            v.mkNull();
+        if (regex.literal) {
+            if (str == *regex.literal)
+                v = state.ctx.mem.newList(0);
+            else
+                v.mkNull();
             return;
         }
 
-        // the first match is the whole string
-        const size_t len = match.size() - 1;
-        v = state.ctx.mem.newList(len);
-        for (size_t i = 0; i < len; ++i) {
-            if (!match[i+1].matched)
-                (v.listElems()[i] = state.ctx.mem.allocValue())->mkNull();
-            else
-                (v.listElems()[i] = state.ctx.mem.allocValue())->mkString(match[i + 1].str());
+        std::optional<LinearRegex::Captures> match;
+        if (regex.linear) {
+            match = regex.linear->match(str);
+        } else {
+            std::cmatch m;
+            if (std::regex_match(str.begin(), str.end(), m, regex.regex))
+                match = capturesOf(m, str.data());
         }
 
+        if (!match)
+            v.mkNull();
+        else
+            mkGroups(state, v, str, *match);
+
     } catch (std::regex_error & e) {
         if (e.code() == std::regex_constants::error_space) {
             // limit is _GLIBCXX_REGEX_STATE_LIMIT for libstdc++
@@ -2632,16 +2751,48 @@ void prim_split(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 
     try {
 
-        auto regex = regexCacheOf(state).get(re);
+        auto & regex = regexCacheOf(state).get(re);
 
         NixStringContext context;
         const auto str = state.forceString(*args[1], context, pos, "while evaluating the second argument passed to builtins.split");
 
-        auto begin = std::cregex_iterator(str.begin(), str.end(), regex);
-        auto end = std::cregex_iterator();
+        if (regex.literal) {
+            const auto & literal = *regex.literal;
+            std::vector<size_t> starts;
+            for (auto p = str.find(literal); p != str.npos; p = str.find(literal, p + literal.size()))
+                starts.push_back(p);
+
+            v = state.ctx.mem.newList(2 * starts.size() + 1);
+            if (starts.empty()) {
+                v.listElems()[0] = args[1];
+                return;
+            }
+
+            size_t idx = 0, last = 0;
+            for (auto p : starts) {
+                (v.listElems()[idx++] = state.ctx.mem.allocValue())->mkString(str.substr(last, p - last));
+                *(v.listElems()[idx++] = state.ctx.mem.allocValue()) = state.ctx.mem.newList(0);
+                last = p + literal.size();
+            }
+            (v.listElems()[idx++] = state.ctx.mem.allocValue())->mkString(str.substr(last));
+            return;
+        }
+
+        /* Collect the matches up front so the string is only scanned once.
+           LinearRegex gives up on subjects that are very long for the
+           expression, and std::regex is used for those as well. */
+        std::optional<std::vector<LinearRegex::Captures>> found;
+        if (regex.linear)
+            found = regex.linear->matchAll(str);
+        if (!found) {
+            found.emplace();
+            for (auto i = std::cregex_iterator(str.begin(), str.end(), regex.regex); i != std::cregex_iterator(); ++i)
+                found->push_back(capturesOf(*i, str.data()));
+        }
+        const auto & matches = *found;
 
         // Any matches results are surrounded by non-matching results.
-        const size_t len = std::distance(begin, end);
+        const size_t len = matches.size();
         v = state.ctx.mem.newList(2 * len + 1);
         size_t idx = 0;
 
@@ -2650,31 +2801,21 @@ void prim_split(EvalState & state, const PosIdx pos, Value * * args, Value & v)
             return;
         }
 
-        for (auto i = begin; i != end; ++i) {
+        size_t last = 0;
+        for (auto & match : matches) {
             assert(idx <= 2 * len + 1 - 3);
-            auto match = *i;
 
             // Add a string for non-matched characters.
-            (v.listElems()[idx++] = state.ctx.mem.allocValue())->mkString(match.prefix().str());
+            (v.listElems()[idx++] = state.ctx.mem.allocValue())->mkString(str.substr(last, match[0] - last));
 
             // Add a list for matched substrings.
-            const size_t slen = match.size() - 1;
-            auto elem = v.listElems()[idx++] = state.ctx.mem.allocValue();
-
-            // Start at 1, beacause the first match is the whole string.
-            *elem = state.ctx.mem.newList(slen);
-            for (size_t si = 0; si < slen; ++si) {
-                if (!match[si + 1].matched)
-                    (elem->listElems()[si] = state.ctx.mem.allocValue())->mkNull();
-                else
-                    (elem->listElems()[si] = state.ctx.mem.allocValue())->mkString(match[si + 1].str());
-            }
-
-            // Add a string for non-matched suffix characters.
-            if (idx == 2 * len)
-                (v.listElems()[idx++] = state.ctx.mem.allocValue())->mkString(match.suffix().str());
+            mkGroups(state, *(v.listElems()[idx++] = state.ctx.mem.allocValue()), str, match);
+            last = match[1];
         }
 
+        // Add a string for non-matched suffix characters.
+        (v.listElems()[idx++] = state.ctx.mem.allocValue())->mkString(str.substr(last));
+
         assert(idx == 2 * len + 1);
 
     } catch (std::regex_error & e) {
@@ -2709,6 +2850,24 @@ static void prim_concatStringsSep(EvalState & state, const PosIdx pos, Value * *
     v.mkString(res, context);
 }
 
+struct ReplaceStringsCache
+{
+    /**
+     * Matchers for recently used lists of patterns. Most calls come from a
+     * handful of library functions with constant pattern lists.
+     */
+    LRUCache<std::vector<std::string>, std::shared_ptr<const MultiStringMatcher>> matchers{1024};
+
+    std::shared_ptr<const MultiStringMatcher> get(const std::vector<std::string> & from)
+    {
+        if (auto matcher = matchers.get(from))
+            return *matcher;
+        auto matcher = std::make_shared<const MultiStringMatcher>(from);
+        matchers.upsert(from, matcher);
+        return matcher;
+    }
+};
+
 static void prim_replaceStrings(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
     state.forceList(*args[0], pos, "while evaluating the first argument passed to builtins.replaceStrings");
@@ -2723,46 +2882,46 @@ static void prim_replaceStrings(EvalState & state, const PosIdx pos, Value * * a
     for (auto elem : args[0]->listItems())
         from.emplace_back(state.forceString(*elem, pos, "while evaluating one of the strings to replace passed to builtins.replaceStrings"));
 
+    if (!state.ctx.caches.replaceStrings) {
+        state.ctx.caches.replaceStrings = std::make_shared<ReplaceStringsCache>();
+    }
+    auto matcher = state.ctx.caches.replaceStrings->get(from);
+
     std::unordered_map<size_t, std::string> cache;
-    auto to = args[1]->listItems();
+    auto to = args[1]->listElems();
 
     NixStringContext context;
     auto s = state.forceString(*args[2], context, pos, "while evaluating the third argument passed to builtins.replaceStrings");
 
     std::string res;
-    // Loops one past last character to handle the case where 'from' contains an empty string.
-    for (size_t p = 0; p <= s.size(); ) {
-        bool found = false;
-        auto i = from.begin();
-        auto j = to.begin();
-        size_t j_index = 0;
-        for (; i != from.end(); ++i, ++j, ++j_index)
-            if (s.compare(p, i->size(), *i) == 0) {
-                found = true;
-                auto v = cache.find(j_index);
-                if (v == cache.end()) {
-                    NixStringContext ctx;
-                    auto ts = state.forceString(**j, ctx, pos, "while evaluating one of the replacement strings passed to builtins.replaceStrings");
-                    v = (cache.emplace(j_index, ts)).first;
-                    for (auto& path : ctx)
-                        context.insert(path);
-                }
-                res += v->second;
-                if (i->empty()) {
-                    if (p < s.size())
-                        res += s[p];
-                    p++;
-                } else {
-                    p += i->size();
-                }
-                break;
-            }
-        if (!found) {
+    // Goes up to one past the last character to handle the case where 'from' contains an empty string.
+    size_t p = 0;
+    while (p <= s.size()) {
+        auto match = matcher->find(s, p);
+        if (!match)
+            break;
+
+        res.append(s.substr(p, match->start - p));
+
+        auto v = cache.find(match->pattern);
+        if (v == cache.end()) {
+            NixStringContext ctx;
+            auto ts = state.forceString(*to[match->pattern], ctx, pos, "while evaluating one of the replacement strings passed to builtins.replaceStrings");
+            v = (cache.emplace(match->pattern, ts)).first;
+            for (auto& path : ctx)
+                context.insert(path);
+        }
+        res += v->second;
+
+        p = match->start + match->length;
+        if (match->length == 0) {
             if (p < s.size())
                 res += s[p];
             p++;
         }
     }
+    if (p < s.size())
+        res.append(s.substr(p));
 
     v.mkString(res, context);
 }
@@ -1,12 +1,14 @@
 #pragma once
 ///@file
 
+#include <array>
 #include <list>
 #include <map>
 #include <unordered_map>
 
 #include "lix/libutil/types.hh"
-#include "lix/libutil/chunked-vector.hh"
+#include "lix/libutil/concurrent-chunked-vector.hh"
+#include "lix/libutil/sync.hh"
 
 namespace nix {
 
@@ -51,6 +53,7 @@ public:
 class Symbol
 {
     friend class SymbolTable;
+    friend class Bindings;
 
 private:
     uint32_t id;
@@ -70,12 +73,20 @@ public:
 /**
  * Symbol table used by the parser and evaluator to represent and look
  * up identifiers and attributes efficiently.
+ *
+ * The table is safe to use from multiple threads. Interning a string locks
+ * only one of a number of shards selected by the hash of the string, while
+ * resolving a symbol back to its string never takes a lock at all.
  */
 class SymbolTable
 {
 private:
-    std::unordered_map<std::string_view, std::pair<const std::string *, uint32_t>> symbols;
-    ChunkedVector<std::string, 8192> store{16};
+    static constexpr size_t shardCount = 32;
+
+    using Shard = std::unordered_map<std::string_view, uint32_t>;
+
+    std::array<Sync<Shard>, shardCount> shards;
+    ConcurrentChunkedVector<std::string, 8192> store;
 
 public:
 
@@ -88,12 +99,12 @@ public:
         // for lookup performance.
         // TODO: could probably be done more efficiently with transparent Hash and Equals
         // on the original implementation using unordered_set
-        // FIXME: make this thread-safe.
-        auto it = symbols.find(s);
-        if (it != symbols.end()) return Symbol(it->second.second + 1);
+        auto shard(shards[std::hash<std::string_view>{}(s) % shardCount].lock());
+        auto it = shard->find(s);
+        if (it != shard->end()) return Symbol(it->second + 1);
 
         const auto & [rawSym, idx] = store.add(std::string(s));
-        symbols.emplace(rawSym, std::make_pair(&rawSym, idx));
+        shard->emplace(rawSym, idx);
         return Symbol(idx + 1);
     }
 
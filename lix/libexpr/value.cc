@@ -82,7 +82,7 @@ void Value::mkPrimOp(PrimOp * p)
 
 void Value::mkString(std::string_view s)
 {
-    mkString(gcCopyStringIfNeeded(s));
+    mkSizedString(gcCopySizedString(s));
 }
 
 void Value::mkString(std::string_view s, const NixStringContext & context)
@@ -93,7 +93,7 @@ void Value::mkString(std::string_view s, const NixStringContext & context)
 
 void Value::mkStringMove(const char * s, const NixStringContext & context)
 {
-    mkString(s);
+    mkSizedString(s);
     copyContextToValue(*this, context);
 }
 
@@ -38,7 +38,10 @@ typedef enum {
     tPrimOp,
     tPrimOpApp,
     tExternal,
-    tFloat
+    tFloat,
+    /// A string whose data was allocated with gcAllocSizedString(), so that its
+    /// length is known without scanning for the NUL terminator.
+    tSizedString,
 } InternalType;
 
 /**
@@ -275,8 +278,8 @@ public:
     /// The string data *is* copied from @ref copyFrom, and this constructor
     /// performs a dynamic (GC) allocation to do so.
     Value(string_t, std::string_view copyFrom, NixStringContext const & context = {})
-        : internalType(tString)
-        , string({ .s = gcCopyStringIfNeeded(copyFrom), .context = nullptr })
+        : internalType(tSizedString)
+        , string({ .s = gcCopySizedString(copyFrom), .context = nullptr })
     {
         if (context.empty()) {
             // It stays nullptr.
@@ -622,7 +625,7 @@ public:
         switch (internalType) {
             case tInt: return nInt;
             case tBool: return nBool;
-            case tString: return nString;
+            case tString: case tSizedString: return nString;
             case tPath: return nPath;
             case tNull: return nNull;
             case tAttrs: return nAttrs;
@@ -673,10 +676,25 @@ public:
         string.context = context;
     }
 
+    /**
+     * Like mkString(const char *, const char **), but `s` must have been
+     * allocated by gcAllocSizedString() or gcCopySizedString().
+     */
+    inline void mkSizedString(const char * s, const char * * context = 0)
+    {
+        internalType = tSizedString;
+        string.s = s;
+        string.context = context;
+    }
+
     void mkString(std::string_view s);
 
     void mkString(std::string_view s, const NixStringContext & context);
 
+    /**
+     * Take ownership of `s`, which must have been allocated by
+     * gcAllocSizedString(), and copy `context` into the value.
+     */
     void mkStringMove(const char * s, const NixStringContext & context);
 
     void mkPath(const SourcePath & path);
@@ -836,6 +854,9 @@ public:
 
     std::string_view str() const
     {
+        if (internalType == tSizedString) {
+            return std::string_view(string.s, gcSizedStringLength(string.s));
+        }
         assert(internalType == tString);
         return std::string_view(string.s);
     }
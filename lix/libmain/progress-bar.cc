@@ -513,7 +513,30 @@ std::string ProgressBar::getStatus(State & state)
         if (!s2.empty()) { res += " ("; res += s2; res += ')'; }
     }
 
-    showActivity(actFileTransfer, "%s MiB DL", "%.1f", MiB);
+    {
+        auto s = renderActivity(actFileTransfer, "%s MiB DL", "%.1f", MiB);
+        if (!s.empty()) {
+            auto & act = state.activitiesByType[actFileTransfer];
+            uint64_t downloaded = act.done;
+            for (auto & [actId, infoIt] : act.its) {
+                downloaded += infoIt->done;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            auto elapsed = std::chrono::duration<double>(now - state.downloadSampleTime).count();
+            if (elapsed >= 1) {
+                state.downloadRate = (downloaded - state.downloadedAtSample) / elapsed;
+                state.downloadedAtSample = downloaded;
+                state.downloadSampleTime = now;
+            }
+
+            if (!act.its.empty() && state.downloadRate > 0) {
+                s += fmt(" at %.1f MiB/s", state.downloadRate / MiB);
+            }
+            if (!res.empty()) res += ", ";
+            res += s;
+        }
+    }
 
     {
         auto s = renderActivity(actOptimiseStore, "%s paths optimised");
@@ -48,6 +48,14 @@ struct ProgressBar : public Logger
 
         uint64_t corruptedPaths = 0, untrustedPaths = 0;
 
+        /**
+         * Bytes downloaded by all file transfers at the last rate sample,
+         * and the download rate (in bytes per second) measured then.
+         */
+        uint64_t downloadedAtSample = 0;
+        ActInfo::TimePoint downloadSampleTime;
+        double downloadRate = 0;
+
         uint32_t paused = 1;
         bool haveUpdate = false;
     };
@@ -1,11 +1,13 @@
 #include "lix/libutil/archive.hh"
 #include "lix/libstore/binary-cache-store.hh"
 #include "lix/libutil/async-io.hh"
+#include "lix/libutil/chunking.hh"
 #include "lix/libutil/compression.hh"
 #include "lix/libstore/derivations.hh"
 #include "lix/libstore/fs-accessor.hh"
 #include "lix/libstore/nar-info.hh"
 #include "lix/libutil/json.hh"
+#include "lix/libutil/read-ahead.hh"
 #include "lix/libutil/result.hh"
 #include "lix/libutil/sync.hh"
 #include "lix/libstore/remote-fs-accessor.hh"
@@ -17,6 +19,8 @@
 #include "lix/libutil/strings.hh"
 
 #include <chrono>
+#include <deque>
+#include <future>
 #include <regex>
 #include <fstream>
 #include <sstream>
@@ -89,12 +93,9 @@ try {
 
     upsertFile(narInfoFile, narInfo->to_string(*this), "text/x-nix-narinfo");
 
-    {
-        auto state_(co_await state.lock());
-        state_->pathInfoCache.upsert(
-            std::string(narInfo->path.to_string()),
-            PathInfoCacheValue { .value = std::shared_ptr<NarInfo>(narInfo) });
-    }
+    pathInfoCache.upsert(
+        std::string(narInfo->path.to_string()),
+        PathInfoCacheValue { .value = std::shared_ptr<NarInfo>(narInfo) });
 
     if (diskCache)
         diskCache->upsertNarInfo(getUri(), std::string(narInfo->path.hashPart()), std::shared_ptr<NarInfo>(narInfo));
@@ -103,6 +104,105 @@ try {
     co_return result::current_exception();
 }
 
+static std::string compressionExtension(const std::string & method)
+{
+    return method == "xz" ? ".xz" :
+           method == "bzip2" ? ".bz2" :
+           method == "zstd" ? ".zst" :
+           method == "lzip" ? ".lzip" :
+           method == "lz4" ? ".lz4" :
+           method == "br" ? ".br" :
+           "";
+}
+
+/**
+ * How many chunks of a chunked NAR are uploaded or fetched at once.
+ */
+static constexpr size_t maxChunksInFlight = 8;
+
+static std::string chunkPath(std::string_view hash, const std::string & compression)
+{
+    return "chunks/" + std::string(hash) + compressionExtension(compression);
+}
+
+namespace {
+/**
+ * Splits a NAR into content-defined chunks, uploads every chunk that is not
+ * in the cache yet, and writes the chunk manifest to `manifestSink`. Up to
+ * `maxChunksInFlight` chunks are checked for and uploaded at once, since
+ * each check is a round trip to the cache.
+ */
+struct ChunkUploadSink : FinishSink
+{
+    BinaryCacheStore & store;
+    Sink & manifestSink;
+    ChunkingSink chunker;
+
+    /**
+     * Chunks of this NAR that are already uploaded or being uploaded.
+     */
+    std::set<std::string> seen;
+    std::deque<std::future<void>> pending;
+
+    /**
+     * Declared last so that its threads are stopped before anything they use
+     * is destroyed.
+     */
+    ThreadPool pool{"upload chunks", maxChunksInFlight};
+
+    ChunkUploadSink(BinaryCacheStore & store, Sink & manifestSink)
+        : store(store)
+        , manifestSink(manifestSink)
+        , chunker(store.config().chunkSize, [this](std::string_view chunk) { upload(chunk); })
+    {
+    }
+
+    void operator()(std::string_view data) override
+    {
+        chunker(data);
+    }
+
+    void finish() override
+    {
+        chunker.finish();
+        while (!pending.empty()) {
+            pending.front().get();
+            pending.pop_front();
+        }
+        pool.process();
+    }
+
+    void upload(std::string_view chunk)
+    {
+        checkInterrupt();
+
+        auto hash = hashString(HashType::SHA256, chunk).to_string(Base::Base32, false);
+        manifestSink(fmt("%s %d\n", hash, chunk.size()));
+        if (!seen.insert(hash).second) {
+            return;
+        }
+
+        if (pending.size() >= maxChunksInFlight) {
+            pending.front().get();
+            pending.pop_front();
+        }
+        pending.push_back(
+            pool.enqueueWithResult([&store{store}, hash, chunk{std::string(chunk)}] {
+                auto & config = store.config();
+                auto path = chunkPath(hash, config.compression);
+                if (!store.fileExists(path)) {
+                    store.upsertFile(
+                        path,
+                        compress(config.compression, chunk, false, config.compressionLevel),
+                        "application/octet-stream"
+                    );
+                }
+            })
+        );
+    }
+};
+}
+
 kj::Promise<Result<ref<const ValidPathInfo>>> BinaryCacheStore::addToStoreCommon(
     AsyncInputStream & narSource, RepairFlag repair, CheckSigsFlag checkSigs,
     std::function<ValidPathInfo(HashResult)> mkInfo)
@@ -119,15 +219,30 @@ try {
     HashSink fileHashSink { HashType::SHA256 };
     nar_index::Entry narIndex;
     HashSink narHashSink { HashType::SHA256 };
+    std::vector<uint64_t> compressedFrames;
     {
         FdSink fileSink(fdTemp.get());
         TeeSink teeSinkCompressed { fileSink, fileHashSink };
-        auto compressionSink = makeCompressionSink(
-            config().compression,
-            teeSinkCompressed,
-            config().parallelCompression,
-            config().compressionLevel
-        );
+        auto compressionSink = [&]() -> ref<FinishSink> {
+            if (config().chunkSize > 0) {
+                return make_ref<ChunkUploadSink>(*this, teeSinkCompressed);
+            }
+            if (config().compressionFrameSize > 0 && supportsCompressionFrames(config().compression)) {
+                return makeFramedCompressionSink(
+                    config().compression,
+                    teeSinkCompressed,
+                    config().compressionFrameSize,
+                    compressedFrames,
+                    config().compressionLevel
+                );
+            }
+            return makeCompressionSink(
+                config().compression,
+                teeSinkCompressed,
+                config().parallelCompression,
+                config().compressionLevel
+            );
+        }();
         TeeSink teeSinkUncompressed { *compressionSink, narHashSink };
         AsyncTeeInputStream teeSource { narSource, teeSinkUncompressed };
         narIndex = TRY_AWAIT(nar_index::create(teeSource));
@@ -140,17 +255,12 @@ try {
     auto info = mkInfo(narHashSink.finish());
     auto narInfo = make_ref<NarInfo>(info);
     narInfo->compression = config().compression;
+    narInfo->compressedFrames = std::move(compressedFrames);
     auto [fileHash, fileSize] = fileHashSink.finish();
     narInfo->fileHash = fileHash;
     narInfo->fileSize = fileSize;
     narInfo->url = "nar/" + narInfo->fileHash->to_string(Base::Base32, false) + ".nar"
-        + (config().compression == "xz" ? ".xz" :
-           config().compression == "bzip2" ? ".bz2" :
-           config().compression == "zstd" ? ".zst" :
-           config().compression == "lzip" ? ".lzip" :
-           config().compression == "lz4" ? ".lz4" :
-           config().compression == "br" ? ".br" :
-           "");
+        + (config().chunkSize > 0 ? std::string(chunkManifestSuffix) : compressionExtension(config().compression));
 
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
     printMsg(lvlTalkative, "copying path '%1%' (%2% bytes, compressed %3$.1f%% in %4% ms) to binary cache",
@@ -349,6 +459,98 @@ try {
     co_return result::current_exception();
 }
 
+/**
+ * Returns the uncompressed chunk `hash` of `size` bytes, reading it from the
+ * `local-chunk-cache` if it is there and fetching it from `store` otherwise.
+ */
+static std::string
+fetchChunk(BinaryCacheStore & store, const std::string & compression, const Hash & hash, uint64_t size)
+{
+    auto name = hash.to_string(Base::Base32, false);
+    auto path = chunkPath(name, compression);
+    auto & cacheDir = store.config().localChunkCache.get();
+
+    auto check = [&](const std::string & chunk) {
+        if (chunk.size() != size) {
+            throw Error("chunk '%s' has size %d, expected %d", name, chunk.size(), size);
+        }
+        if (hashString(HashType::SHA256, chunk) != hash) {
+            throw Error("chunk '%s' does not match its hash", name);
+        }
+    };
+
+    if (!cacheDir.empty()) {
+        try {
+            auto chunk = decompress(compression, readFile(cacheDir + "/" + path));
+            check(chunk);
+            return chunk;
+        } catch (Error &) {
+            /* Missing or damaged; fetch it again. */
+        }
+    }
+
+    auto compressed = store.getFile(path)->drain();
+    auto chunk = decompress(compression, compressed);
+    check(chunk);
+
+    if (!cacheDir.empty()) {
+        auto cachePath = cacheDir + "/" + path;
+        auto tmpPath = makeTempPath(cachePath);
+        try {
+            createDirs(dirOf(cachePath));
+            writeFile(tmpPath, compressed);
+            renameFile(tmpPath, cachePath);
+        } catch (...) {
+            deletePath(tmpPath);
+            ignoreExceptionExceptInterrupt();
+        }
+    }
+
+    return chunk;
+}
+
+/**
+ * Reassembles a chunked NAR from its manifest, fetching and decompressing a
+ * few chunks ahead of the consumer.
+ */
+static WireFormatGenerator
+fetchChunks(BinaryCacheStore & store, std::string compression, std::string manifest)
+{
+    auto lines = tokenizeString<std::vector<std::string>>(manifest, "\n");
+    std::deque<std::future<std::string>> pending;
+    size_t next = 0;
+
+    /* Declared last so that its threads are stopped before anything they
+       use is destroyed. */
+    ThreadPool pool{"fetch chunks", maxChunksInFlight};
+
+    while (next < lines.size() || !pending.empty()) {
+        while (next < lines.size() && pending.size() < maxChunksInFlight) {
+            auto fields = tokenizeString<std::vector<std::string>>(lines[next++], " ");
+            auto size = fields.size() == 2 ? string2Int<uint64_t>(fields[1]) : std::nullopt;
+            /* The hash becomes part of the chunk's path in the cache, so
+               only accept exactly what upload() writes. */
+            std::optional<Hash> hash;
+            if (size && fields[0].size() == Hash(HashType::SHA256).base32Len()) {
+                try {
+                    hash = Hash::parseNonSRIUnprefixed(fields[0], HashType::SHA256);
+                } catch (BadHash &) {
+                }
+            }
+            if (!hash) {
+                throw Error("chunk manifest line '%s' is corrupt", lines[next - 1]);
+            }
+            pending.push_back(pool.enqueueWithResult([&store, compression, hash{*hash}, size{*size}] {
+                return fetchChunk(store, compression, hash, size);
+            }));
+        }
+
+        auto chunk = pending.front().get();
+        pending.pop_front();
+        co_yield std::span<const char>{chunk.data(), chunk.size()};
+    }
+}
+
 kj::Promise<Result<box_ptr<Source>>> BinaryCacheStore::narFromPath(const StorePath & storePath)
 try {
     auto info = TRY_AWAIT(queryPathInfo(storePath)).cast<const NarInfo>();
@@ -356,24 +558,43 @@ try {
     try {
         auto file = getFile(info->url);
         co_return make_box_ptr<GeneratorSource>(
-            [](auto info, auto file, auto & stats) -> WireFormatGenerator {
-                constexpr size_t buflen = 65536;
-                auto buf = std::make_unique<char[]>(buflen);
+            [](auto info, auto file, auto & store, auto & stats) -> WireFormatGenerator {
                 size_t total = 0;
-                auto decompressor = makeDecompressionSource(info->compression, *file);
-                try {
-                    while (true) {
-                        const auto len = decompressor->read(buf.get(), buflen);
-                        co_yield std::span{buf.get(), len};
-                        total += len;
+
+                if (info->isChunked()) {
+                    co_yield fetchChunks(store, info->compression, file->drain());
+                    stats.narRead++;
+                    stats.narReadBytes += info->narSize;
+                    co_return;
+                }
+
+                std::unique_ptr<Source> decompressor;
+                /* Download and decompress on separate threads, so that the
+                   consumer (usually hashing and unpacking the NAR into the
+                   store) runs in parallel with decompression. Framed NARs
+                   additionally decompress several frames at once. */
+                auto decompressed = [&] {
+                    if (!info->compressedFrames.empty()) {
+                        return decompressFrames(
+                            info->compression,
+                            *file,
+                            info->compressedFrames,
+                            info->fileSize,
+                            info->narSize
+                        );
                     }
-                } catch (EndOfFile &) {
+                    decompressor = makeDecompressionSource(info->compression, *file);
+                    return readAhead(*decompressor);
+                }();
+                while (auto data = decompressed.next()) {
+                    co_yield *data;
+                    total += data->size();
                 }
 
                 stats.narRead++;
                 // stats.narReadCompressedBytes += nar->size(); // FIXME
                 stats.narReadBytes += total;
-            }(std::move(info), std::move(file), stats)
+            }(std::move(info), std::move(file), *this, stats)
         );
     } catch (NoSuchBinaryCacheFile & e) {
         throw SubstituteGone(std::move(e.info()));
@@ -46,6 +46,38 @@ struct BinaryCacheStoreConfig : virtual StoreConfig
           The meaning and accepted values depend on the compression method selected.
           `-1` specifies that the default compression level should be used.
         )"};
+
+    const Setting<uint64_t> chunkSize{this, 0, "chunk-size",
+        R"(
+          If non-zero, store NARs as content-defined chunks of about this
+          many bytes (which must be a power of two) instead of as a single
+          file. Chunks are compressed individually and shared between all
+          NARs that contain them, so similar store paths only upload and
+          store the chunks that differ. The `.narinfo` of such a NAR names
+          its manifest in a `ChunkManifest` field instead of `URL`. Clients
+          that do not support chunked NARs reject it as corrupt; they can
+          only substitute from such a cache with `--fallback`.
+        )"};
+
+    const Setting<Path> localChunkCache{this, "", "local-chunk-cache",
+        R"(
+          Path to a local cache of the chunks of chunked NARs fetched from
+          this binary cache. Chunks found there are not downloaded again, so
+          substituting a new version of a store path only fetches the chunks
+          that changed. Nothing is ever removed from this cache.
+        )"};
+
+    const Setting<uint64_t> compressionFrameSize{this, 0, "compression-frame-size",
+        R"(
+          If non-zero, compress NARs as a sequence of independent frames of
+          this many uncompressed bytes, and list the compressed frame sizes
+          in the `CompressedFrames` field of the `.narinfo`. Clients that
+          understand this field decompress the frames in parallel; all
+          others read the NAR as a single stream. Frames are compressed in
+          parallel as well. This is only available for `xz` and `zstd` and
+          is ignored for other compression methods. Frames may be at most
+          64 MiB.
+        )"};
 };
 
 
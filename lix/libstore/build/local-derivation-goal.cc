@@ -2095,9 +2095,9 @@ try {
         else {
             debug("scanning for references for output '%s' in temp location '%s'", outputName, actualPath);
 
-            /* Pass blank Sink as we are not ready to hash data at this stage. */
-            NullSink blank;
-            references = scanForReferences(blank, actualPath, referenceablePaths);
+            /* We are not ready to hash data at this stage, so there is no
+               need to produce a NAR and the files can be scanned in parallel. */
+            references = scanForReferencesParallel(actualPath, referenceablePaths);
         }
 
         outputReferencesIfUnregistered.insert_or_assign(
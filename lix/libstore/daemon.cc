@@ -265,7 +265,7 @@ struct ClientSettings
 
 static void performOp(AsyncIoRoot & aio, TunnelLogger * logger, ref<Store> store,
     TrustedFlag trusted, RecursiveFlag recursive, WorkerProto::Version clientVersion,
-    Source & from, BufferedSink & to, WorkerProto::Op op)
+    Source & from, FdSink & to, WorkerProto::Op op)
 {
     WorkerProto::ReadConn rconn{from, clientVersion};
     WorkerProto::WriteConn wconn{clientVersion};
@@ -885,7 +885,7 @@ static void performOp(AsyncIoRoot & aio, TunnelLogger * logger, ref<Store> store
         auto path = store->parseStorePath(readString(from));
         logger->startWork();
         logger->stopWork();
-        to << dumpPath(store->toRealPath(path));
+        dumpPath(store->toRealPath(path), to);
         break;
     }
 
@@ -24,8 +24,11 @@
 #include <curl/curl.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <cstring>
+#include <deque>
 #include <random>
 #include <thread>
 #include <regex>
@@ -44,6 +47,27 @@ struct FileTransferResultWithEncoding : FileTransferResult
     // empty string means identity (cf makeDecompressionSource)
     std::string encoding;
 };
+
+/**
+ * Host part of a URI, used to apply per-host transfer limits. Returns an
+ * empty string for URIs without a host (or that curl cannot parse).
+ */
+std::string uriHost(const std::string & uri)
+{
+    auto url = curl_url();
+    if (!url) {
+        throw std::bad_alloc();
+    }
+    KJ_DEFER(curl_url_cleanup(url));
+    char * host = nullptr;
+    if (curl_url_set(url, CURLUPART_URL, uri.c_str(), 0) != CURLUE_OK
+        || curl_url_get(url, CURLUPART_HOST, &host, 0) != CURLUE_OK)
+    {
+        return "";
+    }
+    KJ_DEFER(curl_free(host));
+    return host;
+}
 }
 
 struct curlFileTransfer : public FileTransfer
@@ -62,6 +86,9 @@ struct curlFileTransfer : public FileTransfer
         };
 
         std::string uri;
+        std::string host;
+        Priority priority;
+        std::chrono::steady_clock::time_point enqueued;
         FileTransferResultWithEncoding result;
         Activity act;
         std::unique_ptr<FILE, decltype([](FILE * f) { fclose(f); })> uploadData;
@@ -111,9 +138,12 @@ struct curlFileTransfer : public FileTransfer
             ActivityId parentAct,
             std::optional<std::string_view> uploadData,
             bool noBody,
-            curl_off_t writtenToSink
+            curl_off_t writtenToSink,
+            Priority priority
         )
             : uri(uri)
+            , host(uriHost(uri))
+            , priority(priority)
             , act(*logger, lvlTalkative, actFileTransfer,
                 fmt(uploadData ? "uploading '%s'" : "downloading '%s'", uri),
                 {uri}, parentAct)
@@ -481,6 +511,8 @@ struct curlFileTransfer : public FileTransfer
 
     Sync<State> state_;
 
+    Stats<std::atomic> stats;
+
     std::thread workerThread;
 
     curlFileTransfer(unsigned int baseRetryTimeMs)
@@ -547,14 +579,84 @@ struct curlFileTransfer : public FileTransfer
 
         std::map<CURL *, std::shared_ptr<TransferItem>> items;
 
+        /* Transfers not yet handed to curl, by priority. Metadata transfers
+           always start right away; bulk transfers wait until both their host
+           and the whole worker have a free bulk slot. Bulk transfers never
+           take all of the `http-connections` that curl allows, so that later
+           metadata transfers are not queued behind them inside curl. */
+        std::deque<std::shared_ptr<TransferItem>> pendingBulk;
+        std::map<std::string, size_t> activePerHost;
+        size_t activeBulk = 0;
+        const size_t totalLimit = fileTransferSettings.httpConnections;
+        const size_t bulkLimit =
+            totalLimit > 1 ? totalLimit - std::max<size_t>(1, totalLimit / 5) : totalLimit;
+        const size_t hostLimit = fileTransferSettings.httpConnectionsPerHost
+            ? fileTransferSettings.httpConnectionsPerHost
+            : bulkLimit;
+
         // clear all current transfers in case of an early exit, as can happen
         // via Interrupted if the interruption occured right before a log call
         KJ_DEFER({
             for (auto & [_, item] : items) {
                 item->finish(CURLE_ABORTED_BY_CALLBACK);
             }
+            for (auto & item : pendingBulk) {
+                item->finish(CURLE_ABORTED_BY_CALLBACK);
+            }
         });
 
+        auto start = [&](const std::shared_ptr<TransferItem> & item) {
+            uint64_t waitMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - item->enqueued
+            ).count();
+            debug("starting %s of %s after %d ms in queue", item->verb(), item->uri, waitMs);
+            curl_multi_add_handle(curlm.get(), item->req.get());
+            items[item->req.get()] = item;
+            if (item->priority == Priority::Metadata) {
+                stats.metadataTransfers++;
+                stats.metadataQueueWaitMs += waitMs;
+            } else {
+                activePerHost[item->host]++;
+                activeBulk++;
+                stats.bulkTransfers++;
+                stats.bulkQueueWaitMs += waitMs;
+                // only this thread writes the maximum
+                if (waitMs > stats.bulkMaxQueueWaitMs) {
+                    stats.bulkMaxQueueWaitMs = waitMs;
+                }
+            }
+        };
+
+        auto remove = [&](std::map<CURL *, std::shared_ptr<TransferItem>>::iterator i) {
+            curl_multi_remove_handle(curlm.get(), i->second->req.get());
+            if (i->second->priority != Priority::Metadata) {
+                if (auto h = activePerHost.find(i->second->host); --h->second == 0) {
+                    activePerHost.erase(h);
+                }
+                activeBulk--;
+            }
+            items.erase(i);
+        };
+
+        auto activeFor = [&](const std::string & host) -> size_t {
+            auto i = activePerHost.find(host);
+            return i == activePerHost.end() ? 0 : i->second;
+        };
+
+        auto startPending = [&] {
+            for (auto i = pendingBulk.begin(); i != pendingBulk.end();) {
+                if (bulkLimit != 0 && activeBulk >= bulkLimit) {
+                    break;
+                }
+                if (hostLimit == 0 || activeFor((*i)->host) < hostLimit) {
+                    start(*i);
+                    i = pendingBulk.erase(i);
+                } else {
+                    ++i;
+                }
+            }
+        };
+
         bool quit = false;
 
         // NOTE: we will need to use CURLMOPT_TIMERFUNCTION to integrate this
@@ -565,8 +667,11 @@ struct curlFileTransfer : public FileTransfer
             {
                 auto cancel = [&] { return std::move(state_.lock()->cancel); }();
                 for (auto & [item, promise] : cancel) {
-                    curl_multi_remove_handle(curlm.get(), item->req.get());
-                    items.erase(item->req.get());
+                    if (auto i = items.find(item->req.get()); i != items.end()) {
+                        remove(i);
+                    } else {
+                        std::erase(pendingBulk, item);
+                    }
                     promise.set_value();
                 }
             }
@@ -585,14 +690,15 @@ struct curlFileTransfer : public FileTransfer
                     auto i = items.find(msg->easy_handle);
                     assert(i != items.end());
                     i->second->finish(msg->data.result);
-                    curl_multi_remove_handle(curlm.get(), i->second->req.get());
-                    items.erase(i);
+                    remove(i);
                 }
             }
 
+            startPending();
+
             // only exit when all transfers are done (which will happen through the
             // progress callback issuing an abort in the case of user interruption)
-            if (items.empty() && quit) {
+            if (items.empty() && pendingBulk.empty() && quit) {
                 break;
             }
 
@@ -623,10 +729,13 @@ struct curlFileTransfer : public FileTransfer
             }
 
             for (auto & item : incoming) {
-                debug("starting %s of %s", item->verb(), item->uri);
-                curl_multi_add_handle(curlm.get(), item->req.get());
-                items[item->req.get()] = item;
+                if (item->priority == Priority::Metadata) {
+                    start(item);
+                } else {
+                    pendingBulk.push_back(item);
+                }
             }
+            startPending();
         }
 
         debug("download thread shutting down");
@@ -664,6 +773,7 @@ struct curlFileTransfer : public FileTransfer
             auto state(state_.lock());
             if (state->quit)
                 throw nix::Error("cannot enqueue download request because the download thread is shutting down");
+            item->enqueued = std::chrono::steady_clock::now();
             state->incoming.push_back(item);
         }
         wakeup();
@@ -687,7 +797,18 @@ struct curlFileTransfer : public FileTransfer
 
     void upload(const std::string & uri, std::string data, const Headers & headers) override
     {
-        enqueueFileTransfer(uri, headers, std::move(data), false);
+        enqueueFileTransfer(uri, headers, std::move(data), false, Priority::Bulk);
+    }
+
+    Stats<> getStats() override
+    {
+        return {
+            stats.metadataTransfers,
+            stats.metadataQueueWaitMs,
+            stats.bulkTransfers,
+            stats.bulkQueueWaitMs,
+            stats.bulkMaxQueueWaitMs,
+        };
     }
 
     std::optional<std::pair<FileTransferResult, box_ptr<Source>>> tryEagerTransfers(
@@ -781,14 +902,16 @@ struct curlFileTransfer : public FileTransfer
         const std::string & uri,
         const Headers & headers,
         std::optional<std::string> data,
-        bool noBody
+        bool noBody,
+        Priority priority
     )
     {
         if (auto eager = tryEagerTransfers(uri, headers, data, noBody)) {
             return std::move(*eager);
         }
 
-        auto source = make_box_ptr<TransferSource>(*this, uri, headers, std::move(data), noBody);
+        auto source =
+            make_box_ptr<TransferSource>(*this, uri, headers, std::move(data), noBody, priority);
         source->awaitData();
         return {source->metadata, make_box_ptr<DecompressionWrapper>(std::move(source))};
     }
@@ -800,6 +923,7 @@ struct curlFileTransfer : public FileTransfer
         Headers headers;
         std::optional<std::string> data;
         bool noBody;
+        Priority priority;
         ActivityId parentAct = getCurActivity();
 
         std::shared_ptr<TransferItem> transfer;
@@ -816,13 +940,15 @@ struct curlFileTransfer : public FileTransfer
             const std::string & uri,
             const Headers & headers,
             std::optional<std::string> data,
-            bool noBody
+            bool noBody,
+            Priority priority
         )
             : parent(parent)
             , uri(uri)
             , headers(headers)
             , data(std::move(data))
             , noBody(noBody)
+            , priority(priority)
         {
             auto setup = [&] { return startTransfer(uri); };
             metadata = withRetries(setup, setup);
@@ -869,8 +995,9 @@ struct curlFileTransfer : public FileTransfer
         {
             attempt += 1;
             auto uploadData = data ? std::optional(std::string_view(*data)) : std::nullopt;
-            transfer =
-                std::make_shared<TransferItem>(uri, headers, parentAct, uploadData, noBody, offset);
+            transfer = std::make_shared<TransferItem>(
+                uri, headers, parentAct, uploadData, noBody, offset, priority
+            );
             parent.enqueueItem(transfer);
             return transfer->metadataPromise.get_future().get();
         }
@@ -985,7 +1112,7 @@ struct curlFileTransfer : public FileTransfer
     bool exists(const std::string & uri, const Headers & headers) override
     {
         try {
-            enqueueFileTransfer(uri, headers, std::nullopt, true);
+            enqueueFileTransfer(uri, headers, std::nullopt, true, Priority::Metadata);
             return true;
         } catch (FileTransferError & e) {
             /* S3 buckets return 403 if a file doesn't exist and the
@@ -997,9 +1124,9 @@ struct curlFileTransfer : public FileTransfer
     }
 
     std::pair<FileTransferResult, box_ptr<Source>>
-    download(const std::string & uri, const Headers & headers) override
+    download(const std::string & uri, const Headers & headers, Priority priority) override
     {
-        return enqueueFileTransfer(uri, headers, std::nullopt, false);
+        return enqueueFileTransfer(uri, headers, std::nullopt, false, priority);
     }
 };
 
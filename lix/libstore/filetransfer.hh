@@ -10,6 +10,7 @@
 
 #include <string>
 #include <future>
+#include <type_traits>
 
 namespace nix {
 
@@ -37,6 +38,28 @@ struct FileTransfer
 {
     virtual ~FileTransfer() { }
 
+    /**
+     * Transfers with a higher priority are started before queued transfers
+     * with a lower priority, and are not held back by the per-host limit.
+     */
+    enum class Priority { Bulk, Metadata };
+
+    /**
+     * Number of transfers started so far, and how long they waited to be
+     * started, by priority.
+     */
+    template<template<typename> typename Wrapper = std::type_identity_t>
+    struct Stats
+    {
+        Wrapper<uint64_t> metadataTransfers{0};
+        Wrapper<uint64_t> metadataQueueWaitMs{0};
+        Wrapper<uint64_t> bulkTransfers{0};
+        Wrapper<uint64_t> bulkQueueWaitMs{0};
+        Wrapper<uint64_t> bulkMaxQueueWaitMs{0};
+    };
+
+    virtual Stats<> getStats() = 0;
+
     /**
      * Upload some data. May throw a FileTransferError exception.
      */
@@ -62,8 +85,9 @@ struct FileTransfer
      * thrown by the returned source. The source will only throw errors detected
      * during the transfer itself (decompression errors, connection drops, etc).
      */
-    virtual std::pair<FileTransferResult, box_ptr<Source>>
-    download(const std::string & uri, const Headers & headers = {}) = 0;
+    virtual std::pair<FileTransferResult, box_ptr<Source>> download(
+        const std::string & uri, const Headers & headers = {}, Priority priority = Priority::Bulk
+    ) = 0;
 
     enum Error { NotFound, Forbidden, Misc, Transient, Interrupted };
 };
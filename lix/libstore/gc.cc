@@ -10,7 +10,9 @@
 #include "lix/libutil/unix-domain-socket.hh"
 #include "lix/libutil/strings.hh"
 #include "lix/libutil/thread-name.hh"
+#include "lix/libutil/thread-pool.hh"
 
+#include <future>
 #include <kj/async.h>
 #include <queue>
 #include <regex>
@@ -653,9 +655,17 @@ try {
     if (auto p = getEnv("_NIX_TEST_GC_SYNC_2"))
         readFile(*p);
 
-    /* Helper function that deletes a path from the store and throws
-       GCLimitReached if we've deleted enough garbage. */
-    auto deleteFromStore = [&](std::string_view baseName)
+    auto checkLimit = [&]() {
+        if (results.bytesFreed > options.maxFreed) {
+            printInfo("deleted more than %d bytes; stopping", options.maxFreed);
+            throw GCLimitReached();
+        }
+    };
+
+    /* Helper function that deletes a path from the store and, if
+       `limit` is set, throws GCLimitReached if we've deleted enough
+       garbage. */
+    auto deleteFromStore = [&](std::string_view baseName, bool limit = true)
     {
         Path path = config().storeDir + "/" + std::string(baseName);
         Path realPath = config().realStoreDir + "/" + std::string(baseName);
@@ -679,13 +689,36 @@ try {
         deletePath(realPath, bytesFreed);
         results.bytesFreed += bytesFreed;
 
-        if (results.bytesFreed > options.maxFreed) {
-            printInfo("deleted more than %d bytes; stopping", options.maxFreed);
-            throw GCLimitReached();
+        if (limit) checkLimit();
+    };
+
+    /* Deletes already invalidated store paths from disk in parallel.
+       Removing the files is by far the most expensive part of collecting
+       garbage, and unlike invalidation it does not need the database.
+       A single pool serves the whole collection. */
+    ThreadPool deleter{"GC deleter"};
+
+    auto deletePathsFromStore = [&](const std::vector<StorePath> & paths) {
+        std::vector<std::future<uint64_t>> pending;
+        for (auto & path : paths) {
+            printInfo("deleting '%1%'", printStorePath(path));
+            results.paths.insert(printStorePath(path));
+            pending.push_back(deleter.enqueueWithResult(
+                [realPath{config().realStoreDir + "/" + std::string(path.to_string())}] {
+                    uint64_t freed;
+                    deletePath(realPath, freed);
+                    return freed;
+                }
+            ));
+        }
+        for (auto & freed : pending) {
+            results.bytesFreed += freed.get();
         }
     };
 
-    std::map<StorePath, StorePathSet> referrersCache;
+    /* Reference edges of the whole store by database row id, if they
+       were read in bulk. Paths missing from it have no referrers. */
+    std::optional<ReferrerIds> allReferrers;
 
     /* Helper function that visits all paths reachable from `start`
        via the referrers edges and optionally derivers and derivation
@@ -759,14 +792,12 @@ try {
                 if (TRY_AWAIT(isValidPath(*path))) {
 
                     /* Visit the referrers of this path. */
-                    auto i = referrersCache.find(*path);
-                    if (i == referrersCache.end()) {
-                        StorePathSet referrers;
+                    StorePathSet referrers;
+                    if (allReferrers)
+                        referrers = TRY_AWAIT(queryReferrersByIds(*path, *allReferrers));
+                    else
                         TRY_AWAIT(queryReferrers(*path, referrers));
-                        referrersCache.emplace(*path, std::move(referrers));
-                        i = referrersCache.find(*path);
-                    }
-                    for (auto & p : i->second)
+                    for (auto & p : referrers)
                         enqueue(p);
 
                     /* If keep-derivations is set and this is a
@@ -791,21 +822,60 @@ try {
                 }
             }
 
+            /* Invalidate the dead paths in topological order, then
+               delete them from disk in batches. A batch is cut short
+               once its estimated size would reach `maxFreed`, so we
+               don't overshoot the limit by more than a single path.
+               Waiting clients are only released once the files of
+               every path they may be waiting on are gone. */
+            std::vector<StorePath> batch;
+            uint64_t batchSize = 0;
+
+            // NOLINTNEXTLINE(cppcoreguidelines-avoid-capturing-lambda-coroutines)
+            auto flush = [&]() -> kj::Promise<Result<void>> {
+                try {
+                    if (batch.empty()) co_return result::success();
+                    auto paths = std::move(batch);
+                    batch.clear();
+                    batchSize = 0;
+                    deletePathsFromStore(paths);
+                    checkLimit();
+                    co_return result::success();
+                } catch (...) {
+                    co_return result::current_exception();
+                }
+            };
+
             for (auto & path : TRY_AWAIT(topoSortPaths(visited))) {
                 if (!dead.insert(path).second) continue;
                 if (shouldDelete) {
+                    bool inUse = false;
                     try {
+                        uint64_t narSize = 0;
+                        if (options.maxFreed != std::numeric_limits<uint64_t>::max()) {
+                            try {
+                                narSize = TRY_AWAIT(queryPathInfo(path))->narSize;
+                            } catch (InvalidPath &) {
+                                /* Still deleted from disk below. */
+                            }
+                        }
                         TRY_AWAIT(invalidatePathChecked(path));
-                        deleteFromStore(path.to_string());
-                        referrersCache.erase(path);
+                        batch.push_back(path);
+                        batchSize += narSize;
                     } catch (PathInUse &) {
+                        inUse = true;
+                    }
+                    if (inUse) {
                         // References to upstream "bugs":
                         // https://github.com/NixOS/nix/issues/11923
                         // https://git.lix.systems/lix-project/lix/issues/621
                         printInfo("Skipping deletion of path '%1%' because it is now in use, preventing its removal.", printStorePath(path));
                     }
+                    if (results.bytesFreed + batchSize > options.maxFreed)
+                        TRY_AWAIT(flush());
                 }
             }
+            TRY_AWAIT(flush());
             co_return result::success();
         } catch (...) {
             co_return result::current_exception();
@@ -861,6 +931,12 @@ try {
             AutoCloseDir dir(opendir(config().realStoreDir.get().c_str()));
             if (!dir) throw SysError("opening directory '%1%'", config().realStoreDir);
 
+            /* We're going to visit most of the store, so read all
+               reference edges in one go instead of querying the
+               referrers of every path separately. Edges added after
+               this point are still checked by invalidatePathChecked(). */
+            allReferrers = TRY_AWAIT(queryAllReferrerIds());
+
             /* Read the store and delete all paths that are invalid or
                unreachable. We don't use readDirectory() here so that
                GCing can start faster. */
@@ -155,7 +155,12 @@ protected:
     {
         checkEnabled();
         try {
-            return getFileTransfer()->download(makeURI(path)).second;
+            /* Let small files overtake NAR downloads queued for this cache. */
+            const auto priority =
+                path.ends_with(".narinfo") || path.ends_with(".ls") || path == "nix-cache-info"
+                ? FileTransfer::Priority::Metadata
+                : FileTransfer::Priority::Bulk;
+            return getFileTransfer()->download(makeURI(path), {}, priority).second;
         } catch (FileTransferError & e) {
             if (e.error == FileTransfer::NotFound || e.error == FileTransfer::Forbidden)
                 throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
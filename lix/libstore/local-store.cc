@@ -16,16 +16,21 @@
 #include "lix/libutil/finally.hh"
 #include "lix/libutil/compression.hh"
 #include "lix/libutil/strings.hh"
+#include "lix/libutil/thread-pool.hh"
+#include "lix/libutil/tracepoint.hh"
 #include "lix/libutil/types.hh"
 
 #include <algorithm>
+#include <chrono>
 #include <cstring>
 
 #include <limits>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <new>
 #include <optional>
+#include <thread>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/select.h>
@@ -63,9 +68,12 @@ struct LocalStore::DBState::Stmts {
     SQLiteStmt RegisterValidPath;
     SQLiteStmt UpdatePathInfo;
     SQLiteStmt AddReference;
+    SQLiteStmt AddReferences;
     SQLiteStmt QueryPathInfo;
     SQLiteStmt QueryReferences;
     SQLiteStmt QueryReferrers;
+    SQLiteStmt QueryAllReferrers;
+    SQLiteStmt QueryPathById;
     SQLiteStmt InvalidatePath;
     SQLiteStmt AddDerivationOutput;
     SQLiteStmt RegisterRealisedOutput;
@@ -386,6 +394,13 @@ void LocalStore::initDB(DBState & state)
     prepareStatements(state);
 }
 
+/**
+ * Number of rows inserted into `Refs` by a single statement when registering
+ * paths in bulk. Two parameters per row keeps this well below SQLite's
+ * default limit of 999 bound parameters per statement.
+ */
+static constexpr size_t addReferencesBatchSize = 128;
+
 void LocalStore::prepareStatements(DBState & state)
 {
     /* Prepare SQL statements. */
@@ -395,12 +410,21 @@ void LocalStore::prepareStatements(DBState & state)
         "update ValidPaths set narSize = ?, hash = ?, ultimate = ?, sigs = ?, ca = ? where path = ?;");
     state.stmts->AddReference = state.db.create(
         "insert or replace into Refs (referrer, reference) values (?, ?);");
+    {
+        std::vector<std::string> rows(addReferencesBatchSize, "(?, ?)");
+        state.stmts->AddReferences = state.db.create(
+            "insert or replace into Refs (referrer, reference) values " + concatStringsSep(", ", rows) + ";");
+    }
     state.stmts->QueryPathInfo = state.db.create(
         "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;");
     state.stmts->QueryReferences = state.db.create(
         "select path from Refs join ValidPaths on reference = id where referrer = ?;");
     state.stmts->QueryReferrers = state.db.create(
         "select path from Refs join ValidPaths on referrer = id where reference = (select id from ValidPaths where path = ?);");
+    state.stmts->QueryAllReferrers = state.db.create(
+        "select reference, referrer from Refs;");
+    state.stmts->QueryPathById = state.db.create(
+        "select path from ValidPaths where id = ?;");
     state.stmts->InvalidatePath = state.db.create(
         "delete from ValidPaths where path = ?;");
     state.stmts->AddDerivationOutput = state.db.create(
@@ -897,11 +921,8 @@ try {
         }
     }
 
-    {
-        auto state_(co_await Store::state.lock());
-        state_->pathInfoCache.upsert(std::string(info.path.to_string()),
-            PathInfoCacheValue{ .value = std::make_shared<const ValidPathInfo>(info) });
-    }
+    pathInfoCache.upsert(std::string(info.path.to_string()),
+        PathInfoCacheValue{ .value = std::make_shared<const ValidPathInfo>(info) });
 
     co_return id;
 } catch (...) {
@@ -1082,6 +1103,53 @@ try {
 }
 
 
+kj::Promise<Result<LocalStore::ReferrerIds>> LocalStore::queryAllReferrerIds()
+try {
+    // NOLINTNEXTLINE(cppcoreguidelines-avoid-capturing-lambda-coroutines)
+    co_return TRY_AWAIT(retrySQLite([&]() -> kj::Promise<Result<ReferrerIds>> {
+        try {
+            auto state = co_await _dbState.lock();
+            auto use(state->stmts->QueryAllReferrers.use());
+            ReferrerIds res;
+            while (use.next())
+                res[use.getInt(0)].push_back(use.getInt(1));
+            co_return res;
+        } catch (...) {
+            co_return result::current_exception();
+        }
+    }));
+} catch (...) {
+    co_return result::current_exception();
+}
+
+
+kj::Promise<Result<StorePathSet>>
+LocalStore::queryReferrersByIds(const StorePath & path, const ReferrerIds & all)
+try {
+    // NOLINTNEXTLINE(cppcoreguidelines-avoid-capturing-lambda-coroutines)
+    co_return TRY_AWAIT(retrySQLite([&]() -> kj::Promise<Result<StorePathSet>> {
+        try {
+            auto state = co_await _dbState.lock();
+            StorePathSet referrers;
+            auto i = all.find(queryValidPathId(*state, path));
+            if (i != all.end()) {
+                for (auto id : i->second) {
+                    /* Referrers invalidated since `all` was read are gone. */
+                    auto use(state->stmts->QueryPathById.use()(int64_t(id)));
+                    if (use.next())
+                        referrers.insert(parseStorePath(use.getStr(0)));
+                }
+            }
+            co_return referrers;
+        } catch (...) {
+            co_return result::current_exception();
+        }
+    }));
+} catch (...) {
+    co_return result::current_exception();
+}
+
+
 kj::Promise<Result<StorePathSet>> LocalStore::queryValidDerivers(const StorePath & path)
 try {
     // NOLINTNEXTLINE(cppcoreguidelines-avoid-capturing-lambda-coroutines)
@@ -1217,21 +1285,57 @@ try {
             SQLiteTxn txn = state->db.beginTransaction(SQLiteTxnType::Immediate);
             StorePathSet paths;
 
+            TRACE(DTRACE_PROBE1(lix_store, register__paths__start, infos.size()));
+
+            /* Row IDs of all paths touched so far, so that references
+               between the paths being registered (the common case when
+               importing a closure) need not be looked up again. */
+            std::map<StorePath, uint64_t> ids;
+
             for (auto & [_, i] : infos) {
                 assert(i.narHash.type == HashType::SHA256);
-                if (isValidPath_(*state, i.path))
+                std::optional<uint64_t> id;
+                {
+                    auto use(state->stmts->QueryPathInfo.use()(printStorePath(i.path)));
+                    if (use.next())
+                        id = use.getInt(0);
+                }
+                if (id)
                     updatePathInfo(*state, i);
                 else
-                    TRY_AWAIT(addValidPath(*state, i, false));
+                    id = TRY_AWAIT(addValidPath(*state, i, false));
+                ids.emplace(i.path, *id);
                 paths.insert(i.path);
             }
 
+            TRACE(DTRACE_PROBE1(lix_store, register__paths__references, infos.size()));
+
+            auto resolve = [&](const StorePath & path) {
+                auto it = ids.find(path);
+                if (it == ids.end())
+                    it = ids.emplace(path, queryValidPathId(*state, path)).first;
+                return it->second;
+            };
+
+            std::vector<std::pair<uint64_t, uint64_t>> refs;
             for (auto & [_, i] : infos) {
-                auto referrer = queryValidPathId(*state, i.path);
+                auto referrer = ids.at(i.path);
                 for (auto & j : i.references)
-                    state->stmts->AddReference.use()(referrer)(queryValidPathId(*state, j)).exec();
+                    refs.emplace_back(referrer, resolve(j));
             }
 
+            size_t done = 0;
+            for (; refs.size() - done >= addReferencesBatchSize; done += addReferencesBatchSize) {
+                auto use(state->stmts->AddReferences.use());
+                for (size_t k = done; k < done + addReferencesBatchSize; k++)
+                    use(refs[k].first)(refs[k].second);
+                use.exec();
+            }
+            for (; done < refs.size(); done++)
+                state->stmts->AddReference.use()(refs[done].first)(refs[done].second).exec();
+
+            TRACE(DTRACE_PROBE1(lix_store, register__paths__derivations, infos.size()));
+
             /* Check that the derivation outputs are correct.  We can't do
                this in addValidPath() above, because the references might
                not be valid yet. */
@@ -1243,6 +1347,8 @@ try {
                     );
                 }
 
+            TRACE(DTRACE_PROBE1(lix_store, register__paths__toposort, infos.size()));
+
             /* Do a topological sort of the paths.  This will throw an
                error if a cycle is detected and roll back the
                transaction.  Cycles can only occur when a derivation
@@ -1260,6 +1366,7 @@ try {
                 }});
 
             txn.commit();
+            TRACE(DTRACE_PROBE1(lix_store, register__paths__done, infos.size()));
             co_return result::success();
         } catch (...) {
             co_return result::current_exception();
@@ -1281,10 +1388,7 @@ try {
     /* Note that the foreign key constraints on the Refs table take
        care of deleting the references entries for `path'. */
 
-    {
-        auto state_(co_await Store::state.lock());
-        state_->pathInfoCache.erase(std::string(path.to_string()));
-    }
+    pathInfoCache.erase(std::string(path.to_string()));
 
     co_return result::success();
 } catch (...) {
@@ -1738,52 +1842,150 @@ try {
 
         Hash nullHash(HashType::SHA256);
 
+        /* Hashing the paths is by far the slowest part, so do it on a
+           thread pool. Paths whose hash and size check out need nothing
+           else; all others are handled on this thread afterwards, since
+           they may need to update the database or repair the path. */
+        struct Checked
+        {
+            StorePath path;
+            std::shared_ptr<ValidPathInfo> info;
+            HashResult current{Hash(HashType::SHA256), 0};
+            std::optional<Error> error;
+        };
+
+        Sync<std::vector<Checked>> checked_;
+        std::atomic<uint64_t> nrDone{0}, nrFailed{0};
+        Activity act(*logger, lvlInfo, actVerifyPaths);
+
+        /* Paths that check out are recorded in a progress file, which is
+           removed once every path has been hashed. If it is still there, an
+           earlier run was interrupted, and the paths it already checked are
+           skipped (unless that run is more than a week old). */
+        auto progressPath = dbDir + "/verify-contents-progress";
+        StringSet alreadyChecked;
+        if (struct stat st; stat(progressPath.c_str(), &st) == 0 && st.st_mtime > time(0) - 7 * 24 * 3600) {
+            alreadyChecked = tokenizeString<StringSet>(readFile(progressPath), "\n");
+            printInfo("resuming an interrupted check, skipping %d paths", alreadyChecked.size());
+        }
+        AutoCloseFD progressFd{open(
+            progressPath.c_str(),
+            O_WRONLY | O_CREAT | O_CLOEXEC | (alreadyChecked.empty() ? O_TRUNC : O_APPEND),
+            0600
+        )};
+        if (!progressFd) {
+            throw SysError("opening '%s'", progressPath);
+        }
+
+        /* Hash the paths in the order of their inode numbers, which on most
+           file systems roughly follows their order on disk. */
+        std::vector<std::pair<ino_t, StorePath>> order;
         for (auto & i : validPaths) {
-            std::optional<Error> caught;
-            try {
-                auto info = std::const_pointer_cast<ValidPathInfo>(
-                    std::shared_ptr<const ValidPathInfo>(TRY_AWAIT(queryPathInfo(i)))
-                );
+            if (alreadyChecked.contains(std::string(i.to_string()))) {
+                continue;
+            }
+            struct stat st;
+            order.emplace_back(lstat(Store::toRealPath(i).c_str(), &st) == 0 ? st.st_ino : 0, i);
+        }
+        std::sort(order.begin(), order.end());
+
+        /* Spread `verify-rate-limit` over all jobs by letting each of them
+           reserve the time it takes to read a path at that rate before
+           reading it. */
+        Sync<std::chrono::steady_clock::time_point> nextRead_{std::chrono::steady_clock::now()};
+        auto throttle = [&](uint64_t bytes) {
+            if (!settings.verifyRateLimit) return;
+            auto wakeup = [&] {
+                auto nextRead(nextRead_.lock());
+                auto wakeup = std::max(*nextRead, std::chrono::steady_clock::now());
+                *nextRead = wakeup
+                    + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(double(bytes) / settings.verifyRateLimit)
+                    );
+                return wakeup;
+            }();
+            std::this_thread::sleep_until(wakeup);
+        };
 
-                /* Check the content hash (optionally - slow). */
-                printMsg(lvlTalkative, "checking contents of '%s'", printStorePath(i));
+        {
+            ThreadPool pool{"verifyStore pool", settings.verifyJobs};
 
-                auto hashSink = HashSink(info->narHash.type);
+            for (auto & [_, i] : order) {
+                pool.enqueueWithAio([&, path{i}](AsyncIoRoot & aio) {
+                    Checked c{.path = path};
+                    try {
+                        c.info = std::const_pointer_cast<ValidPathInfo>(
+                            std::shared_ptr<const ValidPathInfo>(aio.blockOn(queryPathInfo(path)))
+                        );
 
-                hashSink << dumpPath(Store::toRealPath(i));
-                auto current = hashSink.finish();
+                        throttle(c.info->narSize);
 
-                if (info->narHash != nullHash && info->narHash != current.first) {
-                    printError("path '%s' was modified! expected hash '%s', got '%s'",
-                        printStorePath(i), info->narHash.to_string(Base::SRI, true), current.first.to_string(Base::SRI, true));
-                    if (repair) TRY_AWAIT(repairPath(i)); else errors = true;
-                } else {
+                        /* Check the content hash (optionally - slow). */
+                        printMsg(lvlTalkative, "checking contents of '%s'", printStorePath(path));
 
-                    bool update = false;
+                        auto hashSink = HashSink(c.info->narHash.type);
 
-                    /* Fill in missing hashes. */
-                    if (info->narHash == nullHash) {
-                        printInfo("fixing missing hash on '%s'", printStorePath(i));
-                        info->narHash = current.first;
-                        update = true;
+                        hashSink << dumpPath(Store::toRealPath(path));
+                        c.current = hashSink.finish();
+                    } catch (Error & e) {
+                        c.error = std::move(e);
+                        nrFailed++;
                     }
 
-                    /* Fill in missing narSize fields (from old stores). */
-                    if (info->narSize == 0) {
-                        printInfo("updating size field on '%s' to %s", printStorePath(i), current.second);
-                        info->narSize = current.second;
-                        update = true;
+                    if (c.error || c.info->narHash == nullHash || c.info->narSize == 0
+                        || c.info->narHash != c.current.first)
+                    {
+                        checked_.lock()->push_back(std::move(c));
+                    } else {
+                        writeFull(progressFd.get(), std::string(path.to_string()) + "\n");
                     }
+                    act.progress(++nrDone, order.size(), 0, nrFailed);
+                });
+            }
 
-                    if (update) {
-                        auto state(co_await _dbState.lock());
-                        updatePathInfo(*state, *info);
-                    }
+            TRY_AWAIT(pool.processAsync());
+        }
 
-                }
+        progressFd.close();
+        deletePath(progressPath);
 
-            } catch (Error & e) {
-                caught = std::move(e);
+        auto checked = std::move(*checked_.lock());
+
+        for (auto & [i, info, current, error] : checked) {
+            std::optional<Error> caught = std::move(error);
+            if (!caught) {
+                try {
+                    if (info->narHash != nullHash && info->narHash != current.first) {
+                        printError("path '%s' was modified! expected hash '%s', got '%s'",
+                            printStorePath(i), info->narHash.to_string(Base::SRI, true), current.first.to_string(Base::SRI, true));
+                        if (repair) TRY_AWAIT(repairPath(i)); else errors = true;
+                    } else {
+
+                        bool update = false;
+
+                        /* Fill in missing hashes. */
+                        if (info->narHash == nullHash) {
+                            printInfo("fixing missing hash on '%s'", printStorePath(i));
+                            info->narHash = current.first;
+                            update = true;
+                        }
+
+                        /* Fill in missing narSize fields (from old stores). */
+                        if (info->narSize == 0) {
+                            printInfo("updating size field on '%s' to %s", printStorePath(i), current.second);
+                            info->narSize = current.second;
+                            update = true;
+                        }
+
+                        if (update) {
+                            auto state(co_await _dbState.lock());
+                            updatePathInfo(*state, *info);
+                        }
+
+                    }
+                } catch (Error & e) {
+                    caught = std::move(e);
+                }
             }
             if (caught) {
                 /* It's possible that the path got GC'ed, so ignore
@@ -15,6 +15,7 @@
 #include <string>
 #include <mutex>
 #include <memory>
+#include <unordered_map>
 #include <unordered_set>
 
 
@@ -267,6 +268,25 @@ private:
 
     AutoCloseFD openGCLock();
 
+    /**
+     * Referrers of valid paths by the `ValidPaths` row ids of both ends.
+     */
+    using ReferrerIds = std::unordered_map<uint64_t, std::vector<uint64_t>>;
+
+    /**
+     * Return the referrers of every valid path that has any, read in a
+     * single pass over the `Refs` table without touching any paths. Much
+     * cheaper than calling queryReferrers() for each path when most of the
+     * store is visited.
+     */
+    kj::Promise<Result<ReferrerIds>> queryAllReferrerIds();
+
+    /**
+     * Return the referrers of `path` recorded in `all`, as far as they are
+     * still valid. Only the paths of these referrers are read.
+     */
+    kj::Promise<Result<StorePathSet>> queryReferrersByIds(const StorePath & path, const ReferrerIds & all);
+
 public:
 
     kj::Promise<Result<Roots>> findRoots(bool censor) override;
@@ -1,6 +1,9 @@
 #include "lix/libstore/nar-info-disk-cache.hh"
+#include "lix/libutil/file-descriptor.hh"
+#include "lix/libutil/file-system.hh"
 #include "lix/libutil/logging.hh"
 #include "lix/libutil/sync.hh"
+#include "lix/libstore/pathlocks.hh"
 #include "lix/libstore/sqlite.hh"
 #include "lix/libstore/globals.hh"
 #include "lix/libutil/json.hh"
@@ -8,7 +11,18 @@
 #include "lix/libutil/users.hh"
 #include "lix/libutil/strings.hh"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <span>
+#include <thread>
+
 #include <sqlite3.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 namespace nix {
 
@@ -37,6 +51,7 @@ create table if not exists NARs (
     deriver          text,
     sigs             text,
     ca               text,
+    compressedFrames text,
     timestamp        integer not null,
     present          integer not null,
     primary key (cache, hashPart),
@@ -59,6 +74,195 @@ create table if not exists LastPurge (
 
 )sql";
 
+static std::string renderCompressedFrames(const std::vector<uint64_t> & frames)
+{
+    Strings sizes;
+    for (auto size : frames)
+        sizes.push_back(std::to_string(size));
+    return concatStringsSep(" ", sizes);
+}
+
+/**
+ * Frame sizes that cannot be parsed are dropped, which only costs the reader
+ * parallel decompression: the NAR is then read as a single stream.
+ */
+static std::vector<uint64_t> parseCompressedFrames(std::string_view s)
+{
+    std::vector<uint64_t> frames;
+    for (auto & size : tokenizeString<Strings>(s, " ")) {
+        auto n = string2Int<uint64_t>(size);
+        if (!n) return {};
+        frames.push_back(*n);
+    }
+    return frames;
+}
+
+namespace {
+
+/**
+ * Read-only snapshot of the positive entries of the NARs table, written next
+ * to the database by NarInfoDiskCacheImpl::compactIndex() and memory-mapped
+ * by every process using the cache. Lookups binary-search a sorted table of
+ * fixed-size entries and do not touch the database, so concurrent processes
+ * do not contend on it for paths they have seen before.
+ *
+ * Only positive entries are indexed: a path can appear in a binary cache at
+ * any time, and another process may have recorded that in the database after
+ * the index was written.
+ *
+ * The file is only ever replaced by renaming a new one over it, so a mapped
+ * snapshot stays valid while it is in use. It consists of a header, the sorted
+ * entries, a table of cache URLs and ids (one `<id>\t<url>\n` line each), and
+ * the NUL-separated narinfo fields referenced by the entries.
+ */
+class NarInfoIndex
+{
+public:
+    static constexpr std::array<char, 8> magic = {'L', 'i', 'x', 'N', 'I', 'd', 'x', '3'};
+
+    struct Header
+    {
+        std::array<char, 8> magic;
+        /**
+         * Time at which the snapshot was taken. Every database write that
+         * finished before this second is reflected in the index.
+         */
+        int64_t snapshotTime;
+        uint64_t entryCount;
+        uint64_t cachesOffset;
+        uint64_t cachesLength;
+    };
+
+    struct Entry
+    {
+        uint32_t cache;
+        char hashPart[StorePath::HashLen];
+        uint32_t length;
+        int64_t timestamp;
+        uint64_t offset;
+    };
+
+    static_assert(sizeof(Header) == 40 && sizeof(Entry) == 56, "index layout must not change");
+
+    /**
+     * Number of NUL-separated fields stored per entry, in the order of the
+     * compaction query in NarInfoDiskCacheImpl::compactIndex().
+     */
+    static constexpr size_t fieldCount = 12;
+
+private:
+    const char * data = nullptr;
+    size_t size = 0;
+    std::span<const Entry> entries;
+    std::map<std::string, uint32_t, std::less<>> caches;
+
+public:
+    /**
+     * Device and inode of the mapped file. Since the index is only replaced
+     * by renaming a new file over it, a different inode means a newer index.
+     */
+    std::pair<dev_t, ino_t> file{0, 0};
+
+    int64_t snapshotTime = 0;
+
+    /**
+     * Maps the index at `path`. A missing or malformed index is treated as
+     * empty; it is rewritten by the next compaction.
+     */
+    explicit NarInfoIndex(const Path & path)
+    {
+        AutoCloseFD fd{open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+        struct stat st;
+        if (!fd || fstat(fd.get(), &st) != 0) {
+            return;
+        }
+        file = {st.st_dev, st.st_ino};
+        if (size_t(st.st_size) < sizeof(Header)) {
+            return;
+        }
+
+        auto p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd.get(), 0);
+        if (p == MAP_FAILED) {
+            return;
+        }
+        data = static_cast<const char *>(p);
+        size = st.st_size;
+
+        Header header;
+        memcpy(&header, data, sizeof(header));
+        if (header.magic != magic
+            || header.entryCount > (size - sizeof(Header)) / sizeof(Entry)
+            || header.cachesOffset > size
+            || header.cachesLength > size - header.cachesOffset)
+        {
+            debug("ignoring malformed NAR info index '%s'", path);
+            return;
+        }
+
+        entries = {reinterpret_cast<const Entry *>(data + sizeof(Header)), header.entryCount};
+        snapshotTime = header.snapshotTime;
+
+        for (auto & line : tokenizeString<std::vector<std::string>>(
+                 std::string_view(data + header.cachesOffset, header.cachesLength), "\n"))
+        {
+            auto tab = line.find('\t');
+            if (tab == std::string::npos) continue;
+            if (auto id = string2Int<uint32_t>(line.substr(0, tab))) {
+                caches.emplace(line.substr(tab + 1), *id);
+            }
+        }
+    }
+
+    NarInfoIndex(const NarInfoIndex &) = delete;
+    NarInfoIndex & operator=(const NarInfoIndex &) = delete;
+
+    ~NarInfoIndex()
+    {
+        if (data) {
+            munmap(const_cast<char *>(data), size);
+        }
+    }
+
+    /**
+     * Returns the stored fields of the entry for `hashPart` in the cache at
+     * `uri`, if it exists and was written after `minTimestamp`.
+     */
+    std::optional<std::array<std::string_view, fieldCount>>
+    lookup(std::string_view uri, std::string_view hashPart, int64_t minTimestamp) const
+    {
+        auto cache = caches.find(uri);
+        if (cache == caches.end() || hashPart.size() != StorePath::HashLen) {
+            return std::nullopt;
+        }
+
+        auto key = [](const Entry & e) {
+            return std::pair(e.cache, std::string_view(e.hashPart, StorePath::HashLen));
+        };
+        auto it = std::lower_bound(
+            entries.begin(),
+            entries.end(),
+            std::pair(cache->second, hashPart),
+            [&](const Entry & e, const auto & k) { return key(e) < k; }
+        );
+        if (it == entries.end() || key(*it) != std::pair(cache->second, hashPart)
+            || it->timestamp <= minTimestamp || it->offset > size || it->length > size - it->offset)
+        {
+            return std::nullopt;
+        }
+
+        std::array<std::string_view, fieldCount> fields;
+        std::string_view rest(data + it->offset, it->length);
+        for (size_t i = 0; i < fieldCount; i++) {
+            auto end = std::min(rest.find('\0'), rest.size());
+            fields[i] = rest.substr(0, end);
+            rest.remove_prefix(std::min(end + 1, rest.size()));
+        }
+        return fields;
+    }
+};
+
+}
+
 class NarInfoDiskCacheImpl : public NarInfoDiskCache
 {
 public:
@@ -69,6 +273,16 @@ public:
     /* How long to cache binary cache info (i.e. /nix-cache-info) */
     const int cacheInfoTtl = 7 * 24 * 3600;
 
+    /* How often to rewrite the memory-mapped index. */
+    const int indexInterval = 3600;
+
+    /* How often long-running processes look for a newer index. */
+    const int indexCheckInterval = 60;
+
+    /* How many NAR infos this process may write before it stops trusting
+       its index until the next one is mapped. */
+    const size_t maxUpserted = 10000;
+
     struct Cache
     {
         int id;
@@ -88,7 +302,48 @@ public:
 
     Sync<State> _state;
 
-    NarInfoDiskCacheImpl(Path dbPath = getCacheDir() + "/nix/binary-cache-v6.sqlite")
+    const Path dbPath, indexPath;
+
+    /**
+     * Compact the index on a separate thread, so that opening the cache
+     * never waits for it.
+     */
+    const bool compactInBackground;
+
+    struct IndexState
+    {
+        /**
+         * The most recent snapshot of the database. Lookups hold a reference
+         * to it, so it stays mapped while they use it even if it is replaced.
+         */
+        std::shared_ptr<const NarInfoIndex> index;
+
+        /**
+         * NAR infos written by this process that `index` may not reflect,
+         * with the time they were written.
+         */
+        std::map<std::pair<std::string, std::string>, time_t> upserted;
+
+        /**
+         * Set once `upserted` grew too large and was cleared, to the time of
+         * the last write since. The index is not used until one taken after
+         * that time is mapped.
+         */
+        std::optional<time_t> overflowedAt;
+    };
+
+    Sync<IndexState> indexState;
+
+    std::atomic<time_t> nextIndexCheck{0};
+    std::atomic<bool> compacting{false};
+    Sync<std::thread> compactor;
+
+    NarInfoDiskCacheImpl(
+        Path dbPath = getCacheDir() + "/nix/binary-cache-v7.sqlite", bool compactInBackground = true
+    )
+        : dbPath(dbPath)
+        , indexPath(dbPath + "-index")
+        , compactInBackground(compactInBackground)
     {
         auto state(_state.lock());
 
@@ -108,13 +363,13 @@ public:
 
         state->insertNAR = state->db.create(
             "insert or replace into NARs(cache, hashPart, namePart, url, compression, fileHash, fileSize, narHash, "
-            "narSize, refs, deriver, sigs, ca, timestamp, present) values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, 1)");
+            "narSize, refs, deriver, sigs, ca, compressedFrames, timestamp, present) values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, 1)");
 
         state->insertMissingNAR = state->db.create(
             "insert or replace into NARs(cache, hashPart, timestamp, present) values (?, ?, ?, 0)");
 
         state->queryNAR = state->db.create(
-            "select present, namePart, url, compression, fileHash, fileSize, narHash, narSize, refs, deriver, sigs, ca from NARs where cache = ? and hashPart = ? and ((present = 0 and timestamp > ?) or (present = 1 and timestamp > ?))");
+            "select present, namePart, url, compression, fileHash, fileSize, narHash, narSize, refs, deriver, sigs, ca, compressedFrames from NARs where cache = ? and hashPart = ? and ((present = 0 and timestamp > ?) or (present = 1 and timestamp > ?))");
 
         state->insertRealisation = state->db.create(
             R"(
@@ -160,6 +415,200 @@ public:
                     .use()(now).exec();
             }
         }, always_progresses);
+
+        {
+            auto unlock = std::move(state);
+        }
+        checkIndex();
+    }
+
+    ~NarInfoDiskCacheImpl()
+    {
+        if (auto compactor_(compactor.lock()); compactor_->joinable()) {
+            compactor_->join();
+        }
+    }
+
+    /**
+     * Maps the index if it was replaced since it was last mapped, and starts
+     * rewriting it if it is missing or old.
+     */
+    void checkIndex()
+    {
+        nextIndexCheck = time(0) + indexCheckInterval;
+        refreshIndex();
+
+        struct stat st;
+        if (stat(indexPath.c_str(), &st) == 0 && st.st_mtime >= time(0) - indexInterval) {
+            return;
+        }
+        if (compacting.exchange(true)) {
+            return;
+        }
+
+        auto compact = [this] {
+            try {
+                /* Only one process rewrites the index at a time; the others
+                   keep using their snapshot and map the new one once it is
+                   there. */
+                auto lock = openLockFile(indexPath + ".lock", true);
+                if (tryLockFile(lock.get(), ltWrite)) {
+                    struct stat st;
+                    if (stat(indexPath.c_str(), &st) != 0 || st.st_mtime < time(0) - indexInterval) {
+                        SQLite db(dbPath);
+                        db.isCache();
+                        compactIndex(db);
+                    }
+                    refreshIndex();
+                }
+            } catch (Error & e) {
+                debug("could not write NAR info index '%s': %s", indexPath, e.what());
+            }
+            compacting = false;
+        };
+
+        if (!compactInBackground) {
+            compact();
+            return;
+        }
+
+        auto compactor_(compactor.lock());
+        if (compactor_->joinable()) {
+            compactor_->join();
+        }
+        *compactor_ = std::thread(compact);
+    }
+
+    /**
+     * Maps the index on disk if it is not the one already mapped, and forgets
+     * the writes of this process that it reflects.
+     */
+    void refreshIndex()
+    {
+        struct stat st;
+        if (stat(indexPath.c_str(), &st) != 0) {
+            return;
+        }
+        if (auto current = indexState.lock()->index;
+            current && current->file == std::pair(st.st_dev, st.st_ino))
+        {
+            return;
+        }
+
+        auto newIndex = std::make_shared<const NarInfoIndex>(indexPath);
+
+        auto indexState_(indexState.lock());
+        std::erase_if(indexState_->upserted, [&](auto & entry) {
+            return entry.second < newIndex->snapshotTime;
+        });
+        if (indexState_->overflowedAt && *indexState_->overflowedAt < newIndex->snapshotTime) {
+            indexState_->overflowedAt.reset();
+        }
+        indexState_->index = newIndex;
+    }
+
+    void compactIndex(SQLite & db)
+    {
+        std::string caches, data;
+        std::vector<NarInfoIndex::Entry> entries;
+        int64_t snapshotTime = 0;
+
+        retrySQLite([&]() {
+            caches.clear();
+            data.clear();
+            entries.clear();
+            snapshotTime = time(0);
+
+            SQLiteTxn txn = db.beginTransaction();
+
+            SQLiteStmt queryCaches = db.create("select id, url from BinaryCaches");
+            auto queryCaches_(queryCaches.use());
+            while (queryCaches_.next()) {
+                caches += fmt("%d\t%s\n", queryCaches_.getInt(0), queryCaches_.getStr(1));
+            }
+
+            SQLiteStmt queryNARs = db.create(
+                "select cache, hashPart, timestamp, namePart, coalesce(url, ''), coalesce(compression, ''), "
+                "coalesce(fileHash, ''), coalesce(fileSize, 0), narHash, narSize, coalesce(refs, ''), "
+                "coalesce(deriver, ''), coalesce(sigs, ''), coalesce(ca, ''), coalesce(compressedFrames, '') from NARs "
+                "where present = 1 and timestamp > ? order by cache, hashPart");
+            auto queryNARs_(queryNARs.use()(time(0) - settings.ttlPositiveNarInfoCache));
+            while (queryNARs_.next()) {
+                auto hashPart = queryNARs_.getStr(1);
+                if (hashPart.size() != StorePath::HashLen) continue;
+
+                NarInfoIndex::Entry entry{
+                    .cache = uint32_t(queryNARs_.getInt(0)),
+                    .hashPart = {},
+                    .length = 0,
+                    .timestamp = queryNARs_.getInt(2),
+                    .offset = data.size(),
+                };
+                memcpy(entry.hashPart, hashPart.data(), StorePath::HashLen);
+
+                for (int col = 3; col < 3 + int(NarInfoIndex::fieldCount); col++) {
+                    if (col > 3) data += '\0';
+                    data += col == 7 || col == 9
+                        ? std::to_string(queryNARs_.getInt(col))
+                        : queryNARs_.getStr(col);
+                }
+                entry.length = data.size() - entry.offset;
+                entries.push_back(entry);
+            }
+
+            txn.commit();
+        }, always_progresses);
+
+        NarInfoIndex::Header header{
+            .magic = NarInfoIndex::magic,
+            .snapshotTime = snapshotTime,
+            .entryCount = entries.size(),
+            .cachesOffset = sizeof(NarInfoIndex::Header) + entries.size() * sizeof(NarInfoIndex::Entry),
+            .cachesLength = caches.size(),
+        };
+        const auto dataOffset = header.cachesOffset + header.cachesLength;
+
+        std::string contents;
+        contents.reserve(dataOffset + data.size());
+        contents.append(reinterpret_cast<const char *>(&header), sizeof(header));
+        for (auto & entry : entries) {
+            entry.offset += dataOffset;
+            contents.append(reinterpret_cast<const char *>(&entry), sizeof(entry));
+        }
+        contents += caches;
+        contents += data;
+
+        auto tmpPath = makeTempPath(indexPath);
+        writeFile(tmpPath, contents);
+        if (rename(tmpPath.c_str(), indexPath.c_str()) == -1) {
+            deletePath(tmpPath);
+            throw SysError("renaming '%s' to '%s'", tmpPath, indexPath);
+        }
+        debug("wrote %d entries to the NAR info index", entries.size());
+    }
+
+    static std::shared_ptr<NarInfo> narInfoFromIndex(
+        const std::string & hashPart,
+        const std::array<std::string_view, NarInfoIndex::fieldCount> & fields)
+    {
+        auto narInfo = make_ref<NarInfo>(
+            StorePath(hashPart + "-" + std::string(fields[0])),
+            Hash::parseAnyPrefixed(fields[5]));
+        narInfo->url = fields[1];
+        narInfo->compression = fields[2];
+        if (!fields[3].empty())
+            narInfo->fileHash = Hash::parseAnyPrefixed(fields[3]);
+        narInfo->fileSize = string2Int<uint64_t>(fields[4]).value_or(0);
+        narInfo->narSize = string2Int<uint64_t>(fields[6]).value_or(0);
+        for (auto & r : tokenizeString<Strings>(fields[7], " "))
+            narInfo->references.insert(StorePath(r));
+        if (!fields[8].empty())
+            narInfo->deriver = StorePath(fields[8]);
+        for (auto & sig : tokenizeString<Strings>(fields[9], " "))
+            narInfo->sigs.insert(sig);
+        narInfo->ca = ContentAddress::parseOpt(fields[10]);
+        narInfo->compressedFrames = parseCompressedFrames(fields[11]);
+        return narInfo;
     }
 
     Cache & getCache(State & state, const std::string & uri)
@@ -241,6 +690,28 @@ public:
     std::pair<Outcome, std::shared_ptr<NarInfo>> lookupNarInfo(
         const std::string & uri, const std::string & hashPart) override
     {
+        if (time(0) >= nextIndexCheck) {
+            checkIndex();
+        }
+
+        auto index = [&]() -> std::shared_ptr<const NarInfoIndex> {
+            auto indexState_(indexState.lock());
+            if (indexState_->overflowedAt || indexState_->upserted.contains({uri, hashPart}))
+                return nullptr;
+            return indexState_->index;
+        }();
+
+        if (auto fields = index
+                ? index->lookup(uri, hashPart, time(0) - settings.ttlPositiveNarInfoCache)
+                : std::nullopt)
+        {
+            try {
+                return {oValid, narInfoFromIndex(hashPart, *fields)};
+            } catch (Error & e) {
+                debug("ignoring bad NAR info index entry for '%s': %s", hashPart, e.what());
+            }
+        }
+
         return retrySQLite([&]() -> std::pair<Outcome, std::shared_ptr<NarInfo>> {
             auto state(_state.lock());
 
@@ -277,6 +748,8 @@ public:
             for (auto & sig : tokenizeString<Strings>(queryNAR.getStr(10), " "))
                 narInfo->sigs.insert(sig);
             narInfo->ca = ContentAddress::parseOpt(queryNAR.getStr(11));
+            if (!queryNAR.isNull(12))
+                narInfo->compressedFrames = parseCompressedFrames(queryNAR.getStr(12));
 
             return {oValid, narInfo};
         }, always_progresses);
@@ -342,6 +815,8 @@ public:
                     (info->deriver ? std::string(info->deriver->to_string()) : "", (bool) info->deriver)
                     (concatStringsSep(" ", info->sigs))
                     (renderContentAddress(info->ca))
+                    (narInfo ? renderCompressedFrames(narInfo->compressedFrames) : "",
+                     narInfo && !narInfo->compressedFrames.empty())
                     (time(0)).exec();
 
             } else {
@@ -351,6 +826,17 @@ public:
                     (time(0)).exec();
             }
         }, always_progresses);
+
+        auto indexState_(indexState.lock());
+        if (indexState_->overflowedAt) {
+            indexState_->overflowedAt = time(0);
+            return;
+        }
+        indexState_->upserted.insert_or_assign({uri, hashPart}, time(0));
+        if (indexState_->upserted.size() > maxUpserted) {
+            indexState_->upserted.clear();
+            indexState_->overflowedAt = time(0);
+        }
     }
 
     void upsertRealisation(
@@ -395,7 +881,7 @@ ref<NarInfoDiskCache> getNarInfoDiskCache()
 
 ref<NarInfoDiskCache> getTestNarInfoDiskCache(Path dbPath)
 {
-    return make_ref<NarInfoDiskCacheImpl>(dbPath);
+    return make_ref<NarInfoDiskCacheImpl>(dbPath, false);
 }
 
 }
@@ -1,3 +1,4 @@
+#include "lix/libutil/compression.hh"
 #include "lix/libutil/strings.hh"
 #include "lix/libstore/nar-info.hh"
 #include "lix/libstore/store-api.hh"
@@ -44,6 +45,10 @@ NarInfo::NarInfo(const Store & store, const std::string_view & s, const std::str
         }
         else if (name == "URL")
             url = value;
+        else if (name == "ChunkManifest") {
+            url = value;
+            if (!isChunked()) throw corrupt("invalid ChunkManifest");
+        }
         else if (name == "Compression")
             compression = value;
         else if (name == "FileHash")
@@ -53,6 +58,14 @@ NarInfo::NarInfo(const Store & store, const std::string_view & s, const std::str
             if (!n) throw corrupt("invalid FileSize");
             fileSize = *n;
         }
+        else if (name == "CompressedFrames") {
+            for (auto & size : tokenizeString<Strings>(value, " ")) {
+                auto n = string2Int<uint64_t>(size);
+                if (!n || *n == 0 || *n > maxCompressedFrameSize)
+                    throw corrupt("invalid CompressedFrames");
+                compressedFrames.push_back(*n);
+            }
+        }
         else if (name == "NarHash") {
             narHash = parseHashField(value);
             haveNarHash = true;
@@ -86,6 +99,18 @@ NarInfo::NarInfo(const Store & store, const std::string_view & s, const std::str
 
     if (compression == "") compression = "bzip2";
 
+    if (!compressedFrames.empty()) {
+        uint64_t total = 0;
+        for (auto size : compressedFrames) {
+            total += size;
+            if (total > fileSize) break;
+        }
+        if (total != fileSize) {
+            line = 0;
+            throw corrupt("CompressedFrames do not add up to FileSize");
+        }
+    }
+
     if (!havePath || !haveNarHash || url.empty() || narSize == 0) {
         line = 0; // don't include line information in the error
         throw corrupt(
@@ -101,12 +126,18 @@ std::string NarInfo::to_string(const Store & store) const
 {
     std::string res;
     res += "StorePath: " + store.printStorePath(path) + "\n";
-    res += "URL: " + url + "\n";
+    res += (isChunked() ? "ChunkManifest: " : "URL: ") + url + "\n";
     assert(compression != "");
     res += "Compression: " + compression + "\n";
     assert(fileHash && fileHash->type == HashType::SHA256);
     res += "FileHash: " + fileHash->to_string(Base::Base32, true) + "\n";
     res += "FileSize: " + std::to_string(fileSize) + "\n";
+    if (!compressedFrames.empty()) {
+        Strings frames;
+        for (auto size : compressedFrames)
+            frames.push_back(std::to_string(size));
+        res += "CompressedFrames: " + concatStringsSep(" ", frames) + "\n";
+    }
     assert(narHash.type == HashType::SHA256);
     res += "NarHash: " + narHash.to_string(Base::Base32, true) + "\n";
     res += "NarSize: " + std::to_string(narSize) + "\n";
@@ -9,6 +9,13 @@ namespace nix {
 
 class Store;
 
+/**
+ * Suffix of the URL of a NAR stored as content-defined chunks. Such a URL
+ * points to an uncompressed manifest listing the chunks of the NAR, one
+ * `<base32 sha256 of the chunk> <chunk size>` line per chunk, in order.
+ */
+constexpr std::string_view chunkManifestSuffix = ".chunks";
+
 struct NarInfo : ValidPathInfo
 {
     std::string url;
@@ -16,6 +23,23 @@ struct NarInfo : ValidPathInfo
     std::optional<Hash> fileHash;
     uint64_t fileSize = 0;
 
+    /**
+     * Sizes of the independently compressed frames the NAR file consists of,
+     * in order. Empty if the file is a single compressed stream.
+     */
+    std::vector<uint64_t> compressedFrames;
+
+    /**
+     * Whether `url` points to the chunk manifest of a chunked NAR. Such
+     * `.narinfo` files name it in a `ChunkManifest` field instead of `URL`,
+     * so that clients that do not know chunked NARs reject them as corrupt
+     * before downloading anything.
+     */
+    bool isChunked() const
+    {
+        return url.ends_with(chunkManifestSuffix);
+    }
+
     NarInfo() = delete;
     NarInfo(const Store & store, std::string && name, ContentAddressWithReferences && ca, Hash narHash)
         : ValidPathInfo(store, std::move(name), std::move(ca), narHash)
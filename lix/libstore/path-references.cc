@@ -1,7 +1,14 @@
 #include "lix/libstore/path-references.hh"
 #include "lix/libutil/hash.hh"
 #include "lix/libutil/archive.hh"
-
+#include "lix/libutil/file-descriptor.hh"
+#include "lix/libutil/file-system.hh"
+#include "lix/libutil/serialise.hh"
+#include "lix/libutil/signals.hh"
+#include "lix/libutil/sync.hh"
+#include "lix/libutil/thread-pool.hh"
+
+#include <fcntl.h>
 #include <map>
 
 
@@ -66,4 +73,51 @@ StorePathSet scanForReferences(
     return refsSink.getResultPaths();
 }
 
+StorePathSet scanForReferencesParallel(const Path & path, const StorePathSet & refs)
+{
+    PathRefScanSink refsSink = PathRefScanSink::fromPaths(refs);
+    Sync<StringSet> foundInFiles;
+
+    auto scanFile = [&](const Path & file) {
+        checkInterrupt();
+        AutoCloseFD fd{open(file.c_str(), O_RDONLY | O_CLOEXEC)};
+        if (!fd) throw SysError("opening file '%1%'", file);
+
+        auto fileSink = refsSink.fork();
+        FdSource source{fd.get()};
+        source.drainInto(fileSink);
+
+        foundInFiles.lock()->merge(fileSink.getResult());
+    };
+
+    std::function<void(const Path &)> walk;
+
+    /* Create pool last to ensure threads are stopped before other destructors
+     * run */
+    ThreadPool pool{"reference scanning pool"};
+
+    walk = [&](const Path & p) {
+        checkInterrupt();
+        auto st = lstat(p);
+        if (S_ISREG(st.st_mode)) {
+            pool.enqueue([&scanFile, p] { scanFile(p); });
+        } else if (S_ISLNK(st.st_mode)) {
+            refsSink.scanSeparately(readLink(p));
+        } else if (S_ISDIR(st.st_mode)) {
+            for (auto & entry : readDirectory(p)) {
+                refsSink.scanSeparately(entry.name);
+                walk(p + "/" + entry.name);
+            }
+        } else {
+            throw Error("file '%1%' has an unsupported type", p);
+        }
+    };
+
+    walk(path);
+    pool.process();
+
+    refsSink.getResult().merge(*foundInFiles.lock());
+    return refsSink.getResultPaths();
+}
+
 }
@@ -10,6 +10,16 @@ std::pair<StorePathSet, HashResult> scanForReferences(const Path & path, const S
 
 StorePathSet scanForReferences(Sink & toTee, const Path & path, const StorePathSet & refs);
 
+/**
+ * Like scanForReferences(), but without producing a NAR of `path`. The
+ * contents of the regular files within `path` are scanned concurrently.
+ *
+ * This finds the same references as scanning the NAR would: NAR framing
+ * places non-base-32 bytes between file names, symlink targets and file
+ * contents, so no reference can span two of them.
+ */
+StorePathSet scanForReferencesParallel(const Path & path, const StorePathSet & refs);
+
 class PathRefScanSink : public RefScanSink
 {
     std::map<std::string, StorePath> backMap;
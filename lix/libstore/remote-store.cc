@@ -884,10 +884,7 @@ try {
     results.bytesFreed = readLongLong(conn->from);
     readLongLong(conn->from); // obsolete
 
-    {
-        auto state_(co_await Store::state.lock());
-        state_->pathInfoCache.clear();
-    }
+    pathInfoCache.clear();
     co_return result::success();
 } catch (...) {
     co_return result::current_exception();
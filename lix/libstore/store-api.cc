@@ -4,6 +4,7 @@
 #include "lix/libstore/store-api.hh"
 #include "lix/libstore/nar-info-disk-cache.hh"
 #include "lix/libutil/async-io.hh"
+#include "lix/libutil/async-semaphore.hh"
 #include "lix/libutil/async.hh"
 #include "lix/libutil/box_ptr.hh"
 #include "lix/libutil/hash.hh"
@@ -331,6 +332,11 @@ try {
         act.progress(nrDone, pathsToCopy.size(), nrRunning, nrFailed);
     };
 
+    /* Paths whose references have all been added are copied concurrently,
+       but only this many at a time so that the buffers of all open source
+       and destination streams stay bounded. */
+    AsyncSemaphore slots{std::max<unsigned>(1, settings.maxCopyJobs)};
+
     TRY_AWAIT(processGraphAsync<StorePath>(
         storePathsToAdd,
 
@@ -370,6 +376,8 @@ try {
                 LegacySSHStore::narFromPath()'s connection lock. */
                 auto source = std::move(source_);
 
+                auto slotToken = co_await slots.acquire();
+
                 if (!TRY_AWAIT(isValidPath(info.path))) {
                     MaintainCount<decltype(nrRunning)> mc(nrRunning);
                     showProgress();
@@ -495,7 +503,7 @@ StringSet StoreConfig::getDefaultSystemFeatures()
     return res;
 }
 
-Store::Store(const StoreConfig & config) : state({(size_t) config.pathInfoCacheSize})
+Store::Store(const StoreConfig & config) : pathInfoCache((size_t) config.pathInfoCacheSize)
 {
     assertLibStoreInitialized();
 }
@@ -589,6 +597,9 @@ kj::Promise<Result<void>> Store::querySubstitutablePathInfos(const StorePathCAMa
 try {
     if (!settings.useSubstitutes) co_return result::success();
     for (auto & sub : TRY_AWAIT(getDefaultSubstituters())) {
+        /* The paths still missing, keyed by their path in this substituter. */
+        std::map<StorePath, StorePath> subPaths;
+
         for (auto & path : paths) {
             if (infos.count(path.first))
                 // Choose first succeeding substituter.
@@ -608,32 +619,56 @@ try {
             } else if (sub->config().storeDir != config().storeDir) continue;
 
             debug("checking substituter '%s' for path '%s'", sub->getUri(), sub->printStorePath(subPath));
-            try {
-                auto info = TRY_AWAIT(sub->queryPathInfo(subPath));
+            subPaths.emplace(subPath, path.first);
+        }
 
-                if (sub->config().storeDir != config().storeDir
-                    && !(info->isContentAddressed(*sub) && info->references.empty()))
-                {
-                    continue;
-                }
+        if (subPaths.empty()) continue;
 
-                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
-                    std::shared_ptr<const ValidPathInfo>(info));
-                infos.insert_or_assign(path.first, SubstitutablePathInfo{
-                    .deriver = info->deriver,
-                    .references = info->references,
-                    .downloadSize = narInfo ? narInfo->fileSize : 0,
-                    .narSize = info->narSize,
-                });
-            } catch (InvalidPath &) {
-            } catch (SubstituterDisabled &) {
-            } catch (Error & e) {
-                if (settings.tryFallback)
+        /* Query all paths at once. If that fails, retry them one by one
+           so that a single failing path does not hide all others. */
+        std::map<StorePath, ref<const ValidPathInfo>> subInfos;
+        bool queryEach = false;
+        try {
+            StorePathSet toQuery;
+            for (auto & [subPath, _] : subPaths)
+                toQuery.insert(subPath);
+            subInfos = TRY_AWAIT(sub->queryPathInfos(toQuery));
+        } catch (SubstituterDisabled &) {
+            continue;
+        } catch (Error & e) {
+            if (!settings.tryFallback)
+                throw;
+            queryEach = true;
+        }
+
+        if (queryEach) {
+            for (auto & [subPath, _] : subPaths) {
+                try {
+                    subInfos.insert_or_assign(subPath, TRY_AWAIT(sub->queryPathInfo(subPath)));
+                } catch (InvalidPath &) {
+                } catch (SubstituterDisabled &) {
+                } catch (Error & e) {
                     logError(e.info());
-                else
-                    throw;
+                }
             }
         }
+
+        for (auto & [subPath, info] : subInfos) {
+            if (sub->config().storeDir != config().storeDir
+                && !(info->isContentAddressed(*sub) && info->references.empty()))
+            {
+                continue;
+            }
+
+            auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
+                std::shared_ptr<const ValidPathInfo>(info));
+            infos.insert_or_assign(subPaths.at(subPath), SubstitutablePathInfo{
+                .deriver = info->deriver,
+                .references = info->references,
+                .downloadSize = narInfo ? narInfo->fileSize : 0,
+                .narSize = info->narSize,
+            });
+        }
     }
 
     co_return result::success();
@@ -645,8 +680,7 @@ try {
 kj::Promise<Result<bool>> Store::isValidPath(const StorePath & storePath)
 try {
     {
-        auto state_(co_await state.lock());
-        auto res = state_->pathInfoCache.get(std::string(storePath.to_string()));
+        auto res = pathInfoCache.get(std::string(storePath.to_string()));
         if (res && res->isKnownNow()) {
             stats.narInfoReadAverted++;
             co_return res->didExist();
@@ -657,8 +691,7 @@ try {
         auto res = diskCache->lookupNarInfo(getUri(), std::string(storePath.hashPart()));
         if (res.first != NarInfoDiskCache::oUnknown) {
             stats.narInfoReadAverted++;
-            auto state_(co_await state.lock());
-            state_->pathInfoCache.upsert(std::string(storePath.to_string()),
+            pathInfoCache.upsert(std::string(storePath.to_string()),
                 res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue { .value = res.second });
             co_return res.first == NarInfoDiskCache::oValid;
         }
@@ -710,7 +743,7 @@ try {
     auto hashPart = std::string(storePath.hashPart());
 
     {
-        auto res = (co_await state.lock())->pathInfoCache.get(std::string(storePath.to_string()));
+        auto res = pathInfoCache.get(std::string(storePath.to_string()));
         if (res && res->isKnownNow()) {
             stats.narInfoReadAverted++;
             if (!res->didExist())
@@ -723,13 +756,10 @@ try {
         auto res = diskCache->lookupNarInfo(getUri(), hashPart);
         if (res.first != NarInfoDiskCache::oUnknown) {
             stats.narInfoReadAverted++;
-            {
-                auto state_(co_await state.lock());
-                state_->pathInfoCache.upsert(std::string(storePath.to_string()),
-                    res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue{ .value = res.second });
-                if (res.first == NarInfoDiskCache::oInvalid)
-                    throw InvalidPath("path '%s' does not exist in the store", printStorePath(storePath));
-            }
+            pathInfoCache.upsert(std::string(storePath.to_string()),
+                res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue{ .value = res.second });
+            if (res.first == NarInfoDiskCache::oInvalid)
+                throw InvalidPath("path '%s' does not exist in the store", printStorePath(storePath));
             co_return ref<const ValidPathInfo>(res.second);
         }
     }
@@ -744,10 +774,7 @@ try {
         diskCache->upsertNarInfo(getUri(), hashPart, info);
     }
 
-    {
-        auto state_(co_await state.lock());
-        state_->pathInfoCache.upsert(std::string(storePath.to_string()), PathInfoCacheValue { .value = info });
-    }
+    pathInfoCache.upsert(std::string(storePath.to_string()), PathInfoCacheValue { .value = info });
 
     if (!info) {
         stats.narInfoMissing++;
@@ -819,30 +846,29 @@ try {
 }
 
 
-kj::Promise<Result<StorePathSet>>
-Store::queryValidPaths(const StorePathSet & paths, SubstituteFlag maybeSubstitute)
+kj::Promise<Result<std::map<StorePath, ref<const ValidPathInfo>>>>
+Store::queryPathInfos(const StorePathSet & paths)
 try {
     struct State
     {
         size_t left;
-        StorePathSet valid;
+        std::map<StorePath, ref<const ValidPathInfo>> infos;
         std::exception_ptr exc = {};
     };
 
-    Sync<State> state_(State{paths.size(), StorePathSet()});
+    Sync<State> state_(State{paths.size(), {}});
 
     std::condition_variable wakeup;
-    ThreadPool pool{"queryValidPaths pool"};
+    ThreadPool pool{"queryPathInfos pool"};
 
     auto doQuery = [&](AsyncIoRoot & aio, const StorePath & path) {
         checkInterrupt();
 
-        bool exists = false;
+        std::shared_ptr<const ValidPathInfo> info;
         std::exception_ptr newExc{};
 
         try {
-            aio.blockOn(queryPathInfo(path));
-            exists = true;
+            info = aio.blockOn(queryPathInfo(path)).get_ptr();
         } catch (InvalidPath &) {
         } catch (...) {
             newExc = std::current_exception();
@@ -851,8 +877,8 @@ try {
         {
             auto state(state_.lock());
 
-            if (exists) {
-                state->valid.insert(path);
+            if (info) {
+                state->infos.emplace(path, ref<const ValidPathInfo>(info));
             }
             if (newExc != nullptr) {
                 state->exc = newExc;
@@ -872,7 +898,7 @@ try {
         auto state(state_.lock());
         if (!state->left) {
             if (state->exc) std::rethrow_exception(state->exc);
-            co_return std::move(state->valid);
+            co_return std::move(state->infos);
         }
         state.wait(wakeup);
     }
@@ -881,6 +907,18 @@ try {
 }
 
 
+kj::Promise<Result<StorePathSet>>
+Store::queryValidPaths(const StorePathSet & paths, SubstituteFlag maybeSubstitute)
+try {
+    StorePathSet valid;
+    for (auto & [path, _] : TRY_AWAIT(queryPathInfos(paths)))
+        valid.insert(path);
+    co_return valid;
+} catch (...) {
+    co_return result::current_exception();
+}
+
+
 /* Return a string accepted by decodeValidPathInfo() that
    registers the specified paths as valid.  Note: it's the
    responsibility of the caller to provide a closure. */
@@ -1050,16 +1088,16 @@ try {
 
 kj::Promise<Result<Store::Stats<>>> Store::getStats()
 try {
-    {
-        auto state_(co_await state.lock());
-        stats.pathInfoCacheSize = state_->pathInfoCache.size();
-    }
+    auto cacheStats = getPathInfoCacheStats();
     co_return {
         stats.narInfoRead,
         stats.narInfoReadAverted,
         stats.narInfoMissing,
         stats.narInfoWrite,
-        stats.pathInfoCacheSize,
+        cacheStats.size,
+        cacheStats.hits,
+        cacheStats.misses,
+        cacheStats.evictions,
         stats.narRead,
         stats.narReadBytes,
         stats.narReadCompressedBytes,
@@ -1240,6 +1278,12 @@ try {
 
     Activity act(*logger, lvlInfo, actCopyPaths, fmt("copying %d paths", missing.size()));
 
+    /* Look up all path infos at once rather than one round trip per path.
+       This also fills the path info cache used by topoSortPaths(). Paths
+       missing from the result are queried again individually below to get
+       the source store's error for them. */
+    auto infos = TRY_AWAIT(srcStore.queryPathInfos(missing));
+
     // In the general case, `addMultipleToStore` requires a sorted list of
     // store paths to add, so sort them right now
     auto sortedMissing = TRY_AWAIT(srcStore.topoSortPaths(missing));
@@ -1270,7 +1314,8 @@ try {
     };
 
     for (auto & missingPath : sortedMissing) {
-        auto info = TRY_AWAIT(srcStore.queryPathInfo(missingPath));
+        auto i = infos.find(missingPath);
+        auto info = i != infos.end() ? i->second : TRY_AWAIT(srcStore.queryPathInfo(missingPath));
 
         auto storePathForDst = computeStorePathForDst(*info);
         pathsMap.insert_or_assign(missingPath, storePathForDst);
@@ -222,12 +222,7 @@ protected:
         }
     };
 
-    struct State
-    {
-        LRUCache<std::string, PathInfoCacheValue> pathInfoCache;
-    };
-
-    Sync<State, AsyncMutex> state;
+    ShardedLRUCache<std::string, PathInfoCacheValue> pathInfoCache;
 
     std::shared_ptr<NarInfoDiskCache> diskCache;
 
@@ -392,6 +387,15 @@ public:
      */
     kj::Promise<Result<ref<const ValidPathInfo>>> queryPathInfo(const StorePath & path);
 
+    /**
+     * Query information about several paths at once. The queries are run
+     * concurrently, so for stores that fetch path info over the network
+     * (e.g. binary caches) this costs a few round trips instead of one per
+     * path. Paths that are not valid are missing from the result.
+     */
+    kj::Promise<Result<std::map<StorePath, ref<const ValidPathInfo>>>>
+    queryPathInfos(const StorePathSet & paths);
+
     /**
      * Query the information about a realisation.
      */
@@ -840,6 +844,9 @@ public:
         Wrapper<uint64_t> narInfoMissing{0};
         Wrapper<uint64_t> narInfoWrite{0};
         Wrapper<uint64_t> pathInfoCacheSize{0};
+        Wrapper<uint64_t> pathInfoCacheHits{0};
+        Wrapper<uint64_t> pathInfoCacheMisses{0};
+        Wrapper<uint64_t> pathInfoCacheEvictions{0};
         Wrapper<uint64_t> narRead{0};
         Wrapper<uint64_t> narReadBytes{0};
         Wrapper<uint64_t> narReadCompressedBytes{0};
@@ -852,6 +859,15 @@ public:
 
     kj::Promise<Result<Stats<>>> getStats();
 
+    /**
+     * Size and hit/miss/eviction counters of the in-memory path info cache.
+     * Unlike getStats() this does not need to wait for anything.
+     */
+    ShardedLRUCache<std::string, PathInfoCacheValue>::Stats getPathInfoCacheStats()
+    {
+        return pathInfoCache.getStats();
+    }
+
     /**
      * Computes the full closure of of a set of store-paths for e.g.
      * derivations that need this information for `exportReferencesGraph`.
@@ -872,7 +888,8 @@ public:
      */
     kj::Promise<void> clearPathInfoCache()
     {
-        (co_await state.lock())->pathInfoCache.clear();
+        pathInfoCache.clear();
+        return kj::READY_NOW;
     }
 
     /**
@@ -12,6 +12,10 @@
 #include <dirent.h>
 #include <fcntl.h>
 
+#if __linux__
+#include <sys/sendfile.h>
+#endif
+
 #include "lix/libutil/archive.hh"
 #include "lix/libutil/async-io.hh"
 #include "lix/libutil/box_ptr.hh"
@@ -20,6 +24,7 @@
 #include "lix/libutil/finally.hh"
 #include "lix/libutil/generator.hh"
 #include "lix/libutil/logging.hh"
+#include "lix/libutil/read-ahead.hh"
 #include "lix/libutil/result.hh"
 #include "lix/libutil/serialise.hh"
 #include "lix/libutil/signals.hh"
@@ -38,11 +43,52 @@ static GlobalConfig::Register rArchiveSettings(&archiveSettings);
 PathFilter defaultPathFilter = [](const Path &) { return true; };
 
 
+/**
+ * Files at least this large are read on a separate thread, so that reading
+ * the next chunk from disk overlaps with consuming the current one (usually
+ * by hashing it). Smaller files are not worth starting a thread for.
+ */
+static constexpr off_t readAheadMinSize = 4 * 1024 * 1024;
+static constexpr size_t readAheadChunkSize = 1024 * 1024;
+static constexpr size_t readAheadChunks = 4;
+
+static WireFormatGenerator dumpContentsReadAhead(int fd, size_t size)
+{
+    size_t left = size;
+    ReadAhead readAhead(
+        [&](std::span<char> buf) {
+            const auto n = std::min(left, buf.size());
+            readFull(fd, buf.data(), n);
+            left -= n;
+            return n;
+        },
+        readAheadChunkSize,
+        readAheadChunks
+    );
+
+    while (true) {
+        auto data = readAhead.next();
+        if (data.empty()) {
+            break;
+        }
+        co_yield data;
+    }
+}
+
 static WireFormatGenerator dumpContents(Path path, off_t size)
 {
     AutoCloseFD fd{open(path.c_str(), O_RDONLY | O_CLOEXEC)};
     if (!fd) throw SysError("opening file '%1%'", path);
 
+#if HAVE_POSIX_FADVISE
+    posix_fadvise(fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    if (size >= readAheadMinSize) {
+        co_yield dumpContentsReadAhead(fd.get(), size);
+        co_return;
+    }
+
     std::vector<char> buf(65536);
     size_t left = size;
 
@@ -54,6 +100,45 @@ static WireFormatGenerator dumpContents(Path path, off_t size)
     }
 }
 
+/**
+ * Like dumpContents(), but writes the file directly to the descriptor of
+ * `sink` after flushing everything dumped before it. On Linux the data is
+ * copied by the kernel with sendfile() and never enters a user space buffer;
+ * elsewhere, or if the descriptor does not support it, this falls back to
+ * yielding the contents like dumpContents() does.
+ */
+static WireFormatGenerator sendContents(Path path, off_t size, FdSink & sink)
+{
+#if __linux__
+    AutoCloseFD fd{open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (!fd) throw SysError("opening file '%1%'", path);
+
+    sink.flush();
+
+    off_t offset = 0;
+    while (offset < size) {
+        checkInterrupt();
+        auto n = sendfile(sink.fd, fd.get(), &offset, std::min<off_t>(size - offset, 1 << 24));
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (offset == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                co_yield dumpContents(std::move(path), size);
+                co_return;
+            }
+            throw SysError("sending file '%1%'", path);
+        }
+        if (n == 0) {
+            throw EndOfFile("file '%1%' was truncated while it was being dumped", path);
+        }
+        sink.written += n;
+    }
+#else
+    co_yield dumpContents(std::move(path), size);
+#endif
+}
+
 static WireFormatGenerator dumpSingle(nar::File f)
 {
     co_yield "type";
@@ -116,7 +201,10 @@ WireFormatGenerator nar::dump(nar::Entry nar)
 // returnUnhacked is false directory entries will be returned as they have
 // been read from disk. to produce a correct NAR from the results the case
 // hack must be undone if configured unless returnUnhacked is set to true.
-static nar::Entry list(Path path, time_t & mtime, PathFilter & filter, bool returnUnhacked)
+// if sendTo is set, file contents are written to it with sendContents().
+static nar::Entry list(
+    Path path, time_t & mtime, PathFilter & filter, bool returnUnhacked, FdSink * sendTo = nullptr
+)
 {
     checkInterrupt();
 
@@ -127,10 +215,15 @@ static nar::Entry list(Path path, time_t & mtime, PathFilter & filter, bool retu
         return nar::File{
             (st.st_mode & S_IXUSR) != 0,
             uint64_t(st.st_size),
-            dumpContents(std::move(path), st.st_size)
+            sendTo ? sendContents(std::move(path), st.st_size, *sendTo)
+                   : dumpContents(std::move(path), st.st_size)
         };
     } else if (S_ISDIR(st.st_mode)) {
-        auto contents = [](Path path, time_t & mtime, PathFilter & filter, bool returnUnhacked
+        auto contents = [](Path path,
+                           time_t & mtime,
+                           PathFilter & filter,
+                           bool returnUnhacked,
+                           FdSink * sendTo
                         ) -> Generator<std::pair<const std::string &, nar::Entry>> {
             /* If we're on a case-insensitive system like macOS, undo
                the case hack applied by restorePath(). */
@@ -157,7 +250,7 @@ static nar::Entry list(Path path, time_t & mtime, PathFilter & filter, bool retu
                     auto diskPath = path + "/" + i.second;
                     co_yield std::pair(
                         std::cref(returnUnhacked ? i.first : i.second),
-                        list(diskPath, tmp_mtime, filter, returnUnhacked)
+                        list(diskPath, tmp_mtime, filter, returnUnhacked, sendTo)
                     );
                     if (tmp_mtime > mtime) {
                         mtime = tmp_mtime;
@@ -166,7 +259,7 @@ static nar::Entry list(Path path, time_t & mtime, PathFilter & filter, bool retu
             }
         };
 
-        return nar::Directory(contents(std::move(path), mtime, filter, returnUnhacked));
+        return nar::Directory(contents(std::move(path), mtime, filter, returnUnhacked, sendTo));
     } else if (S_ISLNK(st.st_mode)) {
         return nar::Symlink{readLink(path)};
     } else {
@@ -191,6 +284,12 @@ WireFormatGenerator dumpPath(Path path)
     co_yield prepared->dump();
 }
 
+void dumpPath(const Path & path, FdSink & sink)
+{
+    time_t ignored;
+    sink << nar::dump(list(path, ignored, defaultPathFilter, true, &sink));
+}
+
 
 WireFormatGenerator dumpString(std::string_view s)
 {
@@ -63,6 +63,14 @@ namespace nix {
 WireFormatGenerator dumpPath(Path path, PathFilter & filter);
 WireFormatGenerator dumpPath(Path path);
 
+/**
+ * Write a Nix archive of `path` to `sink`. Regular file contents are sent to
+ * the sink's file descriptor with `sendfile()` where the platform supports
+ * it, so they are not copied through user space. `sink` may still buffer
+ * data when this returns.
+ */
+void dumpPath(const Path & path, FdSink & sink);
+
 /**
  * Same as dumpPath(), but returns the last modified date of the path.
  */
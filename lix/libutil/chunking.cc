@@ -0,0 +1,82 @@
+#include "lix/libutil/chunking.hh"
+#include "lix/libutil/error.hh"
+
+#include <array>
+#include <bit>
+
+namespace nix {
+
+/**
+ * Random values for the gear hash, generated with splitmix64 from a fixed
+ * seed. Changing them changes all chunk boundaries.
+ */
+static constexpr std::array<uint64_t, 256> gearTable = [] {
+    std::array<uint64_t, 256> table{};
+    uint64_t state = 0;
+    for (auto & entry : table) {
+        state += 0x9e3779b97f4a7c15;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        entry = z ^ (z >> 31);
+    }
+    return table;
+}();
+
+ChunkingSink::ChunkingSink(size_t averageSize, OnChunk onChunk)
+    : minSize(averageSize / 2)
+    , maxSize(averageSize * 4)
+    , onChunk(std::move(onChunk))
+{
+    if (!std::has_single_bit(averageSize) || averageSize < 64) {
+        throw Error("chunk size %d is not a power of two of at least 64", averageSize);
+    }
+    /* The hash shifts left once per byte, so its top bits depend on the last
+       64 bytes and are the ones to test. Since the first minSize bytes of a
+       chunk can never end it, the expected chunk size is minSize plus the
+       average distance between matches, which is averageSize / 2 here. */
+    mask = ~uint64_t(0) << (64 - (std::countr_zero(averageSize) - 1));
+    chunk.reserve(maxSize);
+}
+
+void ChunkingSink::emit()
+{
+    onChunk(chunk);
+    chunk.clear();
+    hash = 0;
+}
+
+void ChunkingSink::operator()(std::string_view data)
+{
+    while (!data.empty()) {
+        /* Bytes before the minimum chunk size are not checked for a
+           boundary, but the hash over them still matters once the chunk
+           reaches the minimum size. */
+        size_t i = 0;
+        bool boundary = false;
+        for (; i < data.size(); i++) {
+            hash = (hash << 1) + gearTable[static_cast<unsigned char>(data[i])];
+            const auto size = chunk.size() + i + 1;
+            if ((size >= minSize && (hash & mask) == 0) || size >= maxSize) {
+                boundary = true;
+                i++;
+                break;
+            }
+        }
+
+        chunk.append(data.substr(0, i));
+        data.remove_prefix(i);
+        if (boundary) {
+            emit();
+        }
+    }
+}
+
+void ChunkingSink::finish()
+{
+    if (!chunk.empty()) {
+        emit();
+    }
+}
+
+}
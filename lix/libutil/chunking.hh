@@ -0,0 +1,52 @@
+#pragma once
+///@file
+
+#include "lix/libutil/serialise.hh"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace nix {
+
+/**
+ * Splits the data written to it into chunks at content-defined boundaries,
+ * so that inserting or removing data only changes the chunks around the
+ * edit and all other chunks of two similar inputs are identical. Boundaries
+ * are found with a gear rolling hash over the last 64 bytes; chunks are at
+ * least half and at most four times the requested average size.
+ *
+ * Chunk boundaries become part of on-disk formats (e.g. chunked binary
+ * caches), so the hash must never change.
+ */
+class ChunkingSink : public FinishSink
+{
+public:
+    using OnChunk = std::function<void(std::string_view)>;
+
+private:
+    size_t minSize, maxSize;
+    uint64_t mask;
+    uint64_t hash = 0;
+    std::string chunk;
+    OnChunk onChunk;
+
+    void emit();
+
+public:
+    /**
+     * @param averageSize Desired average chunk size. Must be a power of two
+     * and at least 64.
+     */
+    ChunkingSink(size_t averageSize, OnChunk onChunk);
+
+    void operator()(std::string_view data) override;
+
+    /**
+     * Emits the final chunk, which may be shorter than the minimum size.
+     */
+    void finish() override;
+};
+
+}
@@ -3,11 +3,16 @@
 #include "lix/libutil/tarfile.hh"
 #include "lix/libutil/signals.hh"
 #include "lix/libutil/logging.hh"
+#include "lix/libutil/thread-pool.hh"
 
 #include <archive.h>
 #include <archive_entry.h>
 #include <cstdio>
 #include <cstring>
+#include <array>
+#include <deque>
+#include <future>
+#include <thread>
 
 #include <brotli/decode.h>
 #include <brotli/encode.h>
@@ -310,4 +315,183 @@ std::string compress(const std::string & method, std::string_view in, const bool
     return std::move(ssink.s);
 }
 
+/**
+ * Number of frames compressed or decompressed at the same time. This bounds
+ * both the threads and the memory spent on frames in flight, to a small
+ * multiple of the frame size.
+ */
+static size_t maxFramesInFlight()
+{
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+/**
+ * Decompresses a single frame, failing if it expands to more than any frame a
+ * framed compression sink writes.
+ */
+static std::string decompressFrame(const std::string & method, std::string_view frame)
+{
+    StringSource source{frame};
+    auto decompressor = makeDecompressionSource(method, source);
+    std::string out;
+    std::array<char, 64 * 1024> buf;
+    while (true) {
+        size_t n;
+        try {
+            n = decompressor->read(buf.data(), buf.size());
+        } catch (EndOfFile &) {
+            return out;
+        }
+        if (out.size() + n > maxCompressionFrameSize) {
+            throw CompressionError(
+                "compressed frame expands to more than %d bytes", maxCompressionFrameSize
+            );
+        }
+        out.append(buf.data(), n);
+    }
+}
+
+bool supportsCompressionFrames(const std::string & method)
+{
+    return method == "xz" || method == "zstd";
+}
+
+struct FramedCompressionSink : CompressionSink
+{
+    std::string method;
+    Sink & nextSink;
+    size_t frameSize;
+    std::vector<uint64_t> & frameSizes;
+    int level;
+
+    std::string frame;
+    std::deque<std::future<std::string>> pending;
+
+    /**
+     * Declared last so that its threads are stopped before anything they use
+     * is destroyed.
+     */
+    ThreadPool pool{"compress frames", maxFramesInFlight()};
+
+    FramedCompressionSink(
+        std::string method, Sink & nextSink, size_t frameSize, std::vector<uint64_t> & frameSizes, int level
+    )
+        : method(std::move(method))
+        , nextSink(nextSink)
+        , frameSize(frameSize)
+        , frameSizes(frameSizes)
+        , level(level)
+    {
+        frame.reserve(frameSize);
+    }
+
+    void writeUnbuffered(std::string_view data) override
+    {
+        while (!data.empty()) {
+            auto n = std::min(frameSize - frame.size(), data.size());
+            frame.append(data.substr(0, n));
+            data.remove_prefix(n);
+            if (frame.size() == frameSize) {
+                startFrame();
+            }
+        }
+    }
+
+    void finish() override
+    {
+        flush();
+        // empty input still needs one (empty) frame to be a valid stream
+        if (!frame.empty() || (frameSizes.empty() && pending.empty())) {
+            startFrame();
+        }
+        while (!pending.empty()) {
+            writeFrame();
+        }
+    }
+
+    void startFrame()
+    {
+        if (pending.size() >= maxFramesInFlight()) {
+            writeFrame();
+        }
+        pending.push_back(pool.enqueueWithResult([method{method}, level{level}, in{std::move(frame)}] {
+            return compress(method, in, false, level);
+        }));
+        frame = {};
+        frame.reserve(frameSize);
+    }
+
+    void writeFrame()
+    {
+        auto out = pending.front().get();
+        pending.pop_front();
+        nextSink(out);
+        frameSizes.push_back(out.size());
+    }
+};
+
+ref<CompressionSink> makeFramedCompressionSink(
+    const std::string & method,
+    Sink & nextSink,
+    size_t frameSize,
+    std::vector<uint64_t> & frameSizes,
+    int level
+)
+{
+    if (!supportsCompressionFrames(method)) {
+        throw UnknownCompressionMethod("compression method '%s' does not support frames", method);
+    }
+    assert(frameSize > 0);
+    if (frameSize > maxCompressionFrameSize) {
+        throw Error(
+            "compression frame size %d exceeds the maximum of %d bytes", frameSize, maxCompressionFrameSize
+        );
+    }
+    return make_ref<FramedCompressionSink>(method, nextSink, frameSize, frameSizes, level);
+}
+
+WireFormatGenerator decompressFrames(
+    std::string method, Source & source, std::vector<uint64_t> frameSizes, uint64_t totalSize, uint64_t maxOutput
+)
+{
+    uint64_t sum = 0;
+    for (auto size : frameSizes) {
+        if (size == 0 || size > maxCompressedFrameSize) {
+            throw CompressionError("invalid compressed frame size %d", size);
+        }
+        sum += size;
+        if (sum > totalSize) {
+            break;
+        }
+    }
+    if (sum != totalSize) {
+        throw CompressionError("compressed frame sizes do not add up to %d bytes", totalSize);
+    }
+
+    std::deque<std::future<std::string>> pending;
+    ThreadPool pool{"decompress frames", maxFramesInFlight()};
+    size_t next = 0;
+    uint64_t output = 0;
+
+    while (next < frameSizes.size() || !pending.empty()) {
+        while (next < frameSizes.size() && pending.size() < maxFramesInFlight()) {
+            std::string frame(frameSizes[next++], '\0');
+            source(frame.data(), frame.size());
+            pending.push_back(pool.enqueueWithResult([method, frame{std::move(frame)}] {
+                return decompressFrame(method, frame);
+            }));
+        }
+
+        auto data = pending.front().get();
+        pending.pop_front();
+        output += data.size();
+        if (output > maxOutput) {
+            throw CompressionError("compressed frames expand to more than %d bytes", maxOutput);
+        }
+        co_yield std::span<const char>{data.data(), data.size()};
+    }
+
+    pool.process();
+}
+
 }
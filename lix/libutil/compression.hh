@@ -6,6 +6,7 @@
 #include "lix/libutil/serialise.hh"
 
 #include <string>
+#include <vector>
 
 namespace nix {
 
@@ -24,6 +25,52 @@ std::string compress(const std::string & method, std::string_view in, const bool
 
 ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel = false, int level = -1);
 
+/**
+ * Whether a stream of independently compressed frames of this method can be
+ * read back as a whole by the regular decompressor, i.e. whether the method's
+ * decoders accept concatenated streams.
+ */
+bool supportsCompressionFrames(const std::string & method);
+
+/**
+ * Largest uncompressed frame size a framed compression sink accepts.
+ */
+constexpr size_t maxCompressionFrameSize = 64 * 1024 * 1024;
+
+/**
+ * Largest compressed frame decompressFrames() accepts. Neither xz nor zstd
+ * expands incompressible input by more than a few bytes per block, so this
+ * leaves ample room for any frame a framed compression sink can write.
+ */
+constexpr uint64_t maxCompressedFrameSize = 2 * maxCompressionFrameSize;
+
+/**
+ * Compresses its input in independent frames of `frameSize` uncompressed
+ * bytes each (the last frame may be shorter), compressing several frames in
+ * parallel. The compressed size of each frame is appended to `frameSizes` as
+ * the frame is written to `nextSink`, so that decompressFrames() can later
+ * split the stream without decompressing it first.
+ */
+ref<CompressionSink> makeFramedCompressionSink(
+    const std::string & method,
+    Sink & nextSink,
+    size_t frameSize,
+    std::vector<uint64_t> & frameSizes,
+    int level = -1
+);
+
+/**
+ * Decompresses a stream written by a framed compression sink, decompressing
+ * several frames in parallel. `frameSizes` are the compressed frame sizes,
+ * which must each be at most `maxCompressedFrameSize` and add up to
+ * `totalSize`; no more than `totalSize` bytes are read from `source`. Fails
+ * if a frame expands to more than `maxCompressionFrameSize` bytes or all of
+ * them to more than `maxOutput` bytes.
+ */
+WireFormatGenerator decompressFrames(
+    std::string method, Source & source, std::vector<uint64_t> frameSizes, uint64_t totalSize, uint64_t maxOutput
+);
+
 MakeError(UnknownCompressionMethod, Error);
 
 MakeError(CompressionError, Error);
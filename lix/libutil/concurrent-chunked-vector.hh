@@ -0,0 +1,121 @@
+#pragma once
+///@file
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+
+namespace nix {
+
+/**
+ * Append-only indexable container with stable element addresses that may be
+ * appended to from multiple threads concurrently. Unlike ChunkedVector, which
+ * keeps its chunks in a growable vector, this container uses a fixed table of
+ * geometrically growing chunks (chunk `k` holds `FirstChunkSize << k` elements)
+ * so that the chunk table never moves and indexing never needs a lock.
+ *
+ * Reading an element is wait-free. Appending reserves an index with a single
+ * atomic increment and only allocates (lock-free, via compare-and-swap) when
+ * the first element of a new chunk is reserved.
+ *
+ * Elements are only guaranteed to be visible to another thread once the index
+ * returned by add() has been handed to that thread through some synchronising
+ * operation (e.g. a mutex or an atomic with release/acquire semantics). forEach()
+ * must not be called concurrently with add().
+ */
+template<typename T, uint32_t FirstChunkSize>
+class ConcurrentChunkedVector
+{
+    static_assert(std::has_single_bit(FirstChunkSize), "FirstChunkSize must be a power of two");
+
+private:
+    static constexpr unsigned firstChunkBits = std::countr_zero(FirstChunkSize);
+    static constexpr unsigned chunkCount = 33 - firstChunkBits;
+
+    std::atomic<uint32_t> size_ = 0;
+    std::array<std::atomic<T *>, chunkCount> chunks = {};
+
+    static constexpr size_t chunkSize(unsigned chunk)
+    {
+        return size_t(FirstChunkSize) << chunk;
+    }
+
+    static constexpr std::pair<unsigned, size_t> locate(uint32_t idx)
+    {
+        const uint64_t biased = uint64_t(idx) + FirstChunkSize;
+        const unsigned chunk = std::bit_width(biased) - 1 - firstChunkBits;
+        return {chunk, biased - chunkSize(chunk)};
+    }
+
+    /**
+     * Keep this out of the ::add hot path
+     */
+    [[gnu::noinline]]
+    T * addChunk(unsigned chunk)
+    {
+        T * fresh = new T[chunkSize(chunk)];
+        T * expected = nullptr;
+        if (chunks[chunk].compare_exchange_strong(expected, fresh, std::memory_order_acq_rel)) {
+            return fresh;
+        }
+        delete[] fresh;
+        return expected;
+    }
+
+public:
+    ConcurrentChunkedVector() = default;
+
+    ConcurrentChunkedVector(const ConcurrentChunkedVector &) = delete;
+    ConcurrentChunkedVector & operator=(const ConcurrentChunkedVector &) = delete;
+
+    ~ConcurrentChunkedVector()
+    {
+        for (auto & chunk : chunks) {
+            delete[] chunk.load(std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Number of elements reserved so far. This may include elements that are
+     * still being written by a concurrent add().
+     */
+    uint32_t size() const
+    {
+        return size_.load(std::memory_order_acquire);
+    }
+
+    std::pair<T &, uint32_t> add(T value)
+    {
+        const auto idx = size_.fetch_add(1, std::memory_order_acq_rel);
+        if (idx == std::numeric_limits<uint32_t>::max()) {
+            abort();
+        }
+        const auto [chunk, offset] = locate(idx);
+        T * storage = chunks[chunk].load(std::memory_order_acquire);
+        if (!storage) {
+            storage = addChunk(chunk);
+        }
+        auto & result = storage[offset];
+        result = std::move(value);
+        return {result, idx};
+    }
+
+    const T & operator[](uint32_t idx) const
+    {
+        const auto [chunk, offset] = locate(idx);
+        return chunks[chunk].load(std::memory_order_acquire)[offset];
+    }
+
+    template<typename Fn>
+    void forEach(Fn fn) const
+    {
+        const auto n = size();
+        for (uint32_t i = 0; i < n; i++) {
+            fn((*this)[i]);
+        }
+    }
+};
+}
@@ -1,7 +1,13 @@
 #pragma once
 ///@file
 
+#include "lix/libutil/sync.hh"
+
+#include <atomic>
 #include <cassert>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <map>
 #include <list>
 #include <optional>
@@ -35,14 +41,16 @@ public:
     LRUCache(size_t capacity) : capacity(capacity) { }
 
     /**
-     * Insert or upsert an item in the cache.
+     * Insert or upsert an item in the cache. Returns whether another item
+     * had to be retired to make room for it.
      */
-    void upsert(const Key & key, const Value & value)
+    bool upsert(const Key & key, const Value & value)
     {
-        if (capacity == 0) return;
+        if (capacity == 0) return false;
 
         erase(key);
 
+        bool retired = false;
         if (data.size() >= capacity) {
             /**
              * Retire the oldest item.
@@ -50,6 +58,7 @@ public:
             auto oldest = lru.begin();
             data.erase(*oldest);
             lru.erase(oldest);
+            retired = true;
         }
 
         auto res = data.emplace(key, std::make_pair(LRUIterator(), value));
@@ -59,6 +68,8 @@ public:
         auto j = lru.insert(lru.end(), i);
 
         i->second.first.it = j;
+
+        return retired;
     }
 
     bool erase(const Key & key)
@@ -101,4 +112,90 @@ public:
     }
 };
 
+/**
+ * A thread-safe cache made of several independently locked LRUCaches. Keys are
+ * distributed over the shards by their hash, so that concurrent users only
+ * contend for a lock when they touch the same shard. Eviction happens per
+ * shard and is thus only approximately least-recently-used overall.
+ */
+template<typename Key, typename Value, size_t Shards = 16, typename Hash = std::hash<Key>>
+class ShardedLRUCache
+{
+public:
+
+    struct Stats
+    {
+        uint64_t size = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+    };
+
+private:
+
+    /**
+     * A deque since `Sync` can be neither copied nor moved.
+     */
+    std::deque<Sync<LRUCache<Key, Value>>> shards;
+
+    std::atomic<uint64_t> hits = 0, misses = 0, evictions = 0;
+
+    Sync<LRUCache<Key, Value>> & shardFor(const Key & key)
+    {
+        return shards[Hash{}(key) % Shards];
+    }
+
+public:
+
+    /**
+     * @param capacity Total capacity, split evenly among the shards.
+     */
+    ShardedLRUCache(size_t capacity)
+    {
+        for (size_t i = 0; i < Shards; i++) {
+            shards.emplace_back(std::in_place, (capacity + Shards - 1) / Shards);
+        }
+    }
+
+    bool upsert(const Key & key, const Value & value)
+    {
+        auto retired = shardFor(key).lock()->upsert(key, value);
+        if (retired) evictions++;
+        return retired;
+    }
+
+    bool erase(const Key & key)
+    {
+        return shardFor(key).lock()->erase(key);
+    }
+
+    std::optional<Value> get(const Key & key)
+    {
+        auto res = shardFor(key).lock()->get(key);
+        (res ? hits : misses)++;
+        return res;
+    }
+
+    size_t size()
+    {
+        size_t total = 0;
+        for (auto & shard : shards) {
+            total += shard.lock()->size();
+        }
+        return total;
+    }
+
+    void clear()
+    {
+        for (auto & shard : shards) {
+            shard.lock()->clear();
+        }
+    }
+
+    Stats getStats()
+    {
+        return {size(), hits, misses, evictions};
+    }
+};
+
 }
@@ -0,0 +1,109 @@
+#include "lix/libutil/read-ahead.hh"
+
+namespace nix {
+
+ReadAhead::ReadAhead(Fill fill, size_t chunkSize, size_t chunks)
+{
+    {
+        auto state(state_.lock());
+        for (size_t i = 0; i < chunks; i++) {
+            state->empty.push_back({std::vector<char>(chunkSize), 0});
+        }
+    }
+    producer = std::thread([this, fill{std::move(fill)}] { run(fill); });
+}
+
+ReadAhead::~ReadAhead()
+{
+    state_.lock()->stop = true;
+    drained.notify_one();
+    producer.join();
+}
+
+void ReadAhead::run(const Fill & fill)
+{
+    try {
+        while (true) {
+            Chunk chunk;
+            {
+                auto state(state_.lock());
+                while (state->empty.empty() && !state->stop) {
+                    state.wait(drained);
+                }
+                if (state->stop) {
+                    return;
+                }
+                chunk = std::move(state->empty.front());
+                state->empty.pop_front();
+            }
+
+            chunk.size = fill(chunk.data);
+            const bool end = chunk.size == 0;
+
+            {
+                auto state(state_.lock());
+                if (end) {
+                    state->done = true;
+                } else {
+                    state->full.push_back(std::move(chunk));
+                }
+            }
+            filled.notify_one();
+
+            if (end) {
+                return;
+            }
+        }
+    } catch (...) {
+        state_.lock()->error = std::current_exception();
+        filled.notify_one();
+    }
+}
+
+std::span<const char> ReadAhead::next()
+{
+    if (current) {
+        state_.lock()->empty.push_back(std::move(*current));
+        current.reset();
+        drained.notify_one();
+    }
+
+    auto state(state_.lock());
+    while (state->full.empty() && !state->done && !state->error) {
+        state.wait(filled);
+    }
+    if (!state->full.empty()) {
+        current = std::move(state->full.front());
+        state->full.pop_front();
+        return {current->data.data(), current->size};
+    }
+    if (state->error) {
+        std::rethrow_exception(state->error);
+    }
+    return {};
+}
+
+WireFormatGenerator readAhead(Source & source, size_t chunkSize, size_t chunks)
+{
+    ReadAhead ahead(
+        [&](std::span<char> buf) -> size_t {
+            try {
+                return source.read(buf.data(), buf.size());
+            } catch (EndOfFile &) {
+                return 0;
+            }
+        },
+        chunkSize,
+        chunks
+    );
+
+    while (true) {
+        auto data = ahead.next();
+        if (data.empty()) {
+            break;
+        }
+        co_yield data;
+    }
+}
+
+}
@@ -0,0 +1,87 @@
+#pragma once
+///@file
+
+#include "lix/libutil/serialise.hh"
+#include "lix/libutil/sync.hh"
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <list>
+#include <optional>
+#include <span>
+#include <thread>
+#include <vector>
+
+namespace nix {
+
+/**
+ * Runs a producer on a background thread that fills a bounded number of
+ * buffers, which are then consumed in order on the calling thread. This lets
+ * reading or decompressing data overlap with hashing it or writing it out,
+ * while keeping at most `chunks * chunkSize` bytes in flight.
+ *
+ * Exceptions thrown by the producer are rethrown by next() once all data
+ * produced before the exception has been consumed. Destroying a ReadAhead
+ * stops the producer after its current fill and waits for it to exit.
+ */
+class ReadAhead
+{
+public:
+    /**
+     * Writes data to a prefix of the given buffer and returns its length.
+     * Returning 0 signals the end of the data.
+     */
+    using Fill = std::function<size_t(std::span<char>)>;
+
+private:
+    struct Chunk
+    {
+        std::vector<char> data;
+        size_t size = 0;
+    };
+
+    struct State
+    {
+        std::list<Chunk> full, empty;
+        bool stop = false;
+        bool done = false;
+        std::exception_ptr error;
+    };
+
+    Sync<State> state_;
+    std::condition_variable filled, drained;
+
+    /**
+     * Chunk most recently returned by next(), handed back to the producer on
+     * the following call.
+     */
+    std::optional<Chunk> current;
+
+    std::thread producer;
+
+    void run(const Fill & fill);
+
+public:
+    ReadAhead(Fill fill, size_t chunkSize, size_t chunks);
+
+    ReadAhead(const ReadAhead &) = delete;
+    ReadAhead & operator=(const ReadAhead &) = delete;
+
+    ~ReadAhead();
+
+    /**
+     * Returns the next piece of data, or an empty span once the producer is
+     * done. The returned span stays valid until the next call.
+     */
+    std::span<const char> next();
+};
+
+/**
+ * Reads `source` until its end on a background thread, yielding the data in
+ * pieces of at most `chunkSize` bytes. `source` must not be used by anything
+ * else while the generator is alive.
+ */
+WireFormatGenerator readAhead(Source & source, size_t chunkSize = 1024 * 1024, size_t chunks = 4);
+
+}
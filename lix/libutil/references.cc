@@ -2,22 +2,52 @@
 #include "lix/libutil/hash.hh"
 #include "lix/libutil/logging.hh"
 
+#include <bit>
 #include <cstdlib>
 #include <mutex>
 #include <algorithm>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 namespace nix {
 
 
-static size_t refLength = 32; /* characters */
+static constexpr size_t refLength = 32; /* characters */
+
+
+#if defined(__SSE2__)
+/**
+ * Returns a mask in which bit `n` is set iff `s[n]` is a base-32 character,
+ * for the 16 bytes starting at `s`.
+ */
+static inline uint32_t base32Mask(const char * s)
+{
+    const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s));
+    const auto inRange = [&](char lo, char hi) {
+        // signed comparisons, but bytes >= 0x80 are below both bounds anyway
+        return _mm_and_si128(
+            _mm_cmpgt_epi8(c, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8(hi + 1))
+        );
+    };
+    const auto is = [&](char x) { return _mm_cmpeq_epi8(c, _mm_set1_epi8(x)); };
+
+    // base32Chars are the digits and the lowercase letters except e, o, t and u.
+    const __m128i excluded = _mm_or_si128(_mm_or_si128(is('e'), is('o')), _mm_or_si128(is('t'), is('u')));
+    const __m128i ok = _mm_or_si128(inRange('0', '9'), _mm_andnot_si128(excluded, inRange('a', 'z')));
+    return _mm_movemask_epi8(ok);
+}
+#endif
 
 
 static void search(
     std::string_view s,
-    StringSet & hashes,
+    const RefScanSink::Hashes & hashes,
     StringSet & seen)
 {
+#if !defined(__SSE2__)
     static std::once_flag initialised;
     static bool isBase32[256];
     std::call_once(initialised, [](){
@@ -25,8 +55,18 @@ static void search(
         for (unsigned int i = 0; i < base32Chars.size(); ++i)
             isBase32[(unsigned char) base32Chars[i]] = true;
     });
+#endif
 
     for (size_t i = 0; i + refLength <= s.size(); ) {
+#if defined(__SSE2__)
+        static_assert(refLength == 32);
+        const uint32_t mask = base32Mask(&s[i]) | (base32Mask(&s[i + 16]) << 16);
+        if (mask != 0xffffffff) {
+            /* Skip past the last non-base-32 character in the window. */
+            i += refLength - std::countl_one(mask);
+            continue;
+        }
+#else
         int j;
         bool match = true;
         for (j = refLength - 1; j >= 0; --j)
@@ -36,10 +76,10 @@ static void search(
                 break;
             }
         if (!match) continue;
-        std::string ref(s.substr(i, refLength));
-        if (hashes.erase(ref)) {
+#endif
+        auto ref = s.substr(i, refLength);
+        if (auto hash = hashes.find(ref); hash != hashes.end() && seen.insert(*hash).second) {
             debug("found reference to '%1%' at offset '%2%'", ref, i);
-            seen.insert(ref);
         }
         ++i;
     }
@@ -54,9 +94,9 @@ void RefScanSink::operator () (std::string_view data)
     auto s = tail;
     auto tailLen = std::min(data.size(), refLength);
     s.append(data.data(), tailLen);
-    search(s, hashes, seen);
+    search(s, *hashes, seen);
 
-    search(data, hashes, seen);
+    search(data, *hashes, seen);
 
     auto rest = refLength - tailLen;
     if (rest < tail.size())
@@ -65,6 +105,13 @@ void RefScanSink::operator () (std::string_view data)
 }
 
 
+void RefScanSink::scanSeparately(std::string_view data)
+{
+    tail.clear();
+    search(data, *hashes, seen);
+}
+
+
 RewritingSource::RewritingSource(const std::string & from, const std::string & to, Source & inner)
     : RewritingSource({{from, to}}, inner)
 {
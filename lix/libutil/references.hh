@@ -3,24 +3,56 @@
 
 #include "lix/libutil/hash.hh"
 
+#include <memory>
+
 namespace nix {
 
 class RefScanSink : public Sink
 {
-    StringSet hashes;
+public:
+    /**
+     * Hash parts to look for. Candidates found in the scanned data are
+     * looked up as `std::string_view`s, without copying them first.
+     */
+    using Hashes = std::set<std::string, std::less<>>;
+
+private:
+    /**
+     * Shared with forks of this sink, and never modified after construction.
+     */
+    std::shared_ptr<const Hashes> hashes;
     StringSet seen;
 
     std::string tail;
 
+    explicit RefScanSink(std::shared_ptr<const Hashes> hashes) : hashes(std::move(hashes))
+    { }
+
 public:
 
-    RefScanSink(StringSet && hashes) : hashes(hashes)
+    RefScanSink(StringSet && hashes)
+        : hashes(std::make_shared<const Hashes>(
+            std::make_move_iterator(hashes.begin()), std::make_move_iterator(hashes.end())
+        ))
     { }
 
     StringSet & getResult()
     { return seen; }
 
     void operator () (std::string_view data) override;
+
+    /**
+     * Scan a complete string on its own. Unlike with operator(), references
+     * spanning `data` and anything else fed to this sink are not found.
+     */
+    void scanSeparately(std::string_view data);
+
+    /**
+     * Create a sink that looks for the same hashes as this one, with an empty
+     * result set. Different forks of one sink may be used concurrently.
+     */
+    RefScanSink fork() const
+    { return RefScanSink(hashes); }
 };
 
 struct RewritingSource : Source
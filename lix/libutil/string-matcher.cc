@@ -0,0 +1,118 @@
+#include "lix/libutil/string-matcher.hh"
+
+#include <cassert>
+#include <queue>
+
+namespace nix {
+
+MultiStringMatcher::MultiStringMatcher(const std::vector<std::string> & patterns)
+    : nodes(1)
+{
+    for (size_t i = 0; i < patterns.size(); i++) {
+        auto & pattern = patterns[i];
+        if (pattern.empty()) {
+            emptyPattern = i;
+            break;
+        }
+
+        uint32_t node = 0;
+        for (unsigned char c : pattern) {
+            auto next = child(node, c);
+            if (next == none) {
+                next = nodes.size();
+                nodes[node].children.emplace_back(c, next);
+                Node added;
+                added.depth = nodes[node].depth + 1;
+                nodes.push_back(std::move(added));
+            }
+            node = next;
+        }
+        if (nodes[node].pattern == none) {
+            nodes[node].pattern = i;
+        }
+        maxLength = std::max(maxLength, pattern.size());
+    }
+
+    /* Compute failure and output links breadth-first, so that the links
+       of all shallower nodes are known when a node is reached. */
+    std::queue<uint32_t> todo;
+    for (auto [c, next] : nodes[0].children) {
+        todo.push(next);
+    }
+    while (!todo.empty()) {
+        auto node = todo.front();
+        todo.pop();
+        auto & n = nodes[node];
+        n.output = n.pattern != none ? node : nodes[n.fail].output;
+        for (auto [c, next] : n.children) {
+            uint32_t fail = n.fail;
+            while (fail != 0 && child(fail, c) == none) {
+                fail = nodes[fail].fail;
+            }
+            auto target = child(fail, c);
+            nodes[next].fail = target != none ? target : 0;
+            todo.push(next);
+        }
+    }
+}
+
+uint32_t MultiStringMatcher::child(uint32_t node, unsigned char c) const
+{
+    for (auto [k, next] : nodes[node].children) {
+        if (k == c) {
+            return next;
+        }
+    }
+    return none;
+}
+
+uint32_t MultiStringMatcher::step(uint32_t node, unsigned char c) const
+{
+    while (true) {
+        auto next = child(node, c);
+        if (next != none) {
+            return next;
+        }
+        if (node == 0) {
+            return 0;
+        }
+        node = nodes[node].fail;
+    }
+}
+
+std::optional<MultiStringMatcher::Match>
+MultiStringMatcher::find(std::string_view text, size_t from) const
+{
+    assert(from <= text.size());
+
+    std::optional<Match> best;
+    auto consider = [&](Match m) {
+        if (!best || m.start < best->start || (m.start == best->start && m.pattern < best->pattern)) {
+            best = m;
+        }
+    };
+
+    if (emptyPattern) {
+        consider({from, 0, *emptyPattern});
+    }
+
+    uint32_t node = 0;
+    for (size_t pos = from; pos < text.size(); pos++) {
+        /* Matches found from here on end after `pos` and thus start after
+           `pos - maxLength`, so none of them can beat a match starting at or
+           before that. */
+        if (best && best->start + maxLength <= pos) {
+            break;
+        }
+
+        node = step(node, text[pos]);
+        for (auto out = nodes[node].output; out != none; out = nodes[nodes[out].fail].output) {
+            auto & n = nodes[out];
+            consider({pos + 1 - n.depth, n.depth, n.pattern});
+        }
+    }
+
+    return best;
+}
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+///@file
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace nix {
+
+/**
+ * Finds occurrences of any of a list of strings in a text using an
+ * Aho-Corasick automaton, so that searching costs time proportional to the
+ * length of the text rather than to its length times the number of
+ * patterns.
+ *
+ * Matches are chosen leftmost-first: the match that starts earliest wins,
+ * and of the patterns matching at the same position the one that comes
+ * first in the pattern list is chosen (not the longest one). This is the
+ * order in which `builtins.replaceStrings` tries its patterns.
+ */
+class MultiStringMatcher
+{
+public:
+    struct Match
+    {
+        size_t start;
+        size_t length;
+        /**
+         * Index of the matched pattern in the list given to the constructor.
+         */
+        size_t pattern;
+    };
+
+private:
+    static constexpr uint32_t none = UINT32_MAX;
+
+    struct Node
+    {
+        std::vector<std::pair<unsigned char, uint32_t>> children;
+        uint32_t fail = 0;
+        /**
+         * Nearest node on the failure chain (including this one) at which
+         * a pattern ends, or `none`.
+         */
+        uint32_t output = none;
+        /**
+         * Lowest index of the patterns ending at this node, or `none`.
+         */
+        uint32_t pattern = none;
+        uint32_t depth = 0;
+    };
+
+    std::vector<Node> nodes;
+    size_t maxLength = 0;
+    /**
+     * Index of the first empty pattern. An empty pattern matches at every
+     * position, so later patterns can never be chosen and are dropped.
+     */
+    std::optional<size_t> emptyPattern;
+
+    uint32_t child(uint32_t node, unsigned char c) const;
+    uint32_t step(uint32_t node, unsigned char c) const;
+
+public:
+    explicit MultiStringMatcher(const std::vector<std::string> & patterns);
+
+    /**
+     * Returns the leftmost-first match in `text` starting at or after
+     * `from`, which must not exceed the length of `text`.
+     */
+    std::optional<Match> find(std::string_view text, size_t from) const;
+};
+
+}
@@ -11,8 +11,10 @@
 #include <map>
 #include <queue>
 #include <functional>
+#include <future>
 #include <thread>
 #include <atomic>
+#include <type_traits>
 
 namespace nix {
 
@@ -47,6 +49,32 @@ public:
         enqueueWithAio([t{std::move(t)}](AsyncIoRoot &) { t(); });
     }
 
+    /**
+     * Enqueue a function and return a future for its result. Exceptions
+     * thrown by the function are passed on through the future instead of
+     * stopping the pool, so the caller decides what a failure means.
+     */
+    template<typename F>
+    auto enqueueWithResult(F f) -> std::future<std::invoke_result_t<F &>>
+    {
+        using T = std::invoke_result_t<F &>;
+        auto promise = std::make_shared<std::promise<T>>();
+        auto result = promise->get_future();
+        enqueue([promise, f{std::move(f)}]() mutable {
+            try {
+                if constexpr (std::is_void_v<T>) {
+                    f();
+                    promise->set_value();
+                } else {
+                    promise->set_value(f());
+                }
+            } catch (...) {
+                promise->set_exception(std::current_exception());
+            }
+        });
+        return result;
+    }
+
     /**
      * Execute work items until the queue is empty.
      *
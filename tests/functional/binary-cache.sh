@@ -26,6 +26,54 @@ nix log --substituters file://$cacheDir $outPath | grep FOO
 nix store copy-log --from file://$cacheDir $(nix-store -qd $outPath)^'*'
 nix log $outPath | grep FOO
 
+# Test whether Lix checks every chunk of a chunked NAR against the manifest.
+chunkCache=$TEST_ROOT/chunk-cache
+rm -rf $chunkCache
+nix copy --to "file://$chunkCache?chunk-size=1024" $outPath
+
+chunk=$(ls $chunkCache/chunks/*.xz | head -n1)
+mv $chunk $chunk.good
+xz -dc $chunk.good | tr '\000-\377' '\001-\377\000' | xz > $chunk
+
+clearStore
+clearCacheCache
+expect 1 nix-store --substituters "file://$chunkCache" --no-require-sigs -r $outPath 2>&1 | tee $TEST_ROOT/log
+grepQuiet "does not match its hash" $TEST_ROOT/log
+
+mv $chunk.good $chunk
+
+# Chunked NARs are named by a field that older clients do not know, so that
+# they reject them instead of trying to unpack the manifest.
+grepQuiet "^ChunkManifest: nar/.*\.chunks$" $chunkCache/*.narinfo
+expect 1 grepQuiet "^URL:" $chunkCache/*.narinfo
+
+# Chunks in the local chunk cache are not fetched again.
+localChunks=$TEST_ROOT/local-chunks
+rm -rf $localChunks
+clearStore
+clearCacheCache
+nix-store --substituters "file://$chunkCache?local-chunk-cache=$localChunks" --no-require-sigs -r $outPath
+[[ $(ls $localChunks/chunks | wc -l) = $(ls $chunkCache/chunks | wc -l) ]]
+
+mv $chunkCache/chunks $chunkCache/chunks.moved
+clearStore
+clearCacheCache
+nix-store --substituters "file://$chunkCache?local-chunk-cache=$localChunks" --no-require-sigs -r $outPath
+mv $chunkCache/chunks.moved $chunkCache/chunks
+rm -rf $localChunks
+
+# Chunk names in the manifest must be hashes, not paths.
+manifest=$(ls $chunkCache/nar/*.chunks | head -n1)
+sed -i '1s|^[^ ]*|../nix-cache-info|' $manifest
+
+clearStore
+clearCacheCache
+expect 1 nix-store --substituters "file://$chunkCache" --no-require-sigs -r $outPath 2>&1 | tee $TEST_ROOT/log
+grepQuiet "chunk manifest line '../nix-cache-info .*' is corrupt" $TEST_ROOT/log
+
+rm -rf $chunkCache
+
+
 basicDownloadTests() {
     # No uploading tests bcause upload with force HTTP doesn't work.
 
@@ -0,0 +1,23 @@
+let
+  tags = map (e: e.tag);
+
+  strings = builtins.genericClosure {
+    startSet = [ { key = "a"; tag = "a"; } ];
+    operator = { key, ... }:
+      if builtins.stringLength key < 3
+      then [ { key = key + "a"; tag = "x"; } { key = "a" + key; tag = "y"; } ]
+      else [ ];
+  };
+
+  paths = builtins.genericClosure {
+    startSet = [ { key = ./a; tag = "a"; } { key = ./b; tag = "b"; } { key = ./a; tag = "c"; } ];
+    operator = _: [ ];
+  };
+
+  # Integer and float keys compare numerically.
+  numbers = builtins.genericClosure {
+    startSet = [ { key = 1; tag = "a"; } { key = 2; tag = "b"; } { key = 1.0; tag = "c"; } { key = 3.0; tag = "d"; } { key = 3; tag = "e"; } ];
+    operator = _: [ ];
+  };
+
+in [ (tags strings) (tags paths) (tags numbers) ]
@@ -0,0 +1,12 @@
+let
+  a = "${./eval-okay-context.nix}";
+  b = "${./eval-okay-context-introspection.nix}";
+  names = s: builtins.sort builtins.lessThan
+    (map (p: builtins.substring 33 100 (baseNameOf p)) (builtins.attrNames (builtins.getContext s)));
+in [
+  (names "x${a}y")
+  (names "${a}${a}")
+  (names "${a}${b}")
+  (names "${b}x${a}")
+  (names ("x" + b + a + b))
+]
@@ -26,4 +26,10 @@ assert match "[[:space:]]+([[:upper:]]+)[[:space:]]+" "  FOO   " == [ "FOO" ];
 assert splitFN "/path/to/foobar.nix" == [ "/path/to/" "/path/to" "foobar" "nix" ];
 assert splitFN "foobar.cc" == [ null null "foobar" "cc" ];
 
+# Patterns without operators match literally.
+assert match "foo" "foo" == [ ];
+assert match "foo" "foobar" == null;
+assert match "a\\.b" "a.b" == [ ];
+assert match "a\\.b" "axb" == null;
+
 true
@@ -45,4 +45,18 @@ assert  split  "([ac])" "abc"    == [ "" [ "a" ] "b" [ "c" ] "" ];
 assert  split  "(a)|(c)" "abc"   == [ "" [ "a" null ] "b" [ null "c" ] "" ];
 assert  split  "([[:upper:]]+)" "  FOO   " == [ "  " [ "FOO" ] "   " ];
 
+# Patterns without operators match literally.
+assert  split "/" "/a//b/"       == [ "" [] "a" [] "" [] "b" [] "" ];
+assert  split "\\." "1.2.3"      == [ "1" [] "2" [] "3" ];
+assert  split "aa" "aaaaa"       == [ "" [] "" [] "a" ];
+assert  split "-" "foo"          == [ "foo" ];
+
+# Results are those of the backtracking matcher used before, including
+# that a repetition leading to a match is not left for a longer one, and
+# long matches do not exhaust the stack.
+assert  split "a*(aabc|b)" "aabc" == [ "" [ "b" ] "c" ];
+assert  split "(a|ab)(c|bcd)(d*)" "abcd" == [ "" [ "a" "bcd" "" ] "" ];
+assert  split "b*" "abab"        == [ "" [] "a" [] "" [] "a" [] "" [] "" ];
+assert  length (split "(.*)" (concatStringsSep "" (genList (_: "x") 100000))) == 5;
+
 true
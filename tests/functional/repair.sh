@@ -7,7 +7,16 @@ clearStore
 path=$(nix-build dependencies.nix -o $TEST_ROOT/result)
 path2=$(nix-store -qR $path | grep input-2)
 
-nix-store --verify --check-contents -v
+nix-store --verify --check-contents -v --option verify-jobs 1 --option verify-rate-limit 100000000
+
+# An interrupted check is resumed, skipping the paths it already checked.
+chmod u+w $path2
+touch $path2/bad
+basename $path2 > $NIX_STATE_DIR/db/verify-contents-progress
+nix-store --verify --check-contents 2>&1 | grepQuiet "resuming an interrupted check"
+[[ ! -e $NIX_STATE_DIR/db/verify-contents-progress ]]
+rm $path2/bad
+chmod u-w $path2
 
 hash=$(nix-hash $path2)
 
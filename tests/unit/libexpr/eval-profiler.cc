@@ -0,0 +1,87 @@
+#include "lix/libexpr/eval-profiler.hh"
+#include "lix/libutil/file-system.hh"
+#include "lix/libutil/strings.hh"
+
+#include "tests/libexpr.hh"
+
+namespace nix {
+
+class EvalProfilerTest : public LibExprTest
+{
+protected:
+    /**
+     * Evaluate `expr` with a profiler recording `metric` and return the
+     * collapsed stacks it writes.
+     */
+    std::map<std::string, uint64_t> profile(std::string expr, EvalProfiler::Metric metric)
+    {
+        evaluator.profiler = std::make_unique<EvalProfiler>(evaluator.mem, metric);
+        eval(std::move(expr));
+
+        Path tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir);
+        evaluator.profiler->write(tmpDir + "/profile", evaluator.positions);
+
+        std::map<std::string, uint64_t> stacks;
+        for (auto & line : tokenizeString<Strings>(readFile(tmpDir + "/profile"), "\n")) {
+            auto space = line.rfind(' ');
+            EXPECT_NE(space, line.npos);
+            stacks[line.substr(0, space)] += string2Int<uint64_t>(line.substr(space + 1)).value();
+        }
+        return stacks;
+    }
+};
+
+TEST_F(EvalProfilerTest, parseMetric)
+{
+    ASSERT_EQ(EvalProfiler::parseMetric("time"), EvalProfiler::Metric::Time);
+    ASSERT_EQ(EvalProfiler::parseMetric("allocations"), EvalProfiler::Metric::Allocations);
+    ASSERT_THROW(EvalProfiler::parseMetric("bogus"), UsageError);
+}
+
+TEST_F(EvalProfilerTest, countsCallsPerStack)
+{
+    auto stacks = profile("let f = x: x + 1; g = x: f (f x); in g 1 + g 2", EvalProfiler::Metric::Calls);
+
+    uint64_t calls = 0;
+    size_t depth = 0;
+    for (auto & [stack, count] : stacks) {
+        ASSERT_TRUE(stack.starts_with("«string»:1:")) << stack;
+        calls += count;
+        depth = std::max(depth, tokenizeString<Strings>(stack, ";").size());
+    }
+    /* Two calls of g, each calling f twice. */
+    ASSERT_EQ(calls, 6);
+    ASSERT_EQ(depth, 3);
+}
+
+TEST_F(EvalProfilerTest, countsThunks)
+{
+    auto stacks = profile("let f = x: x.a + x.b; in f { a = 1 + 1; b = 2 + 2; }", EvalProfiler::Metric::Thunks);
+    stacks.erase("«toplevel»");
+
+    ASSERT_EQ(stacks.size(), 1);
+    ASSERT_GE(stacks.begin()->second, 2);
+}
+
+TEST_F(EvalProfilerTest, collapsesRecursion)
+{
+    auto stacks = profile("let f = n: if n == 0 then 0 else f (n - 1); in f 1000", EvalProfiler::Metric::Calls);
+    stacks.erase("«toplevel»");
+
+    /* The outer call, and the recursive call site charged with all of its
+       recursive calls. */
+    ASSERT_EQ(stacks.size(), 2);
+    ASSERT_EQ(stacks.begin()->second, 1);
+    ASSERT_EQ(std::next(stacks.begin())->second, 1000);
+}
+
+TEST_F(EvalProfilerTest, labelsCallsFromBuiltins)
+{
+    auto stacks = profile("builtins.filter (x: x > 1) [ 1 2 3 ]", EvalProfiler::Metric::Calls);
+
+    ASSERT_EQ(stacks["«string»:1:1"], 1);
+    ASSERT_EQ(stacks["«string»:1:1;«builtins.filter»"], 3);
+}
+
+}
@@ -0,0 +1,199 @@
+#include "lix/libexpr/linear-regex.hh"
+
+#include <functional>
+#include <gtest/gtest.h>
+#include <random>
+#include <regex>
+
+namespace nix {
+
+using Captures = LinearRegex::Captures;
+
+static Captures capturesOf(const std::cmatch & match, const char * begin)
+{
+    Captures res;
+    for (auto & sub : match) {
+        res.push_back(sub.matched ? sub.first - begin : -1);
+        res.push_back(sub.matched ? sub.second - begin : -1);
+    }
+    return res;
+}
+
+/* What builtins.match and builtins.split got from std::regex, which defines
+   the expected results. */
+static std::optional<Captures> stdMatch(const std::regex & re, std::string_view s)
+{
+    std::cmatch match;
+    if (!std::regex_match(s.data(), s.data() + s.size(), match, re))
+        return std::nullopt;
+    return capturesOf(match, s.data());
+}
+
+static std::vector<Captures> stdMatchAll(const std::regex & re, std::string_view s)
+{
+    std::vector<Captures> res;
+    for (auto i = std::cregex_iterator(s.data(), s.data() + s.size(), re); i != std::cregex_iterator(); ++i)
+        res.push_back(capturesOf(*i, s.data()));
+    return res;
+}
+
+static void checkAgainstStd(const std::string & pattern, const std::vector<std::string> & subjects)
+{
+    std::regex re(pattern, std::regex::extended);
+    auto linear = LinearRegex::compile(pattern);
+    ASSERT_TRUE(linear) << pattern;
+    ASSERT_EQ(linear->subexpressions(), re.mark_count()) << pattern;
+    for (auto & s : subjects) {
+        ASSERT_EQ(linear->match(s), stdMatch(re, s)) << pattern << " on " << s;
+        ASSERT_EQ(linear->matchAll(s), stdMatchAll(re, s)) << pattern << " on " << s;
+    }
+}
+
+class LinearRegexTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        if (!LinearRegex::compile("a"))
+            GTEST_SKIP() << "LinearRegex is only used with libstdc++";
+    }
+};
+
+TEST_F(LinearRegexTest, commonExpressions)
+{
+    const std::vector<std::string> subjects{
+        "",
+        "foo",
+        "foo-1.2.3",
+        "python3.11-requests-2.31.0",
+        "/nix/store/abc-foo/bin/foo",
+        "a b  c\td",
+        "x86_64-linux",
+        "1.2.3-rc1",
+        "foo.tar.gz",
+    };
+    for (auto re : {
+             "([^/]*)/(.*)",
+             "(.*)-([0-9].*)",
+             "[a-zA-Z_][a-zA-Z0-9_'-]*",
+             "([0-9]+)(\\.([0-9]+))?(\\.([0-9]+))?.*",
+             "(\\.|-|_)",
+             "[[:space:]]+",
+             "(.*)\\.(.*)",
+             "^(.*)$",
+             "(x86_64|i686|aarch64)-(linux|darwin)",
+             "([^-]*)-?(.*)",
+             "[0-9]{1,3}(\\.[0-9]{1,3}){2,}",
+         })
+        checkAgainstStd(re, subjects);
+}
+
+/* Places where libstdc++ differs from POSIX, which must be kept. */
+TEST_F(LinearRegexTest, libstdcxxQuirks)
+{
+    // A greedy repetition that led to a match is not left to find a longer one.
+    auto re = LinearRegex::compile("a*(aabc|b)");
+    ASSERT_EQ(re->matchAll("aabc"), (std::vector<Captures>{{0, 3, 2, 3}}));
+
+    // Captures follow the first path in backtracking order.
+    checkAgainstStd("(a|ab)(c|bcd)(d*)", {"abcd"});
+    checkAgainstStd("(a|b)*", {"ab", "ba"});
+
+    // `.` does not match NUL.
+    checkAgainstStd(".", {std::string(1, '\0')});
+
+    // Empty matches, and `^` after an empty match at the start.
+    checkAgainstStd("b*", {"abab", ""});
+    checkAgainstStd("^|a", {"aa"});
+    checkAgainstStd("x*|^a", {"ab", "ba"});
+}
+
+TEST_F(LinearRegexTest, unsupported)
+{
+    // Loops over subexpressions that can match the empty string.
+    ASSERT_FALSE(LinearRegex::compile("(a*)*"));
+    ASSERT_FALSE(LinearRegex::compile("(a|)+"));
+    ASSERT_FALSE(LinearRegex::compile("(^a|b?)*"));
+    ASSERT_TRUE(LinearRegex::compile("(a*b)*"));
+}
+
+TEST_F(LinearRegexTest, longSubjects)
+{
+    std::string s(1 << 20, 'a');
+    auto re = LinearRegex::compile("(a|aa)*(.*)");
+    auto size = std::ptrdiff_t(s.size());
+    ASSERT_EQ(re->match(s), (Captures{0, size, size - 1, size, size, size}));
+    ASSERT_EQ(re->matchAll(s), (std::vector<Captures>{{0, size, size - 1, size, size, size}, {size, size, -1, -1, size, size}}));
+}
+
+TEST_F(LinearRegexTest, matchesStdRegex)
+{
+    std::mt19937 random(42);
+    auto pick = [&](std::string_view choices) { return choices[random() % choices.size()]; };
+
+    std::function<std::string(int)> expression = [&](int depth) {
+        std::string res;
+        for (auto branch = random() % 3 ? 1 : 2; branch > 0; branch--) {
+            for (auto terms = random() % 4; terms > 0; terms--) {
+                switch (random() % 12) {
+                case 0:
+                    res += '^';
+                    continue;
+                case 1:
+                    res += '$';
+                    continue;
+                case 2:
+                    res += ".";
+                    break;
+                case 3:
+                    res += random() % 2 ? "[^a]" : "[a-b]";
+                    break;
+                case 4:
+                    res += depth < 3 ? "(" + expression(depth + 1) + ")" : "\\.";
+                    break;
+                default:
+                    res += pick("abc");
+                }
+                switch (random() % 8) {
+                case 0:
+                    res += '*';
+                    break;
+                case 1:
+                    res += '+';
+                    break;
+                case 2:
+                    res += '?';
+                    break;
+                case 3:
+                    res += "{1,2}";
+                    break;
+                }
+            }
+            if (branch > 1)
+                res += '|';
+        }
+        return res;
+    };
+
+    for (int iteration = 0; iteration < 2000; iteration++) {
+        auto pattern = expression(0);
+        std::regex re;
+        try {
+            re = std::regex(pattern, std::regex::extended);
+        } catch (std::regex_error &) {
+            continue;
+        }
+        auto linear = LinearRegex::compile(pattern);
+        if (!linear)
+            continue;
+        for (int i = 0; i < 10; i++) {
+            std::string s(random() % 10, 0);
+            for (auto & c : s)
+                c = pick("abc.");
+            ASSERT_EQ(linear->match(s), stdMatch(re, s)) << pattern << " on " << s;
+            ASSERT_EQ(linear->matchAll(s), stdMatchAll(re, s)) << pattern << " on " << s;
+        }
+    }
+}
+
+}
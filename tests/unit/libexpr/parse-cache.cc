@@ -0,0 +1,144 @@
+#include "lix/libexpr/parse-cache.hh"
+#include "lix/libexpr/eval-settings.hh"
+#include "lix/libutil/file-system.hh"
+
+#include "tests/libexpr.hh"
+
+#include <cstdlib>
+#include <thread>
+
+namespace nix {
+
+using namespace std::chrono_literals;
+
+class ParseCacheTest : public LibExprTest
+{
+protected:
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir{tmpDir};
+    Path cacheDir = tmpDir + "/cache/nix/parse-cache";
+
+    void SetUp() override
+    {
+        setenv("XDG_CACHE_HOME", (tmpDir + "/cache").c_str(), 1);
+        evalSettings.evalParseCache.override(true);
+    }
+
+    void TearDown() override
+    {
+        unsetenv("XDG_CACHE_HOME");
+        evalSettings.evalParseCache.override(false);
+    }
+
+    CheckedSourcePath writeSource(const std::string & name, const std::string & text)
+    {
+        writeFile(tmpDir + "/" + name, text);
+        return SourcePath(CanonPath(tmpDir + "/" + name)).unsafeIntoChecked();
+    }
+
+    Path entryFor(const CheckedSourcePath & path)
+    {
+        auto key = ParseCache::key(path.readFile(), path.parent(), featureSettings);
+        return cacheDir + "/" + key.to_string(Base::Base32, false);
+    }
+
+    /**
+     * Parses and evaluates `path`, returning the AST as JSON and the result.
+     */
+    std::pair<std::string, std::string> evalFile(const CheckedSourcePath & path)
+    {
+        Expr & e = evaluator.parseExprFromFile(path);
+        Value v;
+        state.eval(e, v);
+        state.forceValue(v, noPos);
+        return {e.toJSON(evaluator.symbols).dump(), std::string(v.string.s)};
+    }
+};
+
+TEST_F(ParseCacheTest, roundTrip)
+{
+    auto path = writeSource("default.nix", R"(
+        let
+          inherit (builtins) map toJSON;
+          f = { a, b ? 2, ... }@args: a + b + args.a;
+          g = x: y: x * y;
+          set = rec { x = 1; y = x + 1; ${"dyn"} = 3; nested.a = 1; nested.b = 2; };
+        in
+        assert !false;
+        with set;
+        toJSON [
+          (f { a = 1; })
+          (g 2 3)
+          (if x == 1 && y != 1 || false -> true then "yes" else "no")
+          (set ? nested.a)
+          (set.missing or 4)
+          (set // { z = 5; }).z
+          ([ 1 ] ++ [ 2.5 ])
+          "interpolated ${toString dyn} \${x}"
+          ''
+            indented ${toString y}
+          ''
+          (map (v: v + 1) [ 1 2 ])
+          (let inherit (set) nested; in nested.b)
+          __curPos.line
+          __curPos.column
+        ]
+    )");
+
+    auto parsed = evalFile(path);
+    ASSERT_TRUE(pathExists(entryFor(path)));
+
+    auto cached = evalFile(path);
+    ASSERT_EQ(cached.first, parsed.first);
+    ASSERT_EQ(cached.second, parsed.second);
+}
+
+TEST_F(ParseCacheTest, usesEntries)
+{
+    auto first = writeSource("first.nix", R"("first")");
+    auto second = writeSource("second.nix", R"("other")");
+    evalFile(first);
+    evalFile(second);
+
+    // Prove that the entry is used by pointing the first file at the AST of
+    // the second.
+    writeFile(entryFor(first), readFile(entryFor(second)));
+    ASSERT_EQ(evalFile(first).second, "other");
+
+    // Bad entries are ignored.
+    writeFile(entryFor(first), "garbage");
+    ASSERT_EQ(evalFile(first).second, "first");
+}
+
+TEST_F(ParseCacheTest, prunesLeastRecentlyUsed)
+{
+    ParseCache cache{cacheDir, 250};
+    std::vector<Hash> keys;
+    for (auto i = 0; i < 3; i++) {
+        keys.push_back(hashString(HashType::SHA256, std::to_string(i)));
+        cache.insert(keys.back(), std::string(100, 'a' + i));
+        // Entries are ordered by their modification time.
+        std::this_thread::sleep_for(20ms);
+    }
+    ASSERT_EQ(readDirectory(cacheDir).size(), 2u);
+    ASSERT_FALSE(cache.lookup(keys[0]));
+
+    // Looking an entry up keeps it.
+    auto entry = cache.lookup(keys[1]);
+    ASSERT_TRUE(entry);
+    ASSERT_EQ(entry->view(), std::string(100, 'b'));
+    std::this_thread::sleep_for(20ms);
+    cache.insert(keys[0], std::string(100, 'a'));
+    cache.prune();
+    ASSERT_TRUE(cache.lookup(keys[0]));
+    ASSERT_TRUE(cache.lookup(keys[1]));
+    ASSERT_FALSE(cache.lookup(keys[2]));
+}
+
+TEST_F(ParseCacheTest, onlyFiles)
+{
+    eval("1 + 1");
+    ASSERT_FALSE(pathExists(cacheDir));
+}
+
+}
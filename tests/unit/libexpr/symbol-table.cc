@@ -0,0 +1,43 @@
+#include "lix/libexpr/symbol-table.hh"
+
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+namespace nix {
+    TEST(SymbolTable, CreateIsIdempotent) {
+        SymbolTable symbols;
+        auto a = symbols.create("a");
+        auto b = symbols.create("b");
+        ASSERT_NE(a, b);
+        ASSERT_EQ(a, symbols.create("a"));
+        ASSERT_EQ(symbols[b], "b");
+        ASSERT_EQ(symbols.size(), 2);
+    }
+
+    TEST(SymbolTable, ConcurrentCreate) {
+        constexpr int threads = 8;
+        constexpr int names = 5000;
+
+        SymbolTable symbols;
+        std::vector<std::vector<Symbol>> created(threads);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t] {
+                for (int i = 0; i < names; i++) {
+                    auto sym = symbols.create(std::to_string(i));
+                    ASSERT_EQ(symbols[sym], std::to_string(i));
+                    created[t].push_back(sym);
+                }
+            });
+        }
+        for (auto & w : workers) {
+            w.join();
+        }
+
+        ASSERT_EQ(symbols.size(), names);
+        for (auto & perWorker : created) {
+            ASSERT_EQ(perWorker, created[0]);
+        }
+    }
+}
@@ -76,6 +76,96 @@ namespace nix {
         ASSERT_THAT(*b->value, IsIntEq(2));
     }
 
+    TEST_F(TrivialExpressionTest, selectFromIndexedAttrs) {
+        // large enough and looked up often enough to get a hash index
+        auto v = eval(R"(
+            let
+              names = builtins.genList (n: "a${toString n}") 1000;
+              set = builtins.listToAttrs (map (name: { inherit name; value = name; }) names);
+            in builtins.all (name: set.${name} == name && !(set ? "b${name}")) names
+        )");
+        ASSERT_THAT(v, IsTrue());
+    }
+
+    TEST_F(TrivialExpressionTest, updateLargeAttrsWithSmall) {
+        auto v = eval(R"(
+            let
+              names = builtins.genList (n: "a${toString n}") 100;
+              set = builtins.listToAttrs (map (name: { inherit name; value = 1; }) names);
+            in set // { a0 = 2; a50 = 2; b = 2; }
+        )");
+        ASSERT_THAT(v, IsAttrsOfSize(101));
+        for (auto name : {"a0", "a50", "b"}) {
+            auto a = v.attrs->find(createSymbol(name));
+            ASSERT_NE(a, v.attrs->end());
+            state.forceValue(*a->value, noPos);
+            ASSERT_THAT(*a->value, IsIntEq(2));
+        }
+        auto a1 = v.attrs->find(createSymbol("a1"));
+        ASSERT_NE(a1, v.attrs->end());
+        state.forceValue(*a1->value, noPos);
+        ASSERT_THAT(*a1->value, IsIntEq(1));
+    }
+
+    TEST_F(TrivialExpressionTest, updateOverlays) {
+        auto v = eval(R"(
+            let
+              names = builtins.genList (n: "a${toString n}") 100;
+              set = builtins.listToAttrs (map (name: { inherit name; value = 1; }) names);
+              update = acc: n: acc // { "a${toString (n * 7)}" = n; "b${toString n}" = n; };
+            in builtins.foldl' update set (builtins.genList (n: n) 20)
+        )");
+        // a0 to a98 are shadowed, a105 to a133 are new.
+        ASSERT_THAT(v, IsAttrsOfSize(125));
+
+        auto flattened = Bindings::nrFlattenedAttrs;
+        std::vector<std::pair<const char *, int>> expected{
+            {"a0", 0}, {"a1", 1}, {"a98", 14}, {"a133", 19}, {"b19", 19}
+        };
+        for (auto [name, value] : expected) {
+            auto a = v.attrs->get(createSymbol(name));
+            ASSERT_NE(a, nullptr);
+            state.forceValue(*a->value, noPos);
+            ASSERT_THAT(*a->value, IsIntEq(value));
+        }
+        ASSERT_EQ(v.attrs->get(createSymbol("a2000")), nullptr);
+        ASSERT_EQ(Bindings::nrFlattenedAttrs, flattened);
+
+        ASSERT_EQ(v.attrs->end() - v.attrs->begin(), 125);
+        ASSERT_TRUE(std::is_sorted(v.attrs->begin(), v.attrs->end()));
+        ASSERT_EQ(Bindings::nrFlattenedAttrs, flattened + 125);
+        auto a14 = v.attrs->find(createSymbol("a14"));
+        ASSERT_NE(a14, v.attrs->end());
+        state.forceValue(*a14->value, noPos);
+        ASSERT_THAT(*a14->value, IsIntEq(2));
+    }
+
+    TEST_F(TrivialExpressionTest, updateOverlaysCompareEqual) {
+        auto v = eval(R"(
+            let
+              set = builtins.listToAttrs (builtins.genList (n: { name = "a${toString n}"; value = n; }) 50);
+              o = set // { a3 = 0; z = 1; };
+            in
+              o == set // { a3 = 0; } // { z = 1; }
+              && builtins.attrNames o == builtins.attrNames (builtins.mapAttrs (_: v: v) o)
+              && builtins.length (builtins.attrValues o) == 51
+              && o ? z && !(o ? y) && o.a3 == 0 && o.a4 == 4
+        )");
+        ASSERT_THAT(v, IsTrue());
+    }
+
+    TEST_F(TrivialExpressionTest, sizedStrings) {
+        auto v = eval(R"(
+            let s = "ab" + "c" + ""; in
+            builtins.stringLength s == 3
+            && s == "abc"
+            && s != "abcd"
+            && builtins.substring 1 5 s == "bc"
+            && builtins.stringLength (builtins.substring 0 0 s) == 0
+        )");
+        ASSERT_THAT(v, IsTrue());
+    }
+
     TEST_F(TrivialExpressionTest, hasAttrOpFalse) {
         auto v = eval("{} ? a");
         ASSERT_THAT(v, IsFalse());
@@ -461,4 +461,37 @@ TEST(FileTransfer, setupErrorsAreMetadata)
     ASSERT_THROW(ft->upload(fmt("http://[::1]:%d", port), ""), FileTransferError);
 }
 
+TEST(FileTransfer, reservesConnectionsForMetadata)
+{
+    // with two connections only one may be used by bulk transfers
+    auto connections = fileTransferSettings.httpConnections.get();
+    fileTransferSettings.httpConnections.override(2);
+    KJ_DEFER(fileTransferSettings.httpConnections.override(connections));
+
+    auto [port, srv] = serveHTTP({
+        {"200 ok",
+         "content-length: 100000000\r\n",
+         [](int round) mutable {
+             return round < 100 ? std::optional(std::string(1'000'000, ' ')) : std::nullopt;
+         }},
+    });
+    auto ft = makeFileTransfer(0);
+    auto uri = fmt("http://[::1]:%d", port);
+
+    // the first bulk transfer stalls with its reader, the second has to wait
+    auto [_result1, data1] = ft->download(uri);
+    auto second = std::async(std::launch::async, [&] { return ft->download(uri).second->drain(); });
+
+    // metadata still gets a connection
+    auto [_result3, data3] = ft->download(uri, {}, FileTransfer::Priority::Metadata);
+    ASSERT_EQ(data3->drain().size(), 100'000'000u);
+
+    ASSERT_EQ(data1->drain().size(), 100'000'000u);
+    ASSERT_EQ(second.get().size(), 100'000'000u);
+
+    auto stats = ft->getStats();
+    ASSERT_EQ(stats.metadataTransfers, 1u);
+    ASSERT_EQ(stats.bulkTransfers, 2u);
+}
+
 }
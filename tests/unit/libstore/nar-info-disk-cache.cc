@@ -4,6 +4,7 @@
 #include <rapidcheck/gtest.h>
 #include "lix/libstore/sqlite.hh"
 #include "lix/libstore/temporary-dir.hh"
+#include "lix/libutil/file-system.hh"
 #include "lix/libutil/types.hh"
 #include <sqlite3.h>
 
@@ -122,4 +123,66 @@ TEST(NarInfoDiskCacheImpl, create_and_read) {
     }
 }
 
+TEST(NarInfoDiskCacheImpl, index) {
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    Path dbPath(tmpDir + "/test-narinfo-disk-cache.sqlite");
+
+    StorePath path("g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-foo");
+    StorePath absent("g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3r-bar");
+
+    {
+        auto cache = getTestNarInfoDiskCache(dbPath);
+        cache->createCache("http://foo", "/nix/store", true, 10);
+
+        auto info = std::make_shared<NarInfo>(StorePath(path), Hash::dummy);
+        info->url = "nar/foo.nar.xz";
+        info->compression = "xz";
+        info->narSize = 1234;
+        info->fileSize = 30;
+        info->compressedFrames = {10, 20};
+        info->references.insert(absent);
+        info->sigs.insert("cache-1:sig");
+        cache->upsertNarInfo("http://foo", std::string(path.hashPart()), info);
+        cache->upsertNarInfo("http://foo", std::string(absent.hashPart()), nullptr);
+    }
+
+    // The index is only rewritten once it is old or missing.
+    deletePath(dbPath + "-index");
+    auto cache = getTestNarInfoDiskCache(dbPath);
+    cache->createCache("http://foo", "/nix/store", true, 10);
+
+    // Lookups of indexed paths do not need the database.
+    SQLite db(dbPath);
+    db.exec("delete from NARs", always_progresses);
+
+    {
+        auto [outcome, info] = cache->lookupNarInfo("http://foo", std::string(path.hashPart()));
+        ASSERT_EQ(outcome, NarInfoDiskCache::oValid);
+        ASSERT_EQ(info->path, path);
+        ASSERT_EQ(info->narHash, Hash::dummy);
+        ASSERT_EQ(info->url, "nar/foo.nar.xz");
+        ASSERT_EQ(info->compression, "xz");
+        ASSERT_EQ(info->narSize, 1234);
+        ASSERT_EQ(info->fileSize, 30);
+        ASSERT_EQ(info->compressedFrames, (std::vector<uint64_t>{10, 20}));
+        ASSERT_EQ(info->references, StorePathSet{absent});
+        ASSERT_EQ(info->sigs, StringSet{"cache-1:sig"});
+        ASSERT_FALSE(info->deriver);
+    }
+
+    // Negative entries are never indexed.
+    ASSERT_EQ(
+        cache->lookupNarInfo("http://foo", std::string(absent.hashPart())).first,
+        NarInfoDiskCache::oUnknown
+    );
+
+    // Entries written by this process take precedence over the index.
+    cache->upsertNarInfo("http://foo", std::string(path.hashPart()), nullptr);
+    ASSERT_EQ(
+        cache->lookupNarInfo("http://foo", std::string(path.hashPart())).first,
+        NarInfoDiskCache::oInvalid
+    );
+}
+
 }
@@ -1,4 +1,7 @@
 #include "lix/libutil/references.hh"
+#include "lix/libutil/file-system.hh"
+#include "lix/libstore/path-references.hh"
+#include "lix/libstore/temporary-dir.hh"
 
 #include <gtest/gtest.h>
 
@@ -42,4 +45,39 @@ TEST(references, scan)
     }
 }
 
+TEST(references, scanSeparately)
+{
+    std::string hash1 = "dc04vv14dak1c1r48qa0m23vr9jy8sm0";
+
+    RefScanSink scanner(StringSet{hash1});
+    scanner.scanSeparately(hash1.substr(0, 10));
+    scanner.scanSeparately(hash1.substr(10));
+    ASSERT_EQ(scanner.getResult(), StringSet{});
+
+    auto fork = scanner.fork();
+    fork.scanSeparately("foo" + hash1);
+    ASSERT_EQ(fork.getResult(), StringSet{hash1});
+    ASSERT_EQ(scanner.getResult(), StringSet{});
+}
+
+TEST(references, scanParallel)
+{
+    StorePath path1{"dc04vv14dak1c1r48qa0m23vr9jy8sm0-foo"};
+    StorePath path2{"zc842j0rz61mjsp3h3wp5ly71ak6qgdn-bar"};
+    StorePath path3{"c015dhfh5l0lp6wxyvdn7bmwhbbr6hr9-baz"};
+
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    createDirs(tmpDir + "/out/sub");
+    writeFile(tmpDir + "/out/sub/file", "prefix" + std::string(path1.hashPart()) + "suffix");
+    createSymlink("/nix/store/" + std::string(path2.to_string()), tmpDir + "/out/link");
+    // names are scanned on their own, so this one must not be joined with the file contents
+    writeFile(tmpDir + "/out/" + std::string(path3.hashPart()).substr(0, 16), std::string(path3.hashPart()).substr(16));
+
+    ASSERT_EQ(
+        scanForReferencesParallel(tmpDir + "/out", {path1, path2, path3}),
+        StorePathSet({path1, path2})
+    );
+}
+
 }
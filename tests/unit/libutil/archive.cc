@@ -1,8 +1,11 @@
 #include "lix/libutil/archive.hh"
 #include "lix/libutil/async-io.hh"
 #include "lix/libutil/box_ptr.hh"
+#include "lix/libutil/file-descriptor.hh"
+#include "lix/libutil/file-system.hh"
 #include "lix/libutil/serialise.hh"
 #include <algorithm>
+#include <fcntl.h>
 #include <gtest/gtest.h>
 #include <kj/async.h>
 #include <limits>
@@ -509,4 +512,43 @@ INSTANTIATE_TEST_SUITE_P(
             concat({header, make_directory({{"DE", make_file(false, "meow")}, {"de", make_file(false, "mrrp")}})})
         ))
 );
+
+TEST(nar, dumpLargeFile)
+{
+    // large enough to be read ahead in several chunks, and not a multiple of
+    // the chunk size so the last chunk is only partially filled
+    std::string contents;
+    for (size_t i = 0; contents.size() < 9 * 1024 * 1024 + 17; i++) {
+        contents += std::to_string(i);
+    }
+
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    writeFile(tmpDir + "/file", contents);
+
+    ASSERT_EQ(
+        GeneratorSource(dumpPath(tmpDir + "/file")).drain(),
+        GeneratorSource(dumpString(contents)).drain()
+    );
+}
+
+TEST(nar, dumpToFd)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    createDirs(tmpDir + "/tree/sub");
+    writeFile(tmpDir + "/tree/empty", "");
+    writeFile(tmpDir + "/tree/sub/file", std::string(100000, 'x'));
+    createSymlink("sub/file", tmpDir + "/tree/link");
+
+    {
+        AutoCloseFD fd{open((tmpDir + "/nar").c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600)};
+        ASSERT_TRUE(fd);
+        FdSink sink(fd.get());
+        dumpPath(tmpDir + "/tree", sink);
+        sink.flush();
+    }
+
+    ASSERT_EQ(readFile(tmpDir + "/nar"), GeneratorSource(dumpPath(tmpDir + "/tree")).drain());
+}
 }
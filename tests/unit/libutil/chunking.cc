@@ -0,0 +1,81 @@
+#include "lix/libutil/chunking.hh"
+#include "lix/libutil/error.hh"
+
+#include <gtest/gtest.h>
+#include <random>
+#include <set>
+
+namespace nix {
+
+static std::vector<std::string> chunk(std::string_view data, size_t writeSize)
+{
+    std::vector<std::string> chunks;
+    ChunkingSink sink(4096, [&](std::string_view c) { chunks.emplace_back(c); });
+    while (!data.empty()) {
+        auto n = std::min(writeSize, data.size());
+        sink(data.substr(0, n));
+        data.remove_prefix(n);
+    }
+    sink.finish();
+    return chunks;
+}
+
+static std::string randomData(size_t size)
+{
+    std::mt19937_64 random(42);
+    std::string data(size, 0);
+    for (auto & c : data) {
+        c = static_cast<char>(random());
+    }
+    return data;
+}
+
+TEST(ChunkingSink, rejectsBadSizes)
+{
+    ASSERT_THROW(ChunkingSink(1000, [](auto) {}), Error);
+    ASSERT_THROW(ChunkingSink(32, [](auto) {}), Error);
+}
+
+TEST(ChunkingSink, chunksCoverInputWithinBounds)
+{
+    auto data = randomData(1 << 20);
+    auto chunks = chunk(data, 65536);
+
+    std::string joined;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (i + 1 < chunks.size()) {
+            ASSERT_GE(chunks[i].size(), 2048);
+        }
+        ASSERT_LE(chunks[i].size(), 4 * 4096);
+        joined += chunks[i];
+    }
+    ASSERT_EQ(joined, data);
+}
+
+TEST(ChunkingSink, independentOfWriteSize)
+{
+    auto data = randomData(1 << 18);
+    ASSERT_EQ(chunk(data, 1), chunk(data, 1 << 18));
+    ASSERT_EQ(chunk(data, 777), chunk(data, 4096));
+}
+
+TEST(ChunkingSink, insertionOnlyChangesNearbyChunks)
+{
+    auto data = randomData(1 << 20);
+    auto before = chunk(data, 65536);
+    auto after = chunk(data.substr(0, 1000) + "inserted" + data.substr(1000), 65536);
+
+    std::set<std::string> known(before.begin(), before.end());
+    size_t changed = 0;
+    for (auto & c : after) {
+        changed += !known.contains(c);
+    }
+    ASSERT_LE(changed, 2);
+}
+
+TEST(ChunkingSink, emptyInput)
+{
+    ASSERT_EQ(chunk("", 1), std::vector<std::string>{});
+}
+
+}
@@ -161,4 +161,135 @@ TEST_P(PerTypeNonNullCompressionTest, truncatedValidInput)
     }
 }
 
+/* ---------------------------------------
+ * Framed compression
+ * --------------------------------------- */
+
+class FramedCompressionTest : public testing::TestWithParam<const char *>
+{};
+
+INSTANTIATE_TEST_SUITE_P(compressionFramed, FramedCompressionTest, testing::Values("xz", "zstd"));
+
+static std::string compressFramed(const std::string & method, std::string_view in, std::vector<uint64_t> & frames)
+{
+    StringSink strSink;
+    auto sink = makeFramedCompressionSink(method, strSink, 1000, frames);
+    (*sink)(in);
+    sink->finish();
+    return std::move(strSink.s);
+}
+
+TEST_P(FramedCompressionTest, readableAsSingleStream)
+{
+    auto method = GetParam();
+    std::string str;
+    for (int i = 0; i < 2000; i++) {
+        str += std::to_string(i);
+    }
+
+    std::vector<uint64_t> frames;
+    auto compressed = compressFramed(method, str, frames);
+
+    ASSERT_EQ(frames.size(), (str.size() + 999) / 1000);
+    ASSERT_EQ(decompress(method, compressed), str);
+}
+
+TEST_P(FramedCompressionTest, decompressFrames)
+{
+    auto method = GetParam();
+    std::string str;
+    for (int i = 0; i < 2000; i++) {
+        str += std::to_string(i);
+    }
+
+    std::vector<uint64_t> frames;
+    auto compressed = compressFramed(method, str, frames);
+    StringSource source{compressed};
+
+    ASSERT_EQ(
+        GeneratorSource(decompressFrames(method, source, frames, compressed.size(), str.size())).drain(), str
+    );
+}
+
+TEST_P(FramedCompressionTest, rejectsBadFrameSizes)
+{
+    auto method = GetParam();
+    std::string str;
+    for (int i = 0; i < 2000; i++) {
+        str += std::to_string(i);
+    }
+
+    std::vector<uint64_t> frames;
+    auto compressed = compressFramed(method, str, frames);
+
+    auto drain = [&](std::vector<uint64_t> frames, uint64_t totalSize) {
+        StringSource source{compressed};
+        return GeneratorSource(decompressFrames(method, source, std::move(frames), totalSize, str.size()))
+            .drain();
+    };
+
+    ASSERT_THROW(drain(frames, compressed.size() - 1), CompressionError);
+    ASSERT_THROW(drain(frames, compressed.size() + 1), CompressionError);
+    ASSERT_THROW(drain({maxCompressedFrameSize + 1}, maxCompressedFrameSize + 1), CompressionError);
+    ASSERT_THROW(drain({0, compressed.size()}, compressed.size()), CompressionError);
+}
+
+TEST_P(FramedCompressionTest, limitsOutput)
+{
+    auto method = GetParam();
+    std::string str;
+    for (int i = 0; i < 2000; i++) {
+        str += std::to_string(i);
+    }
+
+    std::vector<uint64_t> frames;
+    auto compressed = compressFramed(method, str, frames);
+    StringSource source{compressed};
+
+    ASSERT_THROW(
+        GeneratorSource(decompressFrames(method, source, frames, compressed.size(), str.size() - 1)).drain(),
+        CompressionError
+    );
+}
+
+TEST_P(FramedCompressionTest, emptyInput)
+{
+    auto method = GetParam();
+
+    std::vector<uint64_t> frames;
+    auto compressed = compressFramed(method, "", frames);
+
+    ASSERT_EQ(frames.size(), 1);
+    ASSERT_EQ(decompress(method, compressed), "");
+}
+
+TEST(makeFramedCompressionSink, rejectsUnsupportedMethods)
+{
+    StringSink strSink;
+    std::vector<uint64_t> frames;
+    ASSERT_THROW(makeFramedCompressionSink("bzip2", strSink, 1000, frames), UnknownCompressionMethod);
+}
+
+TEST(makeFramedCompressionSink, rejectsOversizedFrames)
+{
+    StringSink strSink;
+    std::vector<uint64_t> frames;
+    ASSERT_THROW(makeFramedCompressionSink("zstd", strSink, maxCompressionFrameSize + 1, frames), Error);
+}
+
+TEST(decompressFrames, limitsFrameOutput)
+{
+    // a single frame of zeroes compresses to almost nothing, but expands to
+    // more than a framed compression sink would ever put into one.
+    auto compressed = compress("zstd", std::string(maxCompressionFrameSize + 1, '\0'));
+    StringSource source{compressed};
+
+    ASSERT_THROW(
+        GeneratorSource(decompressFrames(
+            "zstd", source, {compressed.size()}, compressed.size(), maxCompressionFrameSize * 2
+        )).drain(),
+        CompressionError
+    );
+}
+
 }
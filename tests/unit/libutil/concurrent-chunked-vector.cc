@@ -0,0 +1,62 @@
+#include "lix/libutil/concurrent-chunked-vector.hh"
+
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+namespace nix {
+    TEST(ConcurrentChunkedVector, InitEmpty) {
+        ConcurrentChunkedVector<int, 2> v;
+        ASSERT_EQ(v.size(), 0);
+    }
+
+    TEST(ConcurrentChunkedVector, AddAndGet) {
+        ConcurrentChunkedVector<int, 2> v;
+        for (auto i = 1; i < 100; i++) {
+            auto [i2, idx] = v.add(i);
+            auto & i3 = v[idx];
+            ASSERT_EQ(v.size(), i);
+            ASSERT_EQ(i, i2);
+            ASSERT_EQ(&i2, &i3);
+        }
+    }
+
+    TEST(ConcurrentChunkedVector, ForEach) {
+        ConcurrentChunkedVector<int, 4> v;
+        for (auto i = 0; i < 100; i++) {
+            v.add(i);
+        }
+        int expected = 0;
+        v.forEach([&](int elt) {
+            ASSERT_EQ(elt, expected++);
+        });
+        ASSERT_EQ(expected, v.size());
+    }
+
+    TEST(ConcurrentChunkedVector, ConcurrentAdd) {
+        constexpr int threads = 8;
+        constexpr int perThread = 10000;
+
+        ConcurrentChunkedVector<int, 16> v;
+        std::vector<std::vector<std::pair<int, uint32_t>>> added(threads);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t] {
+                for (int i = 0; i < perThread; i++) {
+                    auto value = t * perThread + i;
+                    added[t].emplace_back(value, v.add(value).second);
+                }
+            });
+        }
+        for (auto & w : workers) {
+            w.join();
+        }
+
+        ASSERT_EQ(v.size(), threads * perThread);
+        for (auto & perWorker : added) {
+            for (auto [value, idx] : perWorker) {
+                ASSERT_EQ(v[idx], value);
+            }
+        }
+    }
+}
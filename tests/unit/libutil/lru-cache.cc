@@ -127,4 +127,55 @@ namespace nix {
         ASSERT_EQ(c.size(), 0);
         ASSERT_EQ(c.get("one").value_or("empty"), "empty");
     }
+
+    /* ----------------------------------------------------------------------------
+     * ShardedLRUCache
+     * --------------------------------------------------------------------------*/
+
+    TEST(ShardedLRUCache, upsertGetErase) {
+        ShardedLRUCache<std::string, std::string> c(100);
+        c.upsert("one", "eins");
+        c.upsert("two", "zwei");
+        ASSERT_EQ(c.size(), 2);
+        ASSERT_EQ(c.get("one").value_or("error"), "eins");
+        ASSERT_EQ(c.erase("one"), true);
+        ASSERT_EQ(c.erase("one"), false);
+        ASSERT_EQ(c.get("one").has_value(), false);
+        ASSERT_EQ(c.size(), 1);
+        c.clear();
+        ASSERT_EQ(c.size(), 0);
+    }
+
+    TEST(ShardedLRUCache, countsHitsAndMisses) {
+        ShardedLRUCache<std::string, std::string> c(100);
+        c.upsert("one", "eins");
+        c.get("one");
+        c.get("one");
+        c.get("two");
+        auto stats = c.getStats();
+        ASSERT_EQ(stats.size, 1);
+        ASSERT_EQ(stats.hits, 2);
+        ASSERT_EQ(stats.misses, 1);
+        ASSERT_EQ(stats.evictions, 0);
+    }
+
+    TEST(ShardedLRUCache, evictsWithinShard) {
+        // a single shard so that the eviction order is predictable
+        ShardedLRUCache<int, int, 1> c(2);
+        c.upsert(1, 1);
+        c.upsert(2, 2);
+        c.get(1);
+        ASSERT_EQ(c.upsert(3, 3), true);
+        ASSERT_EQ(c.get(2).has_value(), false);
+        ASSERT_EQ(c.get(1).value_or(0), 1);
+        ASSERT_EQ(c.getStats().evictions, 1);
+    }
+
+    TEST(ShardedLRUCache, capacityIsSplitAmongShards) {
+        ShardedLRUCache<int, int, 4> c(8);
+        for (int i = 0; i < 1000; i++)
+            c.upsert(i, i);
+        ASSERT_LE(c.size(), 8);
+        ASSERT_EQ(c.getStats().evictions, 1000 - c.size());
+    }
 }
@@ -0,0 +1,64 @@
+#include "lix/libutil/read-ahead.hh"
+#include "lix/libutil/serialise.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+TEST(ReadAhead, readsEverythingInOrder)
+{
+    std::string data;
+    for (int i = 0; i < 100000; i++) {
+        data += std::to_string(i);
+    }
+
+    StringSource source{data};
+    // small chunks, so that the producer has to wait for the consumer often
+    auto g = readAhead(source, 1000, 2);
+
+    std::string result;
+    while (auto piece = g.next()) {
+        ASSERT_LE(piece->size(), 1000);
+        result.append(piece->data(), piece->size());
+    }
+    ASSERT_EQ(result, data);
+}
+
+TEST(ReadAhead, rethrowsAfterData)
+{
+    int calls = 0;
+    ReadAhead ahead(
+        [&](std::span<char> buf) -> size_t {
+            if (calls++ > 0) {
+                throw Error("producer failed");
+            }
+            buf[0] = 'x';
+            return 1;
+        },
+        16,
+        4
+    );
+
+    ASSERT_EQ(std::string_view(ahead.next().data(), 1), "x");
+    ASSERT_THROW(ahead.next(), Error);
+}
+
+TEST(ReadAhead, stopsWhenDestroyedEarly)
+{
+    std::atomic<size_t> produced = 0;
+    {
+        ReadAhead ahead(
+            [&](std::span<char> buf) {
+                produced++;
+                return buf.size();
+            },
+            16,
+            2
+        );
+        ASSERT_EQ(ahead.next().size(), 16);
+    }
+    // one chunk consumed, at most all buffers filled once more
+    ASSERT_LE(produced, 3);
+}
+
+}
@@ -0,0 +1,90 @@
+#include "lix/libutil/string-matcher.hh"
+
+#include <gtest/gtest.h>
+#include <random>
+
+namespace nix {
+
+using Matches = std::vector<std::tuple<size_t, size_t, size_t>>;
+
+static Matches findAll(const std::vector<std::string> & patterns, std::string_view text)
+{
+    MultiStringMatcher matcher(patterns);
+    Matches result;
+    size_t pos = 0;
+    while (pos <= text.size()) {
+        auto m = matcher.find(text, pos);
+        if (!m) {
+            break;
+        }
+        result.emplace_back(m->start, m->length, m->pattern);
+        pos = m->start + std::max<size_t>(m->length, 1);
+    }
+    return result;
+}
+
+/* The loop builtins.replaceStrings used before the automaton was added,
+   which defines the expected semantics. */
+static Matches findAllNaive(const std::vector<std::string> & patterns, std::string_view text)
+{
+    Matches result;
+    for (size_t pos = 0; pos <= text.size();) {
+        bool found = false;
+        for (size_t i = 0; i < patterns.size(); i++) {
+            if (text.compare(pos, patterns[i].size(), patterns[i]) == 0) {
+                result.emplace_back(pos, patterns[i].size(), i);
+                pos += std::max<size_t>(patterns[i].size(), 1);
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            pos++;
+        }
+    }
+    return result;
+}
+
+TEST(MultiStringMatcher, noPatterns)
+{
+    ASSERT_EQ(findAll({}, "foo"), Matches{});
+}
+
+TEST(MultiStringMatcher, firstPatternWins)
+{
+    ASSERT_EQ(findAll({"a", "ab"}, "xab"), (Matches{{1, 1, 0}}));
+    ASSERT_EQ(findAll({"ab", "a"}, "xab"), (Matches{{1, 2, 0}}));
+}
+
+TEST(MultiStringMatcher, leftmostWins)
+{
+    ASSERT_EQ(findAll({"bc", "abcd"}, "abcd"), (Matches{{0, 4, 1}}));
+    ASSERT_EQ(findAll({"aa"}, "aaaaa"), (Matches{{0, 2, 0}, {2, 2, 0}}));
+}
+
+TEST(MultiStringMatcher, emptyPattern)
+{
+    ASSERT_EQ(findAll({""}, "ab"), (Matches{{0, 0, 0}, {1, 0, 0}, {2, 0, 0}}));
+    ASSERT_EQ(findAll({"b", "", "a"}, "ab"), (Matches{{0, 0, 1}, {1, 1, 0}, {2, 0, 1}}));
+}
+
+TEST(MultiStringMatcher, matchesNaiveSearch)
+{
+    std::mt19937 random(42);
+    for (int iteration = 0; iteration < 10000; iteration++) {
+        std::vector<std::string> patterns(random() % 5);
+        for (auto & p : patterns) {
+            p.resize(random() % 4);
+            for (auto & c : p) {
+                c = "ab"[random() % 2];
+            }
+        }
+        std::string text(random() % 16, 0);
+        for (auto & c : text) {
+            c = "abc"[random() % 3];
+        }
+        ASSERT_EQ(findAll(patterns, text), findAllNaive(patterns, text)) << text;
+    }
+}
+
+}